@@ -0,0 +1,506 @@
+/*************************************************************************************
+ * frames.c: Saving sequences of rendered frames as images
+ *
+ * Each frame is read back from the current framebuffer into one of a
+ * few pixel buffer objects, which the graphics card fills while the
+ * next frames are drawn. When a buffer comes round again its pixels
+ * are copied out and queued, and a team of threads encodes and writes
+ * them as numbered PNG or PPM files, or as a PPM stream into a command
+ * such as a video encoder. Drawing only waits when the queue is full.
+ *
+ * Copyright (c) 2009 B.Dudson, University of York <bd512@york.ac.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ *************************************************************************************/
+
+/* Needed for the buffer object functions */
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include "frames.h"
+#include "shader.h"
+
+/* Frames being read back by the graphics card at once */
+#define FRAMES_READBACK 3
+
+/* Frames waiting to be saved, per thread saving them */
+#define FRAMES_QUEUE 2
+
+enum FrameFormat {FRAMES_PPM, FRAMES_PNG};
+
+typedef struct {
+  unsigned char *pixels; /* RGB, bottom row first as OpenGL reads them */
+  int frame;             /* Number of the frame, from 0 */
+}TFrame;
+
+static int frame_width, frame_height;
+static int frame_format;
+static char *frame_name = NULL; /* Output file name, numbered for each frame */
+static int frame_digits;
+static FILE *frame_pipe = NULL; /* Command the frames are written into, or NULL */
+static int frame_failed;
+
+static int nadded, nread; /* Frames given to frames_add, and read back so far */
+static int use_pbo;
+static GLuint pbo[FRAMES_READBACK];
+
+/* Frames read back and waiting to be saved are queue[head] onwards,
+   in order. The rest are in free */
+static int nslots;
+static TFrame *slot = NULL;
+static TFrame **queue = NULL, **freeslot = NULL;
+static int qhead, qcount, nfree;
+
+#ifdef HAVE_LIBPTHREAD
+static int nthreads, frames_done;
+static pthread_t *threads = NULL;
+static pthread_mutex_t frames_mutex;
+static pthread_cond_t frames_work, frames_room;
+#endif
+
+/************* Encoding **************/
+
+static int frame_ppm(FILE *fp, TFrame *f)
+{
+  int i;
+  size_t row = 3*frame_width;
+
+  fprintf(fp, "P6\n%d %d\n255\n", frame_width, frame_height);
+  for(i=frame_height-1;i>=0;i--)
+    if(fwrite(f->pixels + i*row, 1, row, fp) != row)
+      return 1;
+  return 0;
+}
+
+#ifdef HAVE_LIBZ
+static void png_put32(unsigned char *b, unsigned long v)
+{
+  b[0] = (v >> 24) & 0xff;
+  b[1] = (v >> 16) & 0xff;
+  b[2] = (v >> 8) & 0xff;
+  b[3] = v & 0xff;
+}
+
+/* Length, type, data and CRC of the type and data */
+static int png_chunk(FILE *fp, const char *type, unsigned char *data, unsigned long len)
+{
+  unsigned char b[4];
+  unsigned long crc;
+
+  crc = crc32(0L, (const Bytef*) type, 4);
+  if(len > 0)
+    crc = crc32(crc, data, len);
+
+  png_put32(b, len);
+  fwrite(b, 1, 4, fp);
+  fwrite(type, 1, 4, fp);
+  if((len > 0) && (fwrite(data, 1, len, fp) != len))
+    return 1;
+  png_put32(b, crc);
+  return fwrite(b, 1, 4, fp) != 4;
+}
+
+static int frame_png(FILE *fp, TFrame *f)
+{
+  static const unsigned char signature[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+  unsigned char ihdr[13], *raw, *data;
+  uLong size;
+  uLongf len;
+  int i, row = 3*frame_width, ret;
+
+  /* Rows go from the top down, each starting with its filter (none) */
+  size = (uLong) (row + 1)*frame_height;
+  len = compressBound(size);
+  raw = (unsigned char*) malloc(size);
+  data = (unsigned char*) malloc(len);
+  if((raw == NULL) || (data == NULL)) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  for(i=0;i<frame_height;i++) {
+    raw[i*(row + 1)] = 0;
+    memcpy(raw + i*(row + 1) + 1, f->pixels + (frame_height-1-i)*row, row);
+  }
+  ret = compress2(data, &len, raw, size, Z_DEFAULT_COMPRESSION) != Z_OK;
+  free(raw);
+
+  /* 8 bit RGB, not interlaced */
+  png_put32(ihdr, frame_width);
+  png_put32(ihdr + 4, frame_height);
+  ihdr[8] = 8;
+  ihdr[9] = 2;
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+  if(!ret) {
+    ret = fwrite(signature, 1, 8, fp) != 8;
+    ret |= png_chunk(fp, "IHDR", ihdr, 13);
+    ret |= png_chunk(fp, "IDAT", data, len);
+    ret |= png_chunk(fp, "IEND", NULL, 0);
+  }
+  free(data);
+  return ret;
+}
+#endif /* HAVE_LIBZ */
+
+/* Write out a frame. Returns 0 on success */
+static int frame_save(TFrame *f)
+{
+  char *file, *ext;
+  FILE *fp;
+  int n, ret;
+
+  if(frame_pipe != NULL)
+    return frame_ppm(frame_pipe, f);
+
+  /* e.g. out.png becomes out_0001.png */
+  if((ext = strrchr(frame_name, '.')) == NULL)
+    ext = frame_name + strlen(frame_name);
+  n = (int) (ext - frame_name);
+  file = (char*) malloc(strlen(frame_name) + frame_digits + 16);
+  if(file == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  sprintf(file, "%.*s_%0*d%s", n, frame_name, frame_digits, f->frame+1, ext);
+
+  if((fp = fopen(file, "wb")) == NULL) {
+    fprintf(stderr, "Error: Unable to open file %s for writing\n", file);
+    free(file);
+    return 1;
+  }
+#ifdef HAVE_LIBZ
+  if(frame_format == FRAMES_PNG)
+    ret = frame_png(fp, f);
+  else
+#endif
+    ret = frame_ppm(fp, f);
+  ret |= fclose(fp) != 0;
+  if(ret)
+    fprintf(stderr, "Error: Couldn't write %s\n", file);
+  free(file);
+  return ret;
+}
+
+/************* Queue **************/
+
+#ifdef HAVE_LIBPTHREAD
+static void *frame_worker(void *data)
+{
+  TFrame *f;
+  int ret;
+
+  (void) data;
+
+  for(;;) {
+    pthread_mutex_lock(&frames_mutex);
+    while((qcount == 0) && !frames_done)
+      pthread_cond_wait(&frames_work, &frames_mutex);
+    if(qcount == 0) {
+      pthread_mutex_unlock(&frames_mutex);
+      break;
+    }
+    f = queue[qhead];
+    qhead = (qhead + 1) % nslots;
+    qcount--;
+    pthread_mutex_unlock(&frames_mutex);
+
+    ret = frame_save(f);
+
+    pthread_mutex_lock(&frames_mutex);
+    if(ret)
+      frame_failed = 1;
+    freeslot[nfree++] = f;
+    pthread_cond_signal(&frames_room);
+    pthread_mutex_unlock(&frames_mutex);
+  }
+  return NULL;
+}
+#endif
+
+/* A frame to copy pixels into, waiting for one to be saved if need be */
+static TFrame *frame_get()
+{
+  TFrame *f;
+
+#ifdef HAVE_LIBPTHREAD
+  pthread_mutex_lock(&frames_mutex);
+  while(nfree == 0)
+    pthread_cond_wait(&frames_room, &frames_mutex);
+#endif
+  f = freeslot[--nfree];
+#ifdef HAVE_LIBPTHREAD
+  pthread_mutex_unlock(&frames_mutex);
+#endif
+  return f;
+}
+
+/* Queue a frame to be saved, or save it now without threads */
+static void frame_put(TFrame *f)
+{
+#ifdef HAVE_LIBPTHREAD
+  pthread_mutex_lock(&frames_mutex);
+  queue[(qhead + qcount) % nslots] = f;
+  qcount++;
+  pthread_cond_signal(&frames_work);
+  pthread_mutex_unlock(&frames_mutex);
+#else
+  if(frame_save(f))
+    frame_failed = 1;
+  freeslot[nfree++] = f;
+#endif
+}
+
+/* Copy out the oldest frame being read back, and queue it */
+static void frame_collect()
+{
+  TFrame *f;
+  void *p;
+
+  f = frame_get();
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[nread % FRAMES_READBACK]);
+  p = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+  if(p != NULL) {
+    memcpy(f->pixels, p, 3*frame_width*frame_height);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }else
+    memset(f->pixels, 0, 3*frame_width*frame_height);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  f->frame = nread++;
+  frame_put(f);
+}
+
+/************* Interface **************/
+
+/* Start saving nframes frames of width x height pixels. These go to
+   files numbered from outfile, which ends in .png or .ppm, or if
+   command is not NULL into its standard input as a stream of PPM
+   images. nthreads encode and write them (0 = one per processor).
+   Needs a current OpenGL context. Returns 0 on success */
+int frames_begin(char *outfile, char *command, int width, int height, int nframes, int threads_wanted)
+{
+  char *ext;
+  int i;
+
+  frame_width = width;
+  frame_height = height;
+  frame_failed = 0;
+  nadded = nread = 0;
+  frame_pipe = NULL;
+
+  if(command != NULL) {
+    frame_format = FRAMES_PPM;
+    /* A command which exits early shouldn't kill us */
+    signal(SIGPIPE, SIG_IGN);
+    if((frame_pipe = popen(command, "w")) == NULL) {
+      fprintf(stderr, "Error: Couldn't run '%s'\n", command);
+      return 1;
+    }
+  }else {
+    ext = strrchr(outfile, '.');
+    if((ext != NULL) && (strcasecmp(ext, ".png") == 0)) {
+#ifndef HAVE_LIBZ
+      fprintf(stderr, "Error: Compiled without zlib, so frames can only be saved as .ppm\n");
+      return 1;
+#endif
+      frame_format = FRAMES_PNG;
+    }else if((ext != NULL) && (strcasecmp(ext, ".ppm") == 0))
+      frame_format = FRAMES_PPM;
+    else {
+      fprintf(stderr, "Error: Frames are saved as .png or .ppm files\n");
+      return 1;
+    }
+  }
+
+  frame_name = (char*) malloc(strlen(outfile) + 1);
+  if(frame_name == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  strcpy(frame_name, outfile);
+  for(frame_digits=1,i=nframes;i>=10;i/=10)
+    frame_digits++;
+  if(frame_digits < 4)
+    frame_digits = 4;
+
+#ifdef HAVE_LIBPTHREAD
+  nthreads = threads_wanted;
+#ifdef _SC_NPROCESSORS_ONLN
+  if(nthreads <= 0)
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  /* A stream has to be written in order */
+  if((nthreads < 1) || (frame_pipe != NULL))
+    nthreads = 1;
+  nslots = FRAMES_QUEUE*nthreads + 1;
+#else
+  (void) threads_wanted;
+  nslots = 1;
+#endif
+
+  slot = (TFrame*) malloc(sizeof(TFrame)*nslots);
+  queue = (TFrame**) malloc(sizeof(TFrame*)*nslots);
+  freeslot = (TFrame**) malloc(sizeof(TFrame*)*nslots);
+  if((slot == NULL) || (queue == NULL) || (freeslot == NULL)) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  for(i=0;i<nslots;i++) {
+    slot[i].pixels = (unsigned char*) malloc(3*width*height);
+    if(slot[i].pixels == NULL) {
+      fprintf(stderr, "Error: Memory allocation failed\n");
+      exit(1);
+    }
+    freeslot[i] = &slot[i];
+  }
+  nfree = nslots;
+  qhead = qcount = 0;
+
+  /* Read back without waiting for the drawing to finish, if possible */
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  use_pbo = shader_supported(2, 1, NULL);
+  if(use_pbo) {
+    glGenBuffers(FRAMES_READBACK, pbo);
+    for(i=0;i<FRAMES_READBACK;i++) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+      glBufferData(GL_PIXEL_PACK_BUFFER, 3*width*height, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+#ifdef HAVE_LIBPTHREAD
+  frames_done = 0;
+  pthread_mutex_init(&frames_mutex, NULL);
+  pthread_cond_init(&frames_work, NULL);
+  pthread_cond_init(&frames_room, NULL);
+  threads = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+  if(threads == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  for(i=0;i<nthreads;i++)
+    if(pthread_create(&threads[i], NULL, frame_worker, NULL))
+      break;
+  if(i == 0) {
+    fprintf(stderr, "Error: Couldn't start threads to save frames\n");
+    nthreads = 0;
+    frames_end();
+    return 1;
+  }
+  nthreads = i;
+#endif
+
+  return 0;
+}
+
+/* Read back the frame just drawn, to be saved in the background.
+   Returns non-zero once saving a frame has failed */
+int frames_add()
+{
+  TFrame *f;
+  int ret;
+
+  if(use_pbo) {
+    /* The oldest buffer is needed again */
+    if(nadded - nread == FRAMES_READBACK)
+      frame_collect();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[nadded % FRAMES_READBACK]);
+    glReadPixels(0, 0, frame_width, frame_height, GL_RGB, GL_UNSIGNED_BYTE, (GLvoid*) 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    nadded++;
+  }else {
+    f = frame_get();
+    glReadPixels(0, 0, frame_width, frame_height, GL_RGB, GL_UNSIGNED_BYTE, f->pixels);
+    f->frame = nread++;
+    nadded++;
+    frame_put(f);
+  }
+
+#ifdef HAVE_LIBPTHREAD
+  pthread_mutex_lock(&frames_mutex);
+#endif
+  ret = frame_failed;
+#ifdef HAVE_LIBPTHREAD
+  pthread_mutex_unlock(&frames_mutex);
+#endif
+  return ret;
+}
+
+/* Save the frames still being read back or queued, and clean up.
+   Returns 0 if every frame was saved */
+int frames_end()
+{
+  int i;
+
+  while(nread < nadded)
+    frame_collect();
+
+#ifdef HAVE_LIBPTHREAD
+  pthread_mutex_lock(&frames_mutex);
+  frames_done = 1;
+  pthread_cond_broadcast(&frames_work);
+  pthread_mutex_unlock(&frames_mutex);
+  for(i=0;i<nthreads;i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  threads = NULL;
+  pthread_cond_destroy(&frames_room);
+  pthread_cond_destroy(&frames_work);
+  pthread_mutex_destroy(&frames_mutex);
+#endif
+
+  if(frame_pipe != NULL) {
+    if(pclose(frame_pipe) != 0) {
+      fprintf(stderr, "Error: Command the frames were written to failed\n");
+      frame_failed = 1;
+    }
+    frame_pipe = NULL;
+  }
+
+  if(use_pbo)
+    glDeleteBuffers(FRAMES_READBACK, pbo);
+  for(i=0;i<nslots;i++)
+    free(slot[i].pixels);
+  free(slot);
+  free(queue);
+  free(freeslot);
+  free(frame_name);
+  slot = NULL;
+  queue = freeslot = NULL;
+  frame_name = NULL;
+
+  return frame_failed;
+}
@@ -0,0 +1,12 @@
+/*****************************************************************
+ * Saving sequences of rendered frames as images
+ *****************************************************************/
+
+#ifndef __FRAMES_H__
+#define __FRAMES_H__
+
+int frames_begin(char *outfile, char *command, int width, int height, int nframes, int nthreads);
+int frames_add();
+int frames_end();
+
+#endif /* __FRAMES_H__ */
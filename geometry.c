@@ -0,0 +1,2416 @@
+/*************************************************************************************
+ * geometry.c: Tessellate model items once into cached vertex arrays
+ *
+ * Each item in the model is converted into an array of interleaved
+ * vertices when the model is loaded. Surfaces only store their cross-section,
+ * which is swept around the axis as an indexed mesh when drawn, so
+ * each vertex is transformed once. These are uploaded to vertex
+ * buffer objects the first time they're drawn, so moving the camera
+ * only needs to re-issue the draw calls.
+ *
+ * Surfaces and field-lines also keep coarser versions of themselves,
+ * made by dropping vertices, and each frame draws the coarsest one
+ * which is within a given number of pixels of the full resolution.
+ *
+ * The triangles of transparent surfaces are also collected together
+ * and sorted back to front, so they can be blended in the right order.
+ *
+ * Copyright (c) 2009 B.Dudson, University of York <bd512@york.ac.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ *************************************************************************************/
+
+/* Needed for the buffer object functions */
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <complex.h>
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "geometry.h"
+#include "shader.h"
+
+/* Field-lines are traced with steps no longer than LINE_MAX_STEP in
+   toroidal angle, and no segment more than LINE_TOLERANCE (relative to
+   the size of the surface) from the curve. Each step's error in
+   poloidal angle is kept below LINE_THETA_TOLERANCE */
+#define LINE_MAX_STEP (2.0*PI/16.0)
+#define LINE_TOLERANCE 1.0e-3
+#define LINE_THETA_TOLERANCE 1.0e-7
+
+/* Number of shapes to remember field-line integrals for */
+#define SHAPE_CACHE_SIZE 32
+
+/* Width (in quads) of the bands a grid is drawn in. The last row of
+   a band is 9 vertices, so is still in the post-transform vertex cache
+   when the next row uses it */
+#define GRID_BAND 8
+
+/* Size (in quads) of the square patches a grid is split into, each
+   skipped as a whole when out of view */
+#define PATCH_SIZE 16
+
+/* Most element moves allowed per triangle when updating the order of
+   transparent triangles, before giving up and sorting from scratch */
+#define BLEND_MOVES 2
+
+/* Most coarser levels of detail per item, and the fewest segments
+   along a strip or across a surface a level can have */
+#define LOD_MAX 6
+#define LOD_MIN_SEGMENTS 8
+
+/* Roughly how many vertices each task works on when building */
+#define BUILD_CHUNK 16384
+
+float qromb(float (*func)(float, void*), float a, float b, void *params);
+float trapzd(float (*func)(float, void*), float a, float b, int n, void *p, float s);
+void polint(float *xa, float *ya, float x, float *y, float *dy);
+
+/************* Memory handling **************/
+
+/* Allocate vertex and strip arrays for an item */
+static void geom_alloc(TGeomItem *g, GLenum mode, int nverts, int nstrips)
+{
+  g->mode = mode;
+  g->nverts = nverts;
+  g->nstrips = nstrips;
+  g->vbo = 0;
+
+  g->vert = NULL;
+  g->first = NULL;
+  g->count = NULL;
+
+  g->blend = 0;
+  g->base = -1;
+  g->ninstances = 0;
+  g->instance = NULL;
+  g->rows = g->cols = 0;
+  g->wraprows = g->wrapcols = 0;
+  g->sweep = NULL;
+  g->sweepstep = g->sweepend = 0.0;
+  g->sweepvbo = 0;
+  g->nindices = 0;
+  g->ibo = 0;
+  g->npatches = 0;
+  g->patch = NULL;
+
+  g->error = 0.0;
+  g->nlod = 0;
+  g->lod = NULL;
+  g->ring = g->extent = 0.0;
+
+  if(nverts > 0)
+    g->vert = (TVertex*) malloc(sizeof(TVertex)*nverts);
+  if(nstrips > 0) {
+    g->first = (GLint*) malloc(sizeof(GLint)*nstrips);
+    g->count = (GLsizei*) malloc(sizeof(GLsizei)*nstrips);
+  }
+
+  if( ((nverts > 0) && (g->vert == NULL)) ||
+      ((nstrips > 0) && ((g->first == NULL) || (g->count == NULL))) ) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+}
+
+static void geom_item_free(TGeomItem *g)
+{
+  int i;
+
+  for(i=0;i<g->nlod;i++) {
+    g->lod[i].instance = NULL; /* Shared with g */
+    geom_item_free(&g->lod[i]);
+  }
+  free(g->lod);
+  g->lod = NULL;
+  g->nlod = 0;
+
+  if(g->vbo != 0)
+    glDeleteBuffers(1, &g->vbo);
+  if(g->ibo != 0)
+    glDeleteBuffers(1, &g->ibo);
+  if(g->sweepvbo != 0)
+    glDeleteBuffers(1, &g->sweepvbo);
+  g->vbo = g->ibo = g->sweepvbo = 0;
+
+  free(g->vert);
+  free(g->first);
+  free(g->count);
+  free(g->sweep);
+  free(g->patch);
+  free(g->instance);
+  g->instance = NULL;
+  g->ninstances = 0;
+  g->vert = NULL;
+  g->first = NULL;
+  g->count = NULL;
+  g->sweep = NULL;
+  g->patch = NULL;
+  g->nverts = g->nstrips = g->nindices = g->npatches = 0;
+}
+
+/* Vertex (i, j) of a grid, where i can be rows and j can be cols if
+   the grid wraps around */
+void geom_grid_vertex(TGeomItem *g, int i, int j, TVertex *out)
+{
+  float c, s;
+
+  if(i == g->rows)
+    i = 0;
+  if(j == g->cols)
+    j = 0;
+  *out = g->vert[i];
+  c = g->sweep[j];
+  s = g->sweep[g->cols + j];
+  out->x = c*g->vert[i].x - s*g->vert[i].z;
+  out->z = s*g->vert[i].x + c*g->vert[i].z;
+}
+
+/* Range of quads [i0, i1) x [j0, j1) in patch k of a grid */
+static void patch_quads(TGeomItem *g, int k, int *i0, int *i1, int *j0, int *j1)
+{
+  int nr, nc, npc;
+
+  nr = g->rows + g->wraprows - 1;
+  nc = g->cols + g->wrapcols - 1;
+  npc = (nc + PATCH_SIZE-1)/PATCH_SIZE;
+
+  *i0 = (k / npc)*PATCH_SIZE;
+  *j0 = (k % npc)*PATCH_SIZE;
+  *i1 = (*i0 + PATCH_SIZE < nr) ? *i0 + PATCH_SIZE : nr;
+  *j1 = (*j0 + PATCH_SIZE < nc) ? *j0 + PATCH_SIZE : nc;
+}
+
+/* Allocate a mesh for a rows x cols grid of vertices, split into
+   patches of PATCH_SIZE x PATCH_SIZE quads. The cross-section and
+   column angles are filled in later by the caller */
+static void geom_grid(TGeomItem *g, int rows, int cols, int wraprows, int wrapcols)
+{
+  int nr, nc, i, i0, i1, j0, j1, n;
+
+  geom_alloc(g, GL_TRIANGLES, rows, 0);
+  g->rows = rows;
+  g->cols = cols;
+  g->wraprows = wraprows;
+  g->wrapcols = wrapcols;
+  g->sweep = (float*) malloc(sizeof(float)*2*(cols > 0 ? cols : 1));
+  if(g->sweep == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+
+  /* Quads in each direction */
+  nr = rows + (wraprows ? 0 : -1);
+  nc = cols + (wrapcols ? 0 : -1);
+  if((nr <= 0) || (nc <= 0))
+    return;
+
+  g->nindices = 6*nr*nc;
+  g->npatches = ((nr + PATCH_SIZE-1)/PATCH_SIZE) * ((nc + PATCH_SIZE-1)/PATCH_SIZE);
+  g->patch = (TGeomPatch*) calloc(g->npatches, sizeof(TGeomPatch));
+  if(g->patch == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+
+  n = 0;
+  for(i=0;i<g->npatches;i++) {
+    patch_quads(g, i, &i0, &i1, &j0, &j1);
+    g->patch[i].first = n;
+    g->patch[i].count = 6*(i1 - i0)*(j1 - j0);
+    n += g->patch[i].count;
+  }
+}
+
+/* Fill in the nindices indices of patches k0 to k1-1 of a grid. The
+   quads are split into two triangles in the same way as a quad strip.
+   Within each patch they go in bands GRID_BAND quads wide so that
+   vertices are reused while still in the vertex cache */
+static void grid_indices(TGeomItem *g, GLuint *index, int k0, int k1)
+{
+  int i, j, k, i0, i1, j0, j1, b0, b1, n;
+  int rows = g->rows, cols = g->cols;
+  GLuint a, b, c, d;
+
+  for(k=k0;k<k1;k++) {
+    patch_quads(g, k, &i0, &i1, &j0, &j1);
+    n = g->patch[k].first;
+    for(b0=j0;b0<j1;b0+=GRID_BAND) {
+      b1 = (b0 + GRID_BAND < j1) ? b0 + GRID_BAND : j1;
+      for(i=i0;i<i1;i++)
+	for(j=b0;j<b1;j++) {
+	  a = i*cols + j;
+	  b = ((i+1) % rows)*cols + j;
+	  c = ((i+1) % rows)*cols + (j+1) % cols;
+	  d = i*cols + (j+1) % cols;
+	  index[n++] = a; index[n++] = b; index[n++] = c;
+	  index[n++] = a; index[n++] = c; index[n++] = d;
+	}
+    }
+  }
+}
+
+/* Unit normals of the two triangles of quad (i, j) of a grid, which
+   is split as a quad strip: a, b, c and a, c, d. Zero if degenerate */
+static void quad_normals(TGeomItem *g, int i, int j, float n[2][3])
+{
+  TVertex p[4];
+  float e[3], f[3], len;
+  int t, l;
+
+  geom_grid_vertex(g, i, j, &p[0]);
+  geom_grid_vertex(g, i+1, j, &p[1]);
+  geom_grid_vertex(g, i+1, j+1, &p[2]);
+  geom_grid_vertex(g, i, j+1, &p[3]);
+
+  for(t=0;t<2;t++) {
+    e[0] = p[t+1].x - p[0].x; e[1] = p[t+1].y - p[0].y; e[2] = p[t+1].z - p[0].z;
+    f[0] = p[t+2].x - p[0].x; f[1] = p[t+2].y - p[0].y; f[2] = p[t+2].z - p[0].z;
+    n[t][0] = e[1]*f[2] - e[2]*f[1];
+    n[t][1] = e[2]*f[0] - e[0]*f[2];
+    n[t][2] = e[0]*f[1] - e[1]*f[0];
+    len = sqrt(n[t][0]*n[t][0] + n[t][1]*n[t][1] + n[t][2]*n[t][2]);
+    for(l=0;l<3;l++)
+      n[t][l] = (len > 0.0) ? n[t][l] / len : 0.0;
+  }
+}
+
+/* Work out the bounding sphere and normal cone of patches k0 to k1-1
+   of a grid, once its vertices are set. The normals may point in or
+   out until patch_orient is called */
+static void patch_bounds(TGeomItem *g, int k0, int k1)
+{
+  int i, j, k, l, t, i0, i1, j0, j1;
+  float lo[3], hi[3], n[2][3], e[3], len, d, *x;
+  TVertex v;
+  TGeomPatch *patch;
+
+  for(k=k0;k<k1;k++) {
+    patch = &g->patch[k];
+    patch_quads(g, k, &i0, &i1, &j0, &j1);
+
+    /* Box around the vertices, then a sphere around the box centre */
+    geom_grid_vertex(g, i0, j0, &v);
+    x = &v.x;
+    for(l=0;l<3;l++)
+      lo[l] = hi[l] = x[l];
+    for(i=i0;i<=i1;i++)
+      for(j=j0;j<=j1;j++) {
+	geom_grid_vertex(g, i, j, &v);
+	for(l=0;l<3;l++) {
+	  if(x[l] < lo[l])
+	    lo[l] = x[l];
+	  if(x[l] > hi[l])
+	    hi[l] = x[l];
+	}
+      }
+    for(l=0;l<3;l++)
+      patch->centre[l] = 0.5*(lo[l] + hi[l]);
+    patch->radius = 0.0;
+    for(i=i0;i<=i1;i++)
+      for(j=j0;j<=j1;j++) {
+	geom_grid_vertex(g, i, j, &v);
+	for(l=0;l<3;l++)
+	  e[l] = x[l] - patch->centre[l];
+	d = sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+	if(d > patch->radius)
+	  patch->radius = d;
+      }
+
+    /* Average of the triangle normals, then the widest angle from it */
+    patch->axis[0] = patch->axis[1] = patch->axis[2] = 0.0;
+    for(i=i0;i<i1;i++)
+      for(j=j0;j<j1;j++) {
+	quad_normals(g, i, j, n);
+	for(t=0;t<2;t++)
+	  for(l=0;l<3;l++)
+	    patch->axis[l] += n[t][l];
+      }
+    len = sqrt(patch->axis[0]*patch->axis[0] + patch->axis[1]*patch->axis[1] +
+	       patch->axis[2]*patch->axis[2]);
+    patch->cosa = 0.0;
+    if(len > 0.0) {
+      for(l=0;l<3;l++)
+	patch->axis[l] /= len;
+      patch->cosa = 1.0;
+      for(i=i0;i<i1;i++)
+	for(j=j0;j<j1;j++) {
+	  quad_normals(g, i, j, n);
+	  for(t=0;t<2;t++) {
+	    d = n[t][0]*patch->axis[0] + n[t][1]*patch->axis[1] + n[t][2]*patch->axis[2];
+	    if((n[t][0] != 0.0) || (n[t][1] != 0.0) || (n[t][2] != 0.0))
+	      if(d < patch->cosa)
+		patch->cosa = d;
+	  }
+	}
+    }
+
+    if(patch->cosa <= 0.0) {
+      /* Normals all over the place, so can't be facing away */
+      patch->cosa = 0.0;
+      patch->sina = 1.0;
+    }else
+      patch->sina = sqrt(1.0 - patch->cosa*patch->cosa);
+  }
+}
+
+/* Make the patch normals of a grid point away from the circle of
+   radius ring about the y axis */
+static void patch_orient(TGeomItem *g, float ring)
+{
+  int k, l;
+  double orient, rho;
+  TGeomPatch *patch;
+
+  orient = 0.0;
+  for(k=0;k<g->npatches;k++) {
+    patch = &g->patch[k];
+    rho = sqrt(patch->centre[0]*patch->centre[0] + patch->centre[2]*patch->centre[2]);
+    if(rho > 0.0)
+      orient += patch->axis[0]*patch->centre[0]*(1.0 - ring/rho) +
+	patch->axis[1]*patch->centre[1] + patch->axis[2]*patch->centre[2]*(1.0 - ring/rho);
+  }
+  if(orient >= 0.0)
+    return;
+  for(k=0;k<g->npatches;k++)
+    for(l=0;l<3;l++)
+      g->patch[k].axis[l] = -g->patch[k].axis[l];
+}
+
+static void set_vertex(TVertex *v, float x, float y, float z, TColor *color, float alpha)
+{
+  v->x = x;
+  v->y = y;
+  v->z = z;
+  v->r = color->r;
+  v->g = color->g;
+  v->b = color->b;
+  v->a = alpha;
+}
+
+/* Allocate n floats of scratch space */
+static float *float_alloc(int n)
+{
+  float *p;
+
+  p = (float*) malloc(sizeof(float)*(n > 0 ? n : 1));
+  if(p == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  return p;
+}
+
+/* Cosine and sine of x0 + i*dx for i = 0..n-1. Angles are worked out
+   from i rather than accumulated, so long tables don't drift */
+static void trig_table(float *c, float *s, int n, double x0, double dx)
+{
+  int i;
+  double x;
+
+  for(i=0;i<n;i++) {
+    x = x0 + i*dx;
+    c[i] = cos(x);
+    s[i] = sin(x);
+  }
+}
+
+/************* Building in parallel **************/
+
+/* A piece of work on one item, covering rows or patches start to
+   end-1. Tasks queued together each write to their own part of the
+   item, so can be done in any order */
+typedef struct _TBuildTask {
+  void (*run)(struct _TBuildTask *task);
+  TGeomItem *g;
+  TGeomItem *src;   /* Full resolution item, for levels of detail */
+  int start, end;
+  int *ind;         /* Rows then columns of src kept, for levels of detail */
+  float error;      /* Furthest any vertex of src is from g, found by the task */
+}TBuildTask;
+
+typedef struct {
+  int ntasks, size, next;
+  TBuildTask *task;
+
+  int nscratch;
+  void **scratch;   /* Tables to free once everything is built */
+#ifdef HAVE_LIBPTHREAD
+  pthread_mutex_t mutex;
+#endif
+}TBuildJobs;
+
+static int build_threads = 0; /* 0 = one per processor */
+
+/* Set how many threads geom_build uses (0 = one per processor) */
+void geom_set_threads(int nthreads)
+{
+  build_threads = (nthreads < 0) ? 0 : nthreads;
+}
+
+/* Queue copies of task for units 0 to n-1 (rows or patches),
+   each of about size vertices, in pieces of about BUILD_CHUNK vertices */
+static void build_add(TBuildJobs *jobs, TBuildTask *task, int n, int size)
+{
+  int i, per;
+
+  per = (size > 0) ? BUILD_CHUNK / size : n;
+  if(per < 1)
+    per = 1;
+  for(i=0;i<n;i+=per) {
+    if(jobs->ntasks == jobs->size) {
+      jobs->size = (jobs->size > 0) ? 2*jobs->size : 64;
+      jobs->task = (TBuildTask*) realloc(jobs->task, sizeof(TBuildTask)*jobs->size);
+      if(jobs->task == NULL) {
+	fprintf(stderr, "Error: Memory allocation failed\n");
+	exit(1);
+      }
+    }
+    jobs->task[jobs->ntasks] = *task;
+    jobs->task[jobs->ntasks].start = i;
+    jobs->task[jobs->ntasks].end = (i + per < n) ? i + per : n;
+    jobs->task[jobs->ntasks].error = 0.0;
+    jobs->ntasks++;
+  }
+}
+
+/* Remember a table to free at the end of the build */
+static void build_scratch(TBuildJobs *jobs, void *p)
+{
+  jobs->scratch = (void**) realloc(jobs->scratch, sizeof(void*)*(jobs->nscratch + 1));
+  if(jobs->scratch == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  jobs->scratch[jobs->nscratch++] = p;
+}
+
+static void *build_worker(void *data)
+{
+  TBuildJobs *jobs = (TBuildJobs*) data;
+  int i;
+
+  for(;;) {
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_lock(&jobs->mutex);
+#endif
+    i = jobs->next++;
+#ifdef HAVE_LIBPTHREAD
+    pthread_mutex_unlock(&jobs->mutex);
+#endif
+    if(i >= jobs->ntasks)
+      break;
+    jobs->task[i].run(&jobs->task[i]);
+  }
+  return NULL;
+}
+
+/* Do all the queued tasks, with a team of threads if there are several,
+   then empty the queue */
+static void build_run(TBuildJobs *jobs)
+{
+  int i;
+#ifdef HAVE_LIBPTHREAD
+  int n, nthreads;
+  pthread_t *threads;
+#endif
+
+  jobs->next = 0;
+#ifdef HAVE_LIBPTHREAD
+  nthreads = build_threads;
+#ifdef _SC_NPROCESSORS_ONLN
+  if(nthreads <= 0)
+    nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(nthreads > jobs->ntasks)
+    nthreads = jobs->ntasks;
+  if(nthreads > 1) {
+    pthread_mutex_init(&jobs->mutex, NULL);
+    threads = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    if(threads == NULL) {
+      fprintf(stderr, "Error: Memory allocation failed\n");
+      exit(1);
+    }
+    /* This thread is one of the team */
+    for(n=1;n<nthreads;n++)
+      if(pthread_create(&threads[n], NULL, build_worker, jobs))
+	break;
+    build_worker(jobs);
+    for(i=1;i<n;i++)
+      pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&jobs->mutex);
+  }else
+#endif
+    build_worker(jobs);
+
+  for(i=0;i<jobs->ntasks;i++)
+    if(jobs->task[i].error > jobs->task[i].g->error)
+      jobs->task[i].g->error = jobs->task[i].error;
+  jobs->ntasks = 0;
+}
+
+static void task_patch_bounds(TBuildTask *task)
+{
+  patch_bounds(task->g, task->start, task->end);
+}
+
+/* Queue working out the bounds of the patches of a grid */
+static void build_patch_bounds(TBuildJobs *jobs, TGeomItem *g)
+{
+  TBuildTask task;
+
+  memset(&task, 0, sizeof(TBuildTask));
+  task.run = task_patch_bounds;
+  task.g = g;
+  build_add(jobs, &task, g->npatches, PATCH_SIZE*PATCH_SIZE);
+}
+
+/************* Tessellation **************/
+
+static void tess_planes(TGeomItem *g, int n, float major, float minor, TColor *color)
+{
+  int i;
+  float z, dz, cz, sz;
+  float r1, r2, x1, y1, x2, y2;
+  TVertex *v;
+
+  if(n < 0)
+    n = 0;
+  geom_alloc(g, GL_QUADS, 4*n, 1);
+  g->first[0] = 0;
+  g->count[0] = 4*n;
+
+  dz = 2.0*PI / ((float) n);
+
+  r1 = major - minor;
+  r2 = major + minor;
+
+  v = g->vert;
+  for(z=0.0,i=0;i<n;i++) {
+    cz = cos(z);
+    sz = sin(z);
+
+    x1 = r1 * cz;
+    y1 = r1 * sz;
+    x2 = r2 * cz;
+    y2 = r2 * sz;
+
+    set_vertex(v++, x1, -1.0*minor, y1, color, color->alpha);
+    set_vertex(v++, x1, minor, y1, color, color->alpha);
+    set_vertex(v++, x2, minor, y2, color, color->alpha);
+    set_vertex(v++, x2, -1.0*minor, y2, color, color->alpha);
+
+    z += dz;
+  }
+}
+
+float shapefunc(float theta, void *data)
+{
+  float *vals;
+  float R, a, b;
+  float ct;
+
+  vals = (float*) data;
+  R = vals[0];
+  a = vals[1];
+  b = vals[2];
+
+  ct = cos(theta);
+  return(1.0 / (a*ct - b*ct*ct + R) );
+}
+
+/* Closed form of the integral of shapefunc from 0 to 2pi.
+   Writing c = cos(theta), the denominator -b c^2 + a c + R has roots c1, c2
+   and partial fractions reduce this to integrals of 1/(c0 - cos(theta)),
+   which are 2pi / sqrt(c0^2 - 1) for any c0 off the interval [-1,1].
+   Returns 1 if the surface is degenerate (r = 0 somewhere) */
+static int shape_integral_exact(double R, double a, double b, double *result)
+{
+  double complex disc, c1, c2, f1, f2;
+  double d;
+
+  if(fabs(b) < 1.0e-10*(fabs(a) + fabs(R))) {
+    /* Unshaped circular cross-section */
+    d = R*R - a*a;
+    if((d <= 0.0) || (R <= 0.0))
+      return 1;
+    *result = 2.0*PI / sqrt(d);
+    return 0;
+  }
+
+  disc = csqrt(a*a + 4.0*b*R + 0.0*I);
+  c1 = (a + disc) / (2.0*b);
+  c2 = (a - disc) / (2.0*b);
+
+  /* Check that neither root is on the interval [-1,1] */
+  if( (fabs(cimag(c1)) < 1.0e-12) && (fabs(creal(c1)) <= 1.0) )
+    return 1;
+  if( (fabs(cimag(c2)) < 1.0e-12) && (fabs(creal(c2)) <= 1.0) )
+    return 1;
+
+  f1 = 2.0*PI / (c1 * csqrt(1.0 - 1.0/(c1*c1)));
+  f2 = 2.0*PI / (c2 * csqrt(1.0 - 1.0/(c2*c2)));
+
+  *result = creal( (f1 - f2) / (b*(c1 - c2)) );
+  if(*result <= 0.0)
+    return 1; /* r changes sign */
+  return 0;
+}
+
+/* Integrals of shapefunc already worked out during one build. Each
+   build has its own, used only by its serial tessellation loop */
+typedef struct {
+  struct {
+    float R, a, b;
+    float value;
+  }entry[SHAPE_CACHE_SIZE];
+  int n, next;      /* Entries in use, and the oldest to be replaced */
+}TShapeCache;
+
+/* Integral of shapefunc over a full poloidal turn, remembered in cache
+   for each (R, a, b) shape so that every surface with the same shape
+   only works it out once */
+static float shape_integral(TShapeCache *cache, float R, float a, float b)
+{
+  int i;
+  float vals[3];
+  double val;
+
+  for(i=0;i<cache->n;i++)
+    if((cache->entry[i].R == R) && (cache->entry[i].a == a) && (cache->entry[i].b == b))
+      return cache->entry[i].value;
+
+  if(shape_integral_exact(R, a, b, &val)) {
+    /* Fall back to numerical integration */
+    vals[0] = R;
+    vals[1] = a;
+    vals[2] = b;
+    val = qromb(shapefunc, 0.0, 2.0*PI, (void*) vals);
+  }
+
+  /* Replace the oldest entry */
+  cache->entry[cache->next].R = R;
+  cache->entry[cache->next].a = a;
+  cache->entry[cache->next].b = b;
+  cache->entry[cache->next].value = val;
+  cache->next = (cache->next + 1) % SHAPE_CACHE_SIZE;
+  if(cache->n < SHAPE_CACHE_SIZE)
+    cache->n++;
+
+  return val;
+}
+
+/* Field-line on a shaped surface: d theta / d phi = -r(theta) / alpha */
+typedef struct {
+  double R, a, b, e;
+  double alpha;
+}TShapeLine;
+
+static double shapeline_slope(TShapeLine *l, double theta)
+{
+  double ct = cos(theta);
+  return -(l->a*ct - l->b*ct*ct + l->R) / l->alpha;
+}
+
+/* One fourth-order Runge-Kutta step of h in toroidal angle */
+static double shapeline_rk4(TShapeLine *l, double theta, double h)
+{
+  double k1, k2, k3, k4;
+
+  k1 = shapeline_slope(l, theta);
+  k2 = shapeline_slope(l, theta + 0.5*h*k1);
+  k3 = shapeline_slope(l, theta + 0.5*h*k2);
+  k4 = shapeline_slope(l, theta + h*k3);
+  return theta + h*(k1 + 2.0*k2 + 2.0*k3 + k4)/6.0;
+}
+
+static void shapeline_point(TShapeLine *l, double phi, double theta, double p[3])
+{
+  double ct = cos(theta);
+  double r = l->a*ct - l->b*ct*ct + l->R;
+
+  p[0] = r*cos(phi);
+  p[1] = r*sin(phi);
+  p[2] = l->a*(1.0 + l->e)*sin(theta);
+}
+
+/* Trace a m/n fieldline on a shaped flux-surface with elongation e and triangularity k,
+   starting at toroidal angle 0, for n toroidal turns until it closes.
+   Returns an array of x then y then z, np of each.
+
+   The poloidal angle is integrated with Runge-Kutta steps, each checked
+   against two half steps. The step grows or shrinks so that the error
+   in angle is small and the midpoint of each segment is close to the
+   curve, so points are spaced more closely only where the line bends.
+
+   The poloidal step only depends on the poloidal angle, so a fieldline
+   starting at any other toroidal angle is this one rotated about the
+   vertical axis, and one trace serves every line on the surface */
+static float *trace_shapeline(int *np, float R, float a, float e, float k,
+			      int m, int n, TShapeCache *cache)
+{
+  TShapeLine line;
+  double phi, theta, h, end, tol, full, half, two, err, sag, grow, d;
+  double p0[3], p1[3], pm[3];
+  float *pts, *out;
+  int i, l, npts, size;
+
+  line.R = R;
+  line.a = a;
+  line.b = a*( 2.0/(2.0 + k) - 1.0 );
+  line.e = e;
+  line.alpha = (((double) n) / ((double) m)) * 2.0*PI / shape_integral(cache, R, a, line.b);
+
+  tol = LINE_TOLERANCE * (fabs(R) + fabs(a));
+  end = 2.0*PI*n;
+
+  size = 256;
+  pts = float_alloc(3*size);
+  npts = 0;
+
+  phi = theta = 0.0;
+  shapeline_point(&line, phi, theta, p0);
+  h = LINE_MAX_STEP;
+  for(;;) {
+    for(l=0;l<3;l++)
+      pts[3*npts + l] = p0[l];
+    npts++;
+    if(phi >= end)
+      break;
+    if(npts == size) {
+      size *= 2;
+      pts = (float*) realloc(pts, sizeof(float)*3*size);
+      if(pts == NULL) {
+	fprintf(stderr, "Error: Memory allocation failed\n");
+	exit(1);
+      }
+    }
+
+    for(;;) {
+      if(h > end - phi)
+	h = end - phi;
+
+      full = shapeline_rk4(&line, theta, h);
+      half = shapeline_rk4(&line, theta, 0.5*h);
+      two = shapeline_rk4(&line, half, 0.5*h);
+      err = fabs(two - full)/15.0;
+
+      /* Distance of the midpoint from the segment's middle */
+      shapeline_point(&line, phi + 0.5*h, half, pm);
+      shapeline_point(&line, phi + h, two, p1);
+      sag = 0.0;
+      for(l=0;l<3;l++) {
+	d = pm[l] - 0.5*(p0[l] + p1[l]);
+	sag += d*d;
+      }
+      sag = sqrt(sag);
+
+      /* Error in angle goes as h^5, and the sag as h^2 */
+      grow = 2.0;
+      if(err > 0.0)
+	grow = fmin(grow, 0.9*pow(LINE_THETA_TOLERANCE/err, 0.2));
+      if(sag > 0.0)
+	grow = fmin(grow, 0.9*sqrt(tol/sag));
+
+      if(((err <= LINE_THETA_TOLERANCE) && (sag <= tol)) || (h < 1.0e-6*LINE_MAX_STEP))
+	break;
+      h *= fmax(grow, 0.2);
+    }
+
+    /* Take the step, with the Richardson extrapolated angle */
+    phi = (h == end - phi) ? end : phi + h;
+    theta = two + (two - full)/15.0;
+    shapeline_point(&line, phi, theta, p0);
+    h = fmin(h*grow, LINE_MAX_STEP);
+  }
+
+  /* After n toroidal and m poloidal turns the line is back where it
+     started, so close it exactly */
+  for(l=0;l<3;l++)
+    pts[3*(npts-1) + l] = pts[l];
+
+  out = float_alloc(3*npts);
+  for(i=0;i<npts;i++)
+    for(l=0;l<3;l++)
+      out[l*npts + i] = pts[3*i + l];
+  free(pts);
+
+  *np = npts;
+  return out;
+}
+
+/* The N field-lines of a surface, starting at toroidal angles 2pi i / N.
+   Only the first is stored; the others are drawn as rotated copies */
+static void tess_shapesurf(TGeomItem *g, float R, float a, float e, float k, int m, int n,
+			   TColor *color, int N, TShapeCache *cache)
+{
+  float *x, *y, *z;
+  int j, nline;
+
+  if(N < 0)
+    N = 0;
+  if(n < 0)
+    n = 0;
+  if((N == 0) || (n == 0)) {
+    geom_alloc(g, GL_LINE_STRIP, 0, 0);
+    return;
+  }
+
+  x = trace_shapeline(&nline, R, a, e, k, m, n, cache);
+  y = x + nline;
+  z = y + nline;
+
+  geom_alloc(g, GL_LINE_STRIP, nline, 1);
+  g->first[0] = 0;
+  g->count[0] = nline;
+  for(j=0;j<nline;j++)
+    set_vertex(g->vert + j, x[j], z[j], y[j], color, 1.0);
+  free(x);
+
+  g->ninstances = N;
+  g->instance = float_alloc(2*N);
+  trig_table(g->instance, g->instance + N, N, 0.0, 2.0*PI / ((float) N));
+}
+
+/* A solid surface is its poloidal cross-section, swept around
+   toroidally through RANGE */
+static void tess_solid(TGeomItem *g, float R, float a, float e, float k, int N,
+		       TColor *color, float phi0, float phi1)
+{
+  int i, cols, full;
+  float *r, *z;
+  float b, ct;
+
+  if(N <= 0) {
+    geom_alloc(g, GL_TRIANGLES, 0, 0);
+    return;
+  }
+
+  /* The rows of the grid go around poloidally, so always close up.
+     The columns go around toroidally, and only close if RANGE is a
+     full turn, in which case the seam shares its vertices */
+  full = fabs(fabs(phi1 - phi0) - 2.0*PI) < 1.0e-5;
+  cols = full ? N : N+1;
+  geom_grid(g, N, cols, 1, full);
+
+  b = a*( 2.0/(2.0 + k) - 1.0 );
+
+  r = float_alloc(2*N);
+  z = r + N;
+  trig_table(r, z, N, 0.0, 2.0*PI / ((float) N));
+  for(i=0;i<N;i++) {
+    ct = r[i];
+    set_vertex(g->vert + i, a*ct - b*ct*ct + R, z[i]*(a*(1.0 + e)), 0.0, color, color->alpha);
+  }
+  free(r);
+
+  g->sweepstep = (phi1 - phi0) / ((float) N);
+  g->sweepend = g->sweepstep * (cols - 1);
+  trig_table(g->sweep, g->sweep + cols, cols, 0.0, (phi1 - phi0) / ((float) N));
+}
+
+/************* Levels of detail **************/
+
+/* Distance of p from the line segment a-b */
+static float segment_dist(TVertex *p, TVertex *a, TVertex *b)
+{
+  float d[3], e[3], t, len2;
+
+  d[0] = b->x - a->x; d[1] = b->y - a->y; d[2] = b->z - a->z;
+  e[0] = p->x - a->x; e[1] = p->y - a->y; e[2] = p->z - a->z;
+
+  len2 = d[0]*d[0] + d[1]*d[1] + d[2]*d[2];
+  t = (len2 > 0.0) ? (d[0]*e[0] + d[1]*e[1] + d[2]*e[2]) / len2 : 0.0;
+  if(t < 0.0) t = 0.0;
+  if(t > 1.0) t = 1.0;
+
+  e[0] -= t*d[0]; e[1] -= t*d[1]; e[2] -= t*d[2];
+  return sqrt(e[0]*e[0] + e[1]*e[1] + e[2]*e[2]);
+}
+
+/* Indices 0, step, 2*step, ... up to and always including n-1.
+   Returns how many there are */
+static int lod_indices(int *ind, int n, int step)
+{
+  int i, m = 0;
+
+  for(i=0;i<n-1;i+=step)
+    ind[m++] = i;
+  ind[m++] = n-1;
+  return m;
+}
+
+/* Make c from each field-line in g by keeping every step'th vertex */
+static void lod_lines(TGeomItem *g, int step, TGeomItem *c)
+{
+  int i, j, k, n, m, nverts;
+  int *ind;
+  float d;
+  TVertex *v;
+
+  nverts = 0;
+  for(i=0;i<g->nstrips;i++)
+    nverts += (g->count[i] < 2) ? g->count[i] : (g->count[i] - 2)/step + 2;
+  geom_alloc(c, g->mode, nverts, g->nstrips);
+  c->ninstances = g->ninstances;
+  c->instance = g->instance;
+
+  nverts = 0;
+  for(i=0;i<g->nstrips;i++) {
+    n = g->count[i];
+    v = g->vert + g->first[i];
+    c->first[i] = nverts;
+    if(n < 2) {
+      memcpy(c->vert + nverts, v, sizeof(TVertex)*n);
+      c->count[i] = n;
+      nverts += n;
+      continue;
+    }
+
+    ind = (int*) malloc(sizeof(int)*n);
+    if(ind == NULL) {
+      fprintf(stderr, "Error: Memory allocation failed\n");
+      exit(1);
+    }
+    m = lod_indices(ind, n, step);
+    for(j=0;j<m;j++)
+      c->vert[nverts + j] = v[ind[j]];
+    c->count[i] = m;
+    nverts += m;
+
+    /* Distance of the dropped vertices from the segments replacing them */
+    for(j=0;j<m-1;j++)
+      for(k=ind[j]+1;k<ind[j+1];k++) {
+	d = segment_dist(&v[k], &v[ind[j]], &v[ind[j+1]]);
+	if(d > c->error)
+	  c->error = d;
+      }
+    free(ind);
+  }
+}
+
+/* Distance of each vertex of g from the coarse quad it falls in, for
+   quad rows start to end-1 of the coarse grid */
+static void task_lod_error(TBuildTask *task)
+{
+  TGeomItem *g = task->src;
+  int *row = task->ind, *col = task->ind + g->rows + 1;
+  int i, j, k, l, nc;
+  float u, w, d, p[3];
+  TVertex a, b, e, f, v;
+
+  nc = task->g->cols + task->g->wrapcols;
+  for(i=task->start;i<task->end;i++)
+    for(j=0;j<nc-1;j++) {
+      geom_grid_vertex(g, row[i], col[j], &a);
+      geom_grid_vertex(g, row[i], col[j+1], &b);
+      geom_grid_vertex(g, row[i+1], col[j], &e);
+      geom_grid_vertex(g, row[i+1], col[j+1], &f);
+      for(k=row[i];k<=row[i+1];k++)
+	for(l=col[j];l<=col[j+1];l++) {
+	  u = ((float) (k - row[i])) / ((float) (row[i+1] - row[i]));
+	  w = ((float) (l - col[j])) / ((float) (col[j+1] - col[j]));
+	  geom_grid_vertex(g, k, l, &v);
+	  p[0] = (1.0-u)*((1.0-w)*a.x + w*b.x) + u*((1.0-w)*e.x + w*f.x) - v.x;
+	  p[1] = (1.0-u)*((1.0-w)*a.y + w*b.y) + u*((1.0-w)*e.y + w*f.y) - v.y;
+	  p[2] = (1.0-u)*((1.0-w)*a.z + w*b.z) + u*((1.0-w)*e.z + w*f.z) - v.z;
+	  d = sqrt(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]);
+	  if(d > task->error)
+	    task->error = d;
+	}
+    }
+}
+
+/* Make c from the grid g by keeping every step'th row and column.
+   The error is filled in by queued tasks */
+static void lod_grid(TGeomItem *g, int step, TGeomItem *c, TBuildJobs *jobs)
+{
+  TBuildTask task;
+  int i, j, nr, nc;
+  int *row, *col;
+
+  row = (int*) malloc(sizeof(int)*(g->rows + g->cols + 2));
+  if(row == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  build_scratch(jobs, row);
+  col = row + g->rows + 1;
+  nr = lod_indices(row, g->rows + g->wraprows, step);
+  nc = lod_indices(col, g->cols + g->wrapcols, step);
+
+  /* If the grid wraps, the last row or column kept is the first again */
+  geom_grid(c, nr - g->wraprows, nc - g->wrapcols, g->wraprows, g->wrapcols);
+  for(i=0;i<c->rows;i++)
+    c->vert[i] = g->vert[row[i]];
+  for(j=0;j<c->cols;j++) {
+    c->sweep[j] = g->sweep[col[j]];
+    c->sweep[c->cols + j] = g->sweep[g->cols + col[j]];
+  }
+  c->sweepstep = step*g->sweepstep;
+  c->sweepend = col[c->cols-1]*g->sweepstep;
+
+  memset(&task, 0, sizeof(TBuildTask));
+  task.g = c;
+  task.src = g;
+  task.ind = row;
+  task.run = task_lod_error;
+  build_add(jobs, &task, nr-1, step*g->cols);
+}
+
+/* Fewest segments along any strip, or across a surface */
+static int lod_segments(TGeomItem *g)
+{
+  int i, n;
+
+  if(g->rows > 0) {
+    n = g->cols + g->wrapcols - 1;
+    return (g->rows + g->wraprows - 1 < n) ? g->rows + g->wraprows - 1 : n;
+  }
+  n = g->count[0] - 1;
+  for(i=1;i<g->nstrips;i++)
+    if(g->count[i] - 1 < n)
+      n = g->count[i] - 1;
+  return n;
+}
+
+/* Work out the bounds of item g, and make its coarser versions. Only
+   field-lines and surfaces have them. The vertices of g must be done;
+   grids are finished by the queued tasks */
+static void lod_build(TGeomItem *g, float ring, TBuildJobs *jobs)
+{
+  int i, n, step;
+  float rho, d;
+  TGeomItem *c;
+
+  g->ring = ring;
+  g->extent = 0.0;
+  for(i=0;i<g->nverts;i++) {
+    rho = sqrt(g->vert[i].x*g->vert[i].x + g->vert[i].z*g->vert[i].z);
+    d = sqrt((rho - ring)*(rho - ring) + g->vert[i].y*g->vert[i].y);
+    if(d > g->extent)
+      g->extent = d;
+  }
+  build_patch_bounds(jobs, g);
+
+  if((g->rows <= 0) && ((g->nstrips <= 0) || (g->mode != GL_LINE_STRIP)))
+    return;
+
+  n = lod_segments(g);
+  for(step=2;(g->nlod < LOD_MAX) && (n/step >= LOD_MIN_SEGMENTS);step*=2)
+    g->nlod++;
+  if(g->nlod == 0)
+    return;
+
+  g->lod = (TGeomItem*) malloc(sizeof(TGeomItem)*g->nlod);
+  if(g->lod == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  for(i=0,step=2;i<g->nlod;i++,step*=2) {
+    c = &g->lod[i];
+    if(g->rows > 0)
+      lod_grid(g, step, c, jobs);
+    else
+      lod_lines(g, step, c);
+    c->ring = g->ring;
+    c->extent = g->extent;
+  }
+}
+
+/************* Transparency **************/
+
+/* Items made of polygons with some transparent vertices */
+static int blend_item(TGeomItem *g)
+{
+  int i;
+
+  if((g->mode != GL_TRIANGLES) && (g->mode != GL_QUADS))
+    return 0;
+  for(i=0;i<g->nverts;i++)
+    if(g->vert[i].a < 1.0)
+      return 1;
+  return 0;
+}
+
+static void blend_free(TGeomBlend *b)
+{
+  if(b->vbo != 0)
+    glDeleteBuffers(1, &b->vbo);
+  if(b->ibo != 0)
+    glDeleteBuffers(1, &b->ibo);
+
+  free(b->vert);
+  free(b->tri);
+  free(b->centre);
+  free(b->order);
+  free(b->key);
+  free(b->index);
+  memset(b, 0, sizeof(TGeomBlend));
+}
+
+/* Collect the triangles of all items marked as transparent. These are
+   always at full detail, with surfaces swept out in full */
+static void blend_build(TGeometry *geom)
+{
+  int i, j, k, t;
+  GLuint v0;
+  TGeomItem *g;
+  TGeomBlend *b = &geom->blend;
+  TVertex *p0, *p1, *p2;
+
+  memset(b, 0, sizeof(TGeomBlend));
+  for(i=0;i<geom->nitems;i++) {
+    g = &geom->item[i];
+    if(!g->blend)
+      continue;
+    b->nverts += (g->rows > 0) ? g->rows*g->cols : g->nverts;
+    b->ntris += g->nindices/3;
+    for(j=0;j<g->nstrips;j++)
+      b->ntris += 2*(g->count[j]/4);
+  }
+  if(b->ntris == 0)
+    return;
+
+  b->vert = (TVertex*) malloc(sizeof(TVertex)*b->nverts);
+  b->tri = (GLuint*) malloc(sizeof(GLuint)*3*b->ntris);
+  b->centre = (float*) malloc(sizeof(float)*3*b->ntris);
+  b->order = (GLuint*) malloc(sizeof(GLuint)*2*b->ntris);
+  b->key = (unsigned int*) malloc(sizeof(unsigned int)*2*b->ntris);
+  b->index = (GLuint*) malloc(sizeof(GLuint)*3*b->ntris);
+  if((b->vert == NULL) || (b->tri == NULL) || (b->centre == NULL) ||
+     (b->order == NULL) || (b->key == NULL) || (b->index == NULL)) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+
+  v0 = 0;
+  t = 0;
+  for(i=0;i<geom->nitems;i++) {
+    g = &geom->item[i];
+    if(!g->blend)
+      continue;
+    if(g->rows > 0) {
+      for(j=0;j<g->rows;j++)
+	for(k=0;k<g->cols;k++)
+	  geom_grid_vertex(g, j, k, b->vert + v0 + j*g->cols + k);
+      grid_indices(g, b->tri + t, 0, g->npatches);
+      for(k=0;k<g->nindices;k++)
+	b->tri[t++] += v0;
+      v0 += g->rows*g->cols;
+      continue;
+    }
+    memcpy(b->vert + v0, g->vert, sizeof(TVertex)*g->nverts);
+    for(j=0;j<g->nstrips;j++)
+      for(k=0;k<g->count[j]/4;k++) {
+	/* Each quad split as the feedback buffer does */
+	b->tri[t++] = v0 + g->first[j] + 4*k;
+	b->tri[t++] = v0 + g->first[j] + 4*k + 1;
+	b->tri[t++] = v0 + g->first[j] + 4*k + 2;
+	b->tri[t++] = v0 + g->first[j] + 4*k;
+	b->tri[t++] = v0 + g->first[j] + 4*k + 2;
+	b->tri[t++] = v0 + g->first[j] + 4*k + 3;
+      }
+    v0 += g->nverts;
+  }
+
+  for(t=0;t<b->ntris;t++) {
+    p0 = &b->vert[b->tri[3*t]];
+    p1 = &b->vert[b->tri[3*t+1]];
+    p2 = &b->vert[b->tri[3*t+2]];
+    b->centre[3*t]   = (p0->x + p1->x + p2->x) / 3.0;
+    b->centre[3*t+1] = (p0->y + p1->y + p2->y) / 3.0;
+    b->centre[3*t+2] = (p0->z + p1->z + p2->z) / 3.0;
+    b->order[t] = t;
+  }
+}
+
+/* Sort key of triangle t seen from eye: the further away, the smaller */
+static unsigned int blend_key(TGeomBlend *b, GLuint t, double eye[3])
+{
+  union {
+    float f;
+    unsigned int u;
+  }d;
+  double x, y, z;
+
+  x = b->centre[3*t] - eye[0];
+  y = b->centre[3*t+1] - eye[1];
+  z = b->centre[3*t+2] - eye[2];
+
+  /* Distances are positive, so their bits increase with them */
+  d.f = x*x + y*y + z*z;
+  return ~d.u;
+}
+
+/* Radix sort of order by key, 8 bits at a time. Uses the second half
+   of both arrays as scratch, and leaves the result in the first half */
+static void blend_radix(TGeomBlend *b)
+{
+  int pass, i, n = b->ntris;
+  unsigned int count[256], sum, c, shift;
+  unsigned int *key = b->key, *key2 = b->key + n, *swapk;
+  GLuint *order = b->order, *order2 = b->order + n, *swapo;
+
+  for(pass=0;pass<4;pass++) {
+    shift = 8*pass;
+    memset(count, 0, sizeof(count));
+    for(i=0;i<n;i++)
+      count[(key[i] >> shift) & 0xff]++;
+    for(sum=0,i=0;i<256;i++) {
+      c = count[i];
+      count[i] = sum;
+      sum += c;
+    }
+    for(i=0;i<n;i++) {
+      c = count[(key[i] >> shift) & 0xff]++;
+      key2[c] = key[i];
+      order2[c] = order[i];
+    }
+    swapk = key; key = key2; key2 = swapk;
+    swapo = order; order = order2; order2 = swapo;
+  }
+}
+
+/* Insertion sort of order by key, which is quick if the order is nearly
+   right already. Gives up after maxmoves moves, returning 1 */
+static int blend_insertion(TGeomBlend *b, long maxmoves)
+{
+  int i, j;
+  long moves = 0;
+  unsigned int k;
+  GLuint t;
+
+  for(i=1;i<b->ntris;i++) {
+    k = b->key[i];
+    if(b->key[i-1] <= k)
+      continue;
+    t = b->order[i];
+    for(j=i;(j > 0) && (b->key[j-1] > k);j--) {
+      b->key[j] = b->key[j-1];
+      b->order[j] = b->order[j-1];
+    }
+    b->key[j] = k;
+    b->order[j] = t;
+    moves += i - j;
+    if(moves > maxmoves)
+      return 1;
+  }
+  return 0;
+}
+
+/* Put the transparent triangles in order for a camera at eye. When the
+   camera has only moved a little, the last order is updated rather than
+   sorted again. Returns 1 if the order may have changed */
+static int blend_sort(TGeomBlend *b, double eye[3])
+{
+  int i;
+
+  if(b->sorted && (eye[0] == b->eye[0]) && (eye[1] == b->eye[1]) && (eye[2] == b->eye[2]))
+    return 0;
+
+  for(i=0;i<b->ntris;i++)
+    b->key[i] = blend_key(b, b->order[i], eye);
+
+  if(!b->sorted || blend_insertion(b, (long) BLEND_MOVES * b->ntris))
+    blend_radix(b);
+
+  for(i=0;i<b->ntris;i++)
+    memcpy(&b->index[3*i], &b->tri[3*b->order[i]], sizeof(GLuint)*3);
+
+  for(i=0;i<3;i++)
+    b->eye[i] = eye[i];
+  b->sorted = 1;
+  return 1;
+}
+
+/************* Interface **************/
+
+/************* Field-lines **************/
+
+/* Rotate the copies in a vertex shader, with the angle worked out from
+   the instance number. Needs GL_ARB_draw_instanced */
+static const char *instance_vs =
+  "#version 130\n"
+  "#extension GL_ARB_draw_instanced : require\n"
+  "uniform float dphi;\n"
+  "void main() {\n"
+  "  float a = dphi * float(gl_InstanceIDARB);\n"
+  "  float c = cos(a), s = sin(a);\n"
+  "  vec4 v = vec4(c*gl_Vertex.x - s*gl_Vertex.z, gl_Vertex.y,\n"
+  "                s*gl_Vertex.x + c*gl_Vertex.z, gl_Vertex.w);\n"
+  "  gl_FrontColor = gl_Color;\n"
+  "  gl_Position = gl_ModelViewProjectionMatrix * v;\n"
+  "}\n";
+
+static const char *color_fs =
+  "#version 130\n"
+  "void main() {\n"
+  "  gl_FragColor = gl_Color;\n"
+  "}\n";
+
+static int instance_state = 0; /* 0 = not set up yet, 1 = ready, -1 = not supported */
+static GLuint instance_prog;
+static GLint instance_step;
+
+/* Whether copies can be drawn by the graphics card */
+static int instance_setup()
+{
+  if(instance_state == 0) {
+    instance_state = -1;
+    if(shader_supported(3, 0, "GL_ARB_draw_instanced") &&
+       ((instance_prog = shader_program(instance_vs, color_fs)) != 0)) {
+      instance_step = glGetUniformLocation(instance_prog, "dphi");
+      instance_state = 1;
+    }
+  }
+  return instance_state > 0;
+}
+
+/* Vertex in of item g, moved to where it is in copy k */
+void geom_instance_vertex(TGeomItem *g, int k, TVertex *in, TVertex *out)
+{
+  float c, s;
+
+  *out = *in;
+  if(g->ninstances <= 0)
+    return;
+  c = g->instance[k];
+  s = g->instance[g->ninstances + k];
+  out->x = c*in->x - s*in->z;
+  out->z = s*in->x + c*in->z;
+}
+
+/* Draw the strips of item g, whose first vertex is base in the bound
+   buffer, and all its rotated copies */
+static void draw_instances(TGeomItem *g, GLint base, int shader)
+{
+  int j, k;
+  GLfloat m[16];
+  GLint prog;
+
+  if(g->ninstances <= 0) {
+    for(j=0;j<g->nstrips;j++)
+      glDrawArrays(g->mode, base + g->first[j], g->count[j]);
+    return;
+  }
+
+  if(shader) {
+    glGetIntegerv(GL_CURRENT_PROGRAM, &prog);
+    glUseProgram(instance_prog);
+    glUniform1f(instance_step, 2.0*PI / ((float) g->ninstances));
+    for(j=0;j<g->nstrips;j++)
+      glDrawArraysInstancedARB(g->mode, base + g->first[j], g->count[j], g->ninstances);
+    glUseProgram(prog);
+    return;
+  }
+
+  /* One copy at a time */
+  memset(m, 0, sizeof(m));
+  m[5] = m[15] = 1.0;
+  for(k=0;k<g->ninstances;k++) {
+    m[0] = m[10] = g->instance[k];
+    m[2] = g->instance[g->ninstances + k];
+    m[8] = -m[2];
+    glPushMatrix();
+    glMultMatrixf(m);
+    for(j=0;j<g->nstrips;j++)
+      glDrawArrays(g->mode, base + g->first[j], g->count[j]);
+    glPopMatrix();
+  }
+}
+
+static void lines_free(TGeomLines *l)
+{
+  if(l->vbo != 0)
+    glDeleteBuffers(1, &l->vbo);
+  free(l->draw);
+  memset(l, 0, sizeof(TGeomLines));
+}
+
+/* Give each field-line item, and each of its coarser versions, a place
+   in the shared buffer */
+static void lines_build(TGeometry *geom)
+{
+  int i, j;
+  TGeomItem *g, *c;
+  TGeomLines *l = &geom->lines;
+
+  memset(l, 0, sizeof(TGeomLines));
+  for(i=0;i<geom->nitems;i++) {
+    g = &geom->item[i];
+    if((g->mode != GL_LINE_STRIP) || (g->nverts <= 0))
+      continue;
+    for(j=-1;j<g->nlod;j++) {
+      c = (j < 0) ? g : &g->lod[j];
+      c->base = l->nverts;
+      l->nverts += c->nverts;
+    }
+    l->nitems++;
+  }
+  if(l->nitems == 0)
+    return;
+
+  l->draw = (TGeomItem**) malloc(sizeof(TGeomItem*)*l->nitems);
+  if(l->draw == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+}
+
+/* Upload all the field-lines to the graphics card */
+static void lines_upload(TGeometry *geom)
+{
+  int i, j;
+  TGeomItem *g, *c;
+  TGeomLines *l = &geom->lines;
+
+  glGenBuffers(1, &l->vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, l->vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(TVertex)*l->nverts, NULL, GL_STATIC_DRAW);
+  for(i=0;i<geom->nitems;i++) {
+    g = &geom->item[i];
+    if(g->base < 0)
+      continue;
+    for(j=-1;j<g->nlod;j++) {
+      c = (j < 0) ? g : &g->lod[j];
+      glBufferSubData(GL_ARRAY_BUFFER, sizeof(TVertex)*c->base,
+		      sizeof(TVertex)*c->nverts, c->vert);
+    }
+  }
+}
+
+/* Tessellate the items of a model for which build is set (all of them
+   if build is NULL) into the items of geom, which must have room.
+   Only the cross-section of a surface or one field-line is made for
+   each item, so this is done here. The errors of the levels of detail
+   and the bounds of patches are split into pieces, and with pthreads
+   these are shared between threads */
+static void build_items(TGeometry *geom, TModel *model, char *build)
+{
+  int i, j;
+  TModelItem *item;
+  TGeomItem *g;
+  TBuildJobs jobs;
+  TShapeCache shapes;
+
+  memset(&jobs, 0, sizeof(TBuildJobs));
+  shapes.n = shapes.next = 0;
+
+  /* Everything at full resolution */
+  for(i=0;i<model->nitems;i++) {
+    if((build != NULL) && !build[i])
+      continue;
+    item = &model->item[i];
+    g = &geom->item[i];
+    switch(item->type) {
+    case DRAW_LINE: {
+      tess_shapesurf(g, item->major_radius, item->minor_radius,
+		     item->elongation, item->triangularity,
+		     item->m, item->n, &item->color, item->number, &shapes);
+      break;
+    }
+    case DRAW_SOLID: {
+      tess_solid(g, item->major_radius, item->minor_radius,
+		 item->elongation, item->triangularity,
+		 item->number, &item->color, item->phi0, item->phi1);
+      break;
+    }
+    case DRAW_PLANES: {
+      tess_planes(g, item->number, item->major_radius, item->minor_radius, &item->color);
+      break;
+    }
+    default: {
+      fprintf(stderr,"ERROR: Unknown model item type. Ignoring\n");
+      geom_alloc(g, GL_POINTS, 0, 0);
+    }
+    }
+  }
+
+  /* Then the levels of detail, which are made from these */
+  for(i=0;i<model->nitems;i++)
+    if((build == NULL) || build[i])
+      lod_build(&geom->item[i], model->item[i].major_radius, &jobs);
+  build_run(&jobs);
+
+  for(i=0;i<model->nitems;i++) {
+    if((build != NULL) && !build[i])
+      continue;
+    g = &geom->item[i];
+    for(j=0;j<g->nlod;j++)
+      build_patch_bounds(&jobs, &g->lod[j]);
+  }
+  build_run(&jobs);
+
+  for(i=0;i<model->nitems;i++) {
+    if((build != NULL) && !build[i])
+      continue;
+    g = &geom->item[i];
+    patch_orient(g, g->ring);
+    for(j=0;j<g->nlod;j++)
+      patch_orient(&g->lod[j], g->ring);
+    g->blend = blend_item(g);
+  }
+
+  for(i=0;i<jobs.nscratch;i++)
+    free(jobs.scratch[i]);
+  free(jobs.scratch);
+  free(jobs.task);
+}
+
+/* Tessellate all items in a model. Any previous geometry should
+   have been released with geom_free first, or use geom_update */
+int geom_build(TGeometry *geom, TModel *model)
+{
+  geom->nitems = 0;
+  geom->item = NULL;
+  memset(&geom->blend, 0, sizeof(TGeomBlend));
+  memset(&geom->lines, 0, sizeof(TGeomLines));
+
+  if(model->nitems <= 0)
+    return 0;
+
+  geom->item = (TGeomItem*) calloc(model->nitems, sizeof(TGeomItem));
+  if(geom->item == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  geom->nitems = model->nitems;
+
+  build_items(geom, model, NULL);
+  blend_build(geom);
+  lines_build(geom);
+  return 0;
+}
+
+/* Items of a model which would be tessellated differently */
+static int item_shape_changed(TModelItem *a, TModelItem *b)
+{
+  return (a->type != b->type) ||
+    (a->major_radius != b->major_radius) || (a->minor_radius != b->minor_radius) ||
+    (a->elongation != b->elongation) || (a->triangularity != b->triangularity) ||
+    (a->number != b->number) || (a->m != b->m) || (a->n != b->n) ||
+    (a->phi0 != b->phi0) || (a->phi1 != b->phi1);
+}
+
+static int item_color_changed(TModelItem *a, TModelItem *b)
+{
+  return (a->color.r != b->color.r) || (a->color.g != b->color.g) ||
+    (a->color.b != b->color.b) || (a->color.alpha != b->color.alpha);
+}
+
+/* Give every vertex of an item, and of its coarser versions, a new
+   color. Its buffer objects are uploaded again when next drawn */
+static void geom_recolor(TGeomItem *g, TColor *color, float alpha)
+{
+  int i, j;
+  TGeomItem *c;
+
+  for(j=-1;j<g->nlod;j++) {
+    c = (j < 0) ? g : &g->lod[j];
+    for(i=0;i<c->nverts;i++) {
+      c->vert[i].r = color->r;
+      c->vert[i].g = color->g;
+      c->vert[i].b = color->b;
+      c->vert[i].a = alpha;
+    }
+    if(c->vbo != 0)
+      glDeleteBuffers(1, &c->vbo);
+    if(c->ibo != 0)
+      glDeleteBuffers(1, &c->ibo);
+    if(c->sweepvbo != 0)
+      glDeleteBuffers(1, &c->sweepvbo);
+    c->vbo = c->ibo = c->sweepvbo = 0;
+  }
+}
+
+/* Bring geometry built from model old up to date with model, which
+   usually differs from it in only a few items. Items are compared in
+   order: those whose shape changed are tessellated again, those whose
+   color changed only have their vertices recolored, and the rest are
+   kept as they are. Needs a current OpenGL context if geom has been
+   drawn. Returns the number of items tessellated */
+int geom_update(TGeometry *geom, TModel *old, TModel *model)
+{
+  int i, j, n, v0, nbuilt, blends, lines;
+  char *build, *recolor;
+  TGeomItem *item, *g, *c;
+  TGeomBlend *b = &geom->blend;
+  TGeomLines *l = &geom->lines;
+  TColor *color;
+  float alpha;
+
+  if(model->nitems <= 0) {
+    geom_free(geom);
+    return 0;
+  }
+
+  item = (TGeomItem*) calloc(model->nitems, sizeof(TGeomItem));
+  build = (char*) malloc(2*model->nitems);
+  if((item == NULL) || (build == NULL)) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  recolor = build + model->nitems;
+
+  /* Move over the items which keep their shape */
+  nbuilt = 0;
+  for(i=0;i<model->nitems;i++) {
+    build[i] = (i >= geom->nitems) || (i >= old->nitems) ||
+      item_shape_changed(&old->item[i], &model->item[i]);
+    recolor[i] = !build[i] && item_color_changed(&old->item[i], &model->item[i]);
+    if(build[i]) {
+      nbuilt++;
+      continue;
+    }
+    item[i] = geom->item[i];
+    memset(&geom->item[i], 0, sizeof(TGeomItem));
+    geom->item[i].base = -1;
+  }
+
+  /* What is left of the old items has to come out of the shared
+     buffers, as do the new ones */
+  blends = lines = 0;
+  for(i=0;i<geom->nitems;i++) {
+    g = &geom->item[i];
+    blends |= g->blend;
+    lines |= (g->base >= 0);
+    geom_item_free(g);
+  }
+  if(geom->nitems > 0)
+    free(geom->item);
+  geom->item = item;
+  geom->nitems = model->nitems;
+
+  build_items(geom, model, build);
+
+  for(i=0;i<geom->nitems;i++) {
+    g = &geom->item[i];
+    if(build[i]) {
+      blends |= g->blend;
+      lines |= (g->mode == GL_LINE_STRIP) && (g->nverts > 0);
+    }else if(recolor[i]) {
+      color = &model->item[i].color;
+      alpha = (model->item[i].type == DRAW_LINE) ? 1.0 : color->alpha;
+      geom_recolor(g, color, alpha);
+      /* Becoming transparent or opaque moves it in or out of the
+	 sorted triangles */
+      j = blend_item(g);
+      blends |= (j != g->blend);
+      g->blend = j;
+    }
+  }
+
+  if(blends) {
+    blend_free(b);
+    blend_build(geom);
+  }else if(b->ntris > 0) {
+    /* Transparent items keep their place, so only colors change */
+    v0 = 0;
+    for(i=0;i<geom->nitems;i++) {
+      g = &geom->item[i];
+      if(!g->blend)
+	continue;
+      n = (g->rows > 0) ? g->rows*g->cols : g->nverts;
+      if(recolor[i]) {
+	for(j=v0;j<v0+n;j++) {
+	  b->vert[j].r = g->vert[0].r;
+	  b->vert[j].g = g->vert[0].g;
+	  b->vert[j].b = g->vert[0].b;
+	  b->vert[j].a = g->vert[0].a;
+	}
+	if(b->vbo != 0) {
+	  glBindBuffer(GL_ARRAY_BUFFER, b->vbo);
+	  glBufferSubData(GL_ARRAY_BUFFER, sizeof(TVertex)*v0,
+			  sizeof(TVertex)*n, b->vert + v0);
+	  glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+      }
+      v0 += n;
+    }
+  }
+
+  if(lines) {
+    lines_free(l);
+    lines_build(geom);
+  }else if(l->vbo != 0) {
+    glBindBuffer(GL_ARRAY_BUFFER, l->vbo);
+    for(i=0;i<geom->nitems;i++) {
+      g = &geom->item[i];
+      if(!recolor[i] || (g->base < 0))
+	continue;
+      for(j=-1;j<g->nlod;j++) {
+	c = (j < 0) ? g : &g->lod[j];
+	glBufferSubData(GL_ARRAY_BUFFER, sizeof(TVertex)*c->base,
+			sizeof(TVertex)*c->nverts, c->vert);
+      }
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  free(build);
+  return nbuilt;
+}
+
+/* The coarsest version of item g which, seen from camera cam in a
+   window height pixels high, is within maxerr pixels of the full
+   resolution. The camera location must be up to date. With no camera,
+   or maxerr <= 0, this is always g itself */
+TGeomItem *geom_lod(TGeomItem *g, TCamera *cam, int height, float maxerr)
+{
+  int i;
+  double rho, dist, scale;
+
+  if((cam == NULL) || (maxerr <= 0.0) || (g->nlod == 0))
+    return g;
+
+  /* Nearest the item can be to the camera */
+  rho = sqrt(cam->cx*cam->cx + cam->cz*cam->cz);
+  dist = sqrt((rho - g->ring)*(rho - g->ring) + cam->cy*cam->cy) - g->extent;
+  if(dist < CAMERA_NEAR)
+    dist = CAMERA_NEAR;
+
+  /* Pixels per unit length at that distance */
+  scale = 0.5*height / tan(0.5*CAMERA_FOV*PI/180.) / dist;
+
+  for(i=g->nlod-1;i>=0;i--)
+    if(g->lod[i].error*scale <= maxerr)
+      return &g->lod[i];
+  return g;
+}
+
+/************* Surfaces **************/
+
+/* Sweep a strip of quads between columns 0 and 1 of a grid around to
+   columns start to start+n-1, one instance for each. Vertices in
+   column 1 are marked by z = 1, the cross-section being at z = 0 */
+static const char *sweep_vs =
+  "#version 130\n"
+  "#extension GL_ARB_draw_instanced : require\n"
+  "uniform float dphi, last;\n"
+  "uniform int start, cols;\n"
+  "void main() {\n"
+  "  int col = start + gl_InstanceIDARB + int(gl_Vertex.z);\n"
+  "  float a = (col >= cols) ? 0.0 : min(dphi * float(col), last);\n"
+  "  vec4 v = vec4(cos(a)*gl_Vertex.x, gl_Vertex.y, sin(a)*gl_Vertex.x, 1.0);\n"
+  "  gl_FrontColor = gl_Color;\n"
+  "  gl_Position = gl_ModelViewProjectionMatrix * v;\n"
+  "}\n";
+
+static int sweep_state = 0; /* 0 = not set up yet, 1 = ready, -1 = not supported */
+static GLuint sweep_prog;
+static GLint sweep_dphi, sweep_last, sweep_start, sweep_cols;
+
+/* Whether surfaces can be swept by the graphics card */
+static int sweep_setup()
+{
+  if(sweep_state == 0) {
+    sweep_state = -1;
+    if(shader_supported(3, 0, "GL_ARB_draw_instanced") &&
+       ((sweep_prog = shader_program(sweep_vs, color_fs)) != 0)) {
+      sweep_dphi = glGetUniformLocation(sweep_prog, "dphi");
+      sweep_last = glGetUniformLocation(sweep_prog, "last");
+      sweep_start = glGetUniformLocation(sweep_prog, "start");
+      sweep_cols = glGetUniformLocation(sweep_prog, "cols");
+      sweep_state = 1;
+    }
+  }
+  return sweep_state > 0;
+}
+
+/* Upload the cross-section of a grid as the strip sweep_vs expects.
+   Each quad is split along the same diagonal as in grid_indices */
+static void sweep_upload(TGeomItem *g)
+{
+  TVertex *v;
+  int i, n;
+
+  n = g->rows + g->wraprows;
+  v = (TVertex*) malloc(sizeof(TVertex)*2*n);
+  if(v == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  for(i=0;i<n;i++) {
+    v[2*i] = v[2*i+1] = g->vert[i % g->rows];
+    v[2*i].z = 1.0;
+    v[2*i+1].z = 0.0;
+  }
+
+  glGenBuffers(1, &g->sweepvbo);
+  glBindBuffer(GL_ARRAY_BUFFER, g->sweepvbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(TVertex)*2*n, v, GL_STATIC_DRAW);
+  free(v);
+}
+
+/* Upload the whole of a grid, swept out here, and its indices. Used
+   when it can't be swept by the graphics card */
+static void grid_upload(TGeomItem *g)
+{
+  TVertex *v;
+  GLuint *index;
+  int i, j;
+
+  v = (TVertex*) malloc(sizeof(TVertex)*g->rows*g->cols);
+  index = (GLuint*) malloc(sizeof(GLuint)*(g->nindices > 0 ? g->nindices : 1));
+  if((v == NULL) || (index == NULL)) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  for(i=0;i<g->rows;i++)
+    for(j=0;j<g->cols;j++)
+      geom_grid_vertex(g, i, j, &v[i*g->cols + j]);
+  grid_indices(g, index, 0, g->npatches);
+
+  glGenBuffers(1, &g->vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, g->vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(TVertex)*g->rows*g->cols, v, GL_STATIC_DRAW);
+  glGenBuffers(1, &g->ibo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g->ibo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*g->nindices, index, GL_STATIC_DRAW);
+  free(v);
+  free(index);
+}
+
+/* Draw a grid one row at a time, in the order vector_add_geometry
+   uses. Needs the item's vertex buffer to be bound */
+static void draw_grid_rows(TGeomItem *g)
+{
+  int i, j, n, nc;
+  GLuint *index;
+
+  nc = g->cols + g->wrapcols - 1;
+  index = (GLuint*) malloc(sizeof(GLuint)*6*(nc > 0 ? nc : 1));
+  if(index == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  for(i=0;i<g->rows+g->wraprows-1;i++) {
+    n = 0;
+    for(j=0;j<nc;j++) {
+      index[n++] = i*g->cols + j;
+      index[n++] = ((i+1) % g->rows)*g->cols + j;
+      index[n++] = ((i+1) % g->rows)*g->cols + (j+1) % g->cols;
+      index[n++] = i*g->cols + j;
+      index[n++] = ((i+1) % g->rows)*g->cols + (j+1) % g->cols;
+      index[n++] = i*g->cols + (j+1) % g->cols;
+    }
+    glDrawElements(GL_TRIANGLES, n, GL_UNSIGNED_INT, index);
+  }
+  free(index);
+}
+
+/* Planes bounding the view of the current OpenGL projection and
+   modelview matrices, each (a, b, c, d) with ax + by + cz + d >= 0
+   inside and (a, b, c) of unit length, in the order left, right,
+   bottom, top, near, far. Also the location of the eye */
+static void view_frustum(double plane[6][4], double eye[3])
+{
+  double proj[16], model[16], m[16], len;
+  int i, j, k;
+
+  glGetDoublev(GL_PROJECTION_MATRIX, proj);
+  glGetDoublev(GL_MODELVIEW_MATRIX, model);
+
+  /* Both column-major */
+  for(i=0;i<4;i++)
+    for(j=0;j<4;j++) {
+      m[4*j+i] = 0.0;
+      for(k=0;k<4;k++)
+	m[4*j+i] += proj[4*k+i]*model[4*j+k];
+    }
+
+  for(k=0;k<6;k++) {
+    for(j=0;j<4;j++)
+      plane[k][j] = m[4*j+3] + ((k % 2) ? -m[4*j+k/2] : m[4*j+k/2]);
+    len = sqrt(plane[k][0]*plane[k][0] + plane[k][1]*plane[k][1] + plane[k][2]*plane[k][2]);
+    if(len > 0.0)
+      for(j=0;j<4;j++)
+	plane[k][j] /= len;
+  }
+
+  /* The modelview is a rotation and translation, so easily inverted */
+  for(i=0;i<3;i++)
+    eye[i] = -(model[4*i]*model[12] + model[4*i+1]*model[13] + model[4*i+2]*model[14]);
+}
+
+/* Signed distance of a patch's bounding sphere inside a plane */
+static double patch_plane(TGeomPatch *patch, double plane[4])
+{
+  return plane[0]*patch->centre[0] + plane[1]*patch->centre[1] +
+    plane[2]*patch->centre[2] + plane[3];
+}
+
+/* Whether every point of a patch faces away from eye */
+static int patch_backface(TGeomPatch *patch, double eye[3])
+{
+  double v[3], d, sinb, cosb;
+
+  v[0] = eye[0] - patch->centre[0];
+  v[1] = eye[1] - patch->centre[1];
+  v[2] = eye[2] - patch->centre[2];
+  d = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+  if(d <= patch->radius)
+    return 0;
+
+  /* The sphere is within angle b of the direction to its centre. Facing
+     away if that direction is more than 90 degrees plus a plus b from
+     the axis of the normal cone */
+  sinb = patch->radius / d;
+  cosb = sqrt(1.0 - sinb*sinb);
+  if(patch->cosa*cosb - patch->sina*sinb <= 0.0)
+    return 0;
+  return (v[0]*patch->axis[0] + v[1]*patch->axis[1] + v[2]*patch->axis[2]) / d
+    < -(patch->sina*cosb + patch->cosa*sinb);
+}
+
+/* Whether patches of a grid facing away from eye can be skipped. Facing
+   away only means hidden for an opaque surface which closes on itself,
+   seen from outside and not cut open by the near plane */
+static int grid_backface(TGeomItem *g, double plane[6][4], double eye[3])
+{
+  int i;
+  double rho;
+
+  if(g->blend || !g->wraprows || !g->wrapcols)
+    return 0;
+  rho = sqrt(eye[0]*eye[0] + eye[2]*eye[2]);
+  if(sqrt((rho - g->ring)*(rho - g->ring) + eye[1]*eye[1]) <= g->extent)
+    return 0;
+  for(i=0;i<g->npatches;i++)
+    if(fabs(patch_plane(&g->patch[i], plane[4])) < g->patch[i].radius)
+      return 0;
+  return 1;
+}
+
+/* Whether patch i of a grid may be seen */
+static int patch_visible(TGeomItem *g, int i, double plane[6][4], double eye[3], int backface)
+{
+  int k;
+
+  for(k=0;k<6;k++)
+    if(patch_plane(&g->patch[i], plane[k]) < -g->patch[i].radius)
+      return 0;
+  return !(backface && patch_backface(&g->patch[i], eye));
+}
+
+/* Draw the patches of a grid which are in view, merging neighbouring
+   ones into a single call. Needs the item's index buffer to be bound */
+static void draw_patches(TGeomItem *g, double plane[6][4], double eye[3])
+{
+  int i, backface;
+  GLsizei start, end;
+
+  backface = grid_backface(g, plane, eye);
+  start = end = 0;
+  for(i=0;i<g->npatches;i++) {
+    if(!patch_visible(g, i, plane, eye, backface))
+      continue;
+
+    if(g->patch[i].first != end) {
+      if(end > start)
+	glDrawElements(g->mode, end - start, GL_UNSIGNED_INT, (GLvoid*) (sizeof(GLuint)*start));
+      start = g->patch[i].first;
+    }
+    end = g->patch[i].first + g->patch[i].count;
+  }
+  if(end > start)
+    glDrawElements(g->mode, end - start, GL_UNSIGNED_INT, (GLvoid*) (sizeof(GLuint)*start));
+}
+
+/* Quads [i0, i1) x [j0, j1) of a grid being swept */
+static void sweep_quads(int i0, int i1, int j0, int j1)
+{
+  if((i1 <= i0) || (j1 <= j0))
+    return;
+  glUniform1i(sweep_start, j0);
+  glDrawArraysInstancedARB(GL_TRIANGLE_STRIP, 2*i0, 2*(i1 - i0 + 1), j1 - j0);
+}
+
+/* Draw the patches of a grid which are in view by sweeping its
+   cross-section on the graphics card, merging neighbouring ones in
+   each row of patches into a single call. Needs sweep_prog in use */
+static void draw_sweep(TGeomItem *g, double plane[6][4], double eye[3])
+{
+  int i, backface, i0, i1, j0, j1, r0, r1, c0, c1;
+
+  if(g->sweepvbo == 0)
+    sweep_upload(g);
+  else
+    glBindBuffer(GL_ARRAY_BUFFER, g->sweepvbo);
+  glVertexPointer(3, GL_FLOAT, sizeof(TVertex), (GLvoid*) 0);
+  glColorPointer(4, GL_FLOAT, sizeof(TVertex), (GLvoid*) (3*sizeof(float)));
+
+  glUniform1f(sweep_dphi, g->sweepstep);
+  glUniform1f(sweep_last, g->sweepend);
+  glUniform1i(sweep_cols, g->cols);
+
+  backface = grid_backface(g, plane, eye);
+  r0 = r1 = -1;
+  c0 = c1 = 0;
+  for(i=0;i<g->npatches;i++) {
+    if(!patch_visible(g, i, plane, eye, backface))
+      continue;
+    patch_quads(g, i, &i0, &i1, &j0, &j1);
+    if((i0 != r0) || (j0 != c1)) {
+      sweep_quads(r0, r1, c0, c1);
+      r0 = i0;
+      r1 = i1;
+      c0 = j0;
+    }
+    c1 = j1;
+  }
+  sweep_quads(r0, r1, c0, c1);
+}
+
+/* Draw cached items, each at the level of detail chosen by geom_lod.
+   which is GEOM_OPAQUE for the opaque items, GEOM_BLEND for the
+   transparent ones (in model order), or both. Field-lines are drawn
+   last from one buffer, with their copies made by the graphics card
+   where possible, except into the feedback buffer */
+void geom_draw_items(TGeometry *geom, TCamera *cam, int height, float maxerr, int which)
+{
+  int i, nlines, sweep;
+  GLint rendermode, prog;
+  TGeomItem *g;
+  TGeomLines *l = &geom->lines;
+  double plane[6][4], eye[3];
+
+  glGetIntegerv(GL_RENDER_MODE, &rendermode);
+  glGetIntegerv(GL_CURRENT_PROGRAM, &prog);
+  view_frustum(plane, eye);
+
+  /* Surfaces are swept out by the graphics card, unless going into the
+     feedback buffer or the caller has its own shaders in use */
+  sweep = (rendermode != GL_FEEDBACK) && (prog == 0) && sweep_setup();
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+
+  nlines = 0;
+  for(i=0;i<geom->nitems;i++) {
+    if(!(which & (geom->item[i].blend ? GEOM_BLEND : GEOM_OPAQUE)))
+      continue;
+    g = geom_lod(&geom->item[i], cam, height, maxerr);
+    if(g->nverts <= 0)
+      continue;
+
+    if((g->base >= 0) && (rendermode != GL_FEEDBACK)) {
+      /* Only gather them for now */
+      l->draw[nlines++] = g;
+      continue;
+    }
+
+    if((g->rows > 0) && sweep) {
+      /* Only the parts in view */
+      glUseProgram(sweep_prog);
+      draw_sweep(g, plane, eye);
+      glUseProgram(0);
+      continue;
+    }
+
+    if(g->vbo == 0) {
+      /* First time drawn: upload to the graphics card */
+      if(g->rows > 0)
+	grid_upload(g);
+      else {
+	glGenBuffers(1, &g->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, g->vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(TVertex)*g->nverts, g->vert, GL_STATIC_DRAW);
+      }
+    }else
+      glBindBuffer(GL_ARRAY_BUFFER, g->vbo);
+
+    glVertexPointer(3, GL_FLOAT, sizeof(TVertex), (GLvoid*) 0);
+    glColorPointer(4, GL_FLOAT, sizeof(TVertex), (GLvoid*) (3*sizeof(float)));
+
+    if((g->rows > 0) && (rendermode == GL_FEEDBACK)) {
+      /* Output for gl2ps, which sorts rows in order into a smaller
+	 BSP tree than it does the vertex cache order of the indices */
+      draw_grid_rows(g);
+    }else if(g->rows > 0) {
+      /* Only the parts in view */
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g->ibo);
+      draw_patches(g, plane, eye);
+    }
+
+    if(g->ninstances > 0)
+      draw_instances(g, 0, 0);
+    else if(g->nstrips > 0)
+      glMultiDrawArrays(g->mode, g->first, g->count, g->nstrips);
+  }
+
+  if(nlines > 0) {
+    if(l->vbo == 0)
+      lines_upload(geom);
+    else
+      glBindBuffer(GL_ARRAY_BUFFER, l->vbo);
+    glVertexPointer(3, GL_FLOAT, sizeof(TVertex), (GLvoid*) 0);
+    glColorPointer(4, GL_FLOAT, sizeof(TVertex), (GLvoid*) (3*sizeof(float)));
+    for(i=0;i<nlines;i++)
+      draw_instances(l->draw[i], l->draw[i]->base, instance_setup());
+  }
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+/* Draw all cached items, each at the level of detail chosen by geom_lod.
+   Needs a current OpenGL context */
+void geom_draw(TGeometry *geom, TCamera *cam, int height, float maxerr)
+{
+  geom_draw_items(geom, cam, height, maxerr, GEOM_OPAQUE | GEOM_BLEND);
+}
+
+/* Draw all cached items for blending: first the opaque ones, then the
+   triangles of transparent ones sorted from back to front as seen from
+   cam. These are depth tested against the opaque items but don't write
+   depth themselves. Blending should be set up by the caller */
+void geom_draw_blend(TGeometry *geom, TCamera *cam, int height, float maxerr)
+{
+  TGeomBlend *b = &geom->blend;
+  double eye[3];
+  int changed;
+
+  geom_draw_items(geom, cam, height, maxerr, GEOM_OPAQUE);
+  if(b->ntris == 0)
+    return;
+
+  changed = 0;
+  if(cam != NULL) {
+    eye[0] = cam->cx;
+    eye[1] = cam->cy;
+    eye[2] = cam->cz;
+    changed = blend_sort(b, eye);
+  }
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
+
+  if(b->vbo == 0) {
+    glGenBuffers(1, &b->vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, b->vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(TVertex)*b->nverts, b->vert, GL_STATIC_DRAW);
+  }else
+    glBindBuffer(GL_ARRAY_BUFFER, b->vbo);
+
+  /* The order changes as the camera moves */
+  if(b->ibo == 0) {
+    glGenBuffers(1, &b->ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*3*b->ntris,
+		 b->sorted ? b->index : b->tri, GL_DYNAMIC_DRAW);
+  }else {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, b->ibo);
+    if(changed)
+      glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, sizeof(GLuint)*3*b->ntris, b->index);
+  }
+
+  glVertexPointer(3, GL_FLOAT, sizeof(TVertex), (GLvoid*) 0);
+  glColorPointer(4, GL_FLOAT, sizeof(TVertex), (GLvoid*) (3*sizeof(float)));
+
+  glDepthMask(GL_FALSE);
+  glDrawElements(GL_TRIANGLES, 3*b->ntris, GL_UNSIGNED_INT, (GLvoid*) 0);
+  glDepthMask(GL_TRUE);
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+/* Estimate the number of floats needed to capture all cached items
+   in a GL_3D_COLOR feedback buffer (before any clipping) */
+int geom_feedback_size(TGeometry *geom)
+{
+  int i, j;
+  double size, part;
+  TGeomItem *g;
+
+  /* Each vertex is x, y, z plus RGBA color */
+  const int vsize = 7;
+
+  size = 0.0;
+  for(i=0;i<geom->nitems;i++) {
+    g = &geom->item[i];
+    part = 0.0;
+    if(g->mode == GL_TRIANGLES) {
+      /* Polygon token, vertex count and 3 vertices */
+      part += (g->nindices/3) * (2.0 + 3*vsize);
+    }
+    for(j=0;j<g->nstrips;j++) {
+      switch(g->mode) {
+      case GL_QUAD_STRIP: {
+	/* Drivers (e.g. Mesa) usually return quads as two triangles,
+	   each a polygon token, vertex count and 3 vertices */
+	if(g->count[j] >= 4)
+	  part += (g->count[j]/2 - 1) * 2*(2.0 + 3*vsize);
+	break;
+      }
+      case GL_QUADS: {
+	part += (g->count[j]/4) * 2*(2.0 + 3*vsize);
+	break;
+      }
+      case GL_LINE_STRIP: {
+	/* Line token and 2 vertices per segment */
+	if(g->count[j] >= 2)
+	  part += (g->count[j] - 1) * (1.0 + 2*vsize);
+	break;
+      }
+      default: {
+	part += g->count[j] * (1.0 + vsize);
+      }
+      }
+    }
+    /* Every copy of a field-line goes through the buffer */
+    size += part * ((g->ninstances > 0) ? g->ninstances : 1);
+  }
+
+  /* Leave room for pass-through tokens and some clipping */
+  size = 1.1*size + 1024.0;
+  if(size > (double) (1<<30))
+    size = (double) (1<<30);
+  return (int) size;
+}
+
+/* Release all memory and buffer objects. Buffer objects can only be
+   deleted when there is a current OpenGL context */
+void geom_free(TGeometry *geom)
+{
+  int i;
+
+  if(geom == NULL)
+    return;
+
+  for(i=0;i<geom->nitems;i++)
+    geom_item_free(&geom->item[i]);
+  blend_free(&geom->blend);
+  lines_free(&geom->lines);
+
+  if(geom->nitems > 0)
+    free(geom->item);
+  geom->item = NULL;
+  geom->nitems = 0;
+}
+
+/*************************************************************************
+ * Integrate a function using QROMB method
+ *************************************************************************/
+
+/* Fractional error, determined by extrapolation error */
+#define EPS 1.0e-6
+/* Maximum number of steps */
+#define JMAX 20
+#define JMAXP (JMAX+1)
+/* Number of points to use in extrapolation */
+#define K 5
+
+/* Integrate function from a to b */
+float qromb(float (*func)(float, void*), float a, float b, void *params)
+{
+  float ss, dss;
+  float s[JMAXP], h[JMAXP+1];
+  int j;
+
+  h[0] = 1.0;
+  for(j=0;j!=JMAX;j++) {
+    s[j] = trapzd(func, a, b, j+1, params, (j > 0) ? s[j-1] : 0.0);
+    if(j > K) {
+      polint(&h[j-K], &s[j-K], 0.0, &ss, &dss);
+      if(fabs(dss) <= EPS*fabs(ss)) return(ss);
+      if(fabs(ss) < 1.0e-14) {
+	printf("Value of function within rounding errors\n");
+	return(0.0);
+      }
+    }
+    h[j+1] = 0.25*h[j];
+  }
+  printf("Too many steps in function qromb\n");
+  return(0.0);
+}
+
+#define FUNC(x, p) ((*func)(x, p))
+
+/* Call with n=1 returns crudest estimate, subsequent calls improve accuracy by adding 2^(n-2) additional points.
+   s is the result of the previous call (unused for n=1) */
+float trapzd(float (*func)(float, void*), float a, float b, int n, void *p, float s)
+{
+  float x, tnm, sum, del;
+  int it, j;
+
+  if(n == 1) {
+    s = 0.5*(b-a)*(FUNC(a, p)+FUNC(b, p));
+  }else {
+    for(it=1,j=1;j<(n-1);j++) it <<= 1;
+    tnm = it;
+    del = (b-a)/tnm;
+    x = a+0.5*del;
+    for(sum=0.0,j=1;j<=it;j++,x+=del) sum += FUNC(x, p);
+    s = 0.5*(s+(b-a)*sum/tnm); /* refine s */
+  }
+  return(s);
+}
+
+#define POL_N K
+
+/* Polynomial interpolation/extrapolation: Input xa and ya, returns value y at x with error estimate dy */
+void polint(float *xa, float *ya, float x, float *y, float *dy)
+{
+  int i, m, ns=0;
+  float den, dif, dift, ho, hp, w;
+  float c[POL_N], d[POL_N];
+
+  dif = fabs(x - xa[0]);
+  for(i=1;i<=POL_N;i++) {
+    /* Find closest index */
+    if((dift = fabs(x - xa[i-1])) < dif) {
+      ns = i;
+      dif = dift;
+    }
+    c[i-1] = ya[i-1];
+    d[i-1] = ya[i-1];
+  }
+
+  *y = ya[ns--];
+  for(m=1;m<POL_N;m++) {
+    for(i=1;i<=(POL_N-m);i++) {
+      ho = xa[i-1] - x;
+      hp = xa[i+m-1] - x;
+      w = c[i] - d[i-1];
+      /* Two xa's within roundoff */
+      if( (den = ho-hp) == 0.0) printf("problem in polint\n");
+      den = w / den;
+      d[i-1] = hp*den;
+      c[i-1] = ho*den;
+    }
+    *y += (*dy=(2*ns < (POL_N-m) ? c[ns] : d[(ns--)-1]));
+  }
+}
@@ -0,0 +1,125 @@
+/*****************************************************************
+ * Cached geometry for model items
+ *****************************************************************/
+
+#ifndef __GEOMETRY_H__
+#define __GEOMETRY_H__
+
+#include <GL/gl.h>
+
+#include "model.h"
+
+/* Interleaved vertex: position followed by color */
+typedef struct {
+  float x, y, z;
+  float r, g, b, a;
+}TVertex;
+
+/* Part of an indexed mesh, with bounds used to skip it when out of view */
+typedef struct {
+  GLsizei first, count; /* Range of the grid's indices holding its triangles */
+  float centre[3], radius; /* Bounding sphere */
+  float axis[3];    /* Average outward normal */
+  float cosa, sina; /* Half-angle of the cone containing all normals.
+		       cosa <= 0 if they face more than one way */
+}TGeomPatch;
+
+/* Tessellated geometry for a single model item */
+typedef struct _TGeomItem {
+  GLenum mode;      /* Primitive type (GL_QUAD_STRIP, GL_LINE_STRIP, ...) */
+
+  int nverts;
+  TVertex *vert;    /* Array of vertices */
+
+  int nstrips;
+  GLint *first;     /* Index of the first vertex in each strip */
+  GLsizei *count;   /* Number of vertices in each strip */
+
+  /* Field-lines are stored once, and drawn as copies rotated about the
+     vertical axis. Cosines of the angle of each copy, then the sines */
+  int ninstances;   /* 0 if only drawn as they are */
+  float *instance;
+
+  GLuint vbo;       /* Vertex buffer object. 0 if not yet uploaded */
+
+  /* Indexed meshes (GL_TRIANGLES) have no strips. They are surfaces
+     swept around the y axis, as a grid of rows x cols vertices. Only
+     the cross-section is stored, with vertex (i, 0) at vert[i], and
+     vertex (i, j) is that rotated by the angle of column j (see
+     geom_grid_vertex). If the grid closes on itself, row (or column) 0
+     also follows the last one */
+  int rows, cols;
+  int wraprows, wrapcols;
+  float *sweep;     /* Cosines of the angle of each column, then the sines */
+  float sweepstep, sweepend; /* Angle between columns, and of the last one */
+  GLuint sweepvbo;  /* Cross-section as a strip, swept on the graphics card */
+  int nindices;     /* Three for each triangle, made when needed */
+  GLuint ibo;       /* Index buffer object. 0 if not yet uploaded */
+  int npatches;
+  TGeomPatch *patch; /* Blocks of quads, in the order of the indices */
+
+  /* Levels of detail */
+  float error;      /* Furthest any full resolution vertex is from this one */
+  int nlod;
+  struct _TGeomItem *lod; /* Coarser versions, each half the resolution of the last */
+  float ring, extent; /* Item is within extent of a circle of radius ring about the y axis */
+
+  int blend;        /* Transparent, so drawn from TGeometry::blend when sorting */
+  GLint base;       /* Field-lines: index of the first vertex in TGeometry::lines */
+}TGeomItem;
+
+/* The triangles of all transparent items, kept in order from back
+   to front for the current camera */
+typedef struct {
+  int nverts;
+  TVertex *vert;
+
+  int ntris;
+  GLuint *tri;      /* Three vertices for each triangle */
+  float *centre;    /* Centre of each triangle (x, y, z) */
+  GLuint *order;    /* Triangles from back to front, then ntris scratch */
+  unsigned int *key; /* Sort key of each triangle in order, then scratch */
+  GLuint *index;    /* Vertices of the triangles in order */
+
+  int sorted;       /* 0 if order has to be sorted from scratch */
+  double eye[3];    /* Camera location order was sorted for */
+
+  GLuint vbo, ibo;  /* Buffer objects. 0 if not yet uploaded */
+}TGeomBlend;
+
+/* The field-lines of all items at every level of detail, in one
+   buffer so that they can all be drawn in a single call */
+typedef struct {
+  int nverts;
+  int nitems;
+  TGeomItem **draw; /* Items to draw, gathered while drawing the rest */
+
+  GLuint vbo;       /* Buffer object. 0 if not yet uploaded */
+}TGeomLines;
+
+typedef struct {
+  int nitems;
+  TGeomItem *item;  /* One for each item in the model */
+
+  TGeomBlend blend;
+  TGeomLines lines;
+}TGeometry;
+
+/* Which items geom_draw_items draws */
+#define GEOM_OPAQUE 1
+#define GEOM_BLEND  2
+
+int geom_build(TGeometry *geom, TModel *model);
+int geom_update(TGeometry *geom, TModel *old, TModel *model);
+void geom_set_threads(int nthreads);
+TGeomItem *geom_lod(TGeomItem *g, TCamera *cam, int height, float maxerr);
+void geom_draw(TGeometry *geom, TCamera *cam, int height, float maxerr);
+void geom_draw_items(TGeometry *geom, TCamera *cam, int height, float maxerr, int which);
+void geom_draw_blend(TGeometry *geom, TCamera *cam, int height, float maxerr);
+void geom_free(TGeometry *geom);
+
+int geom_feedback_size(TGeometry *geom);
+void geom_instance_vertex(TGeomItem *g, int k, TVertex *in, TVertex *out);
+void geom_grid_vertex(TGeomItem *g, int i, int j, TVertex *out);
+
+#endif /* __GEOMETRY_H__ */
@@ -73,6 +73,24 @@
 #include <png.h>
 #endif
 
+#if defined(GL2PS_HAVE_PTHREAD)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/* Storage class of the current context, so that each thread can work
+   on its own page */
+
+#if !defined(GL2PS_HAVE_PTHREAD)
+#  define GL2PS_THREAD_LOCAL
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#  define GL2PS_THREAD_LOCAL _Thread_local
+#elif defined(_MSC_VER)
+#  define GL2PS_THREAD_LOCAL __declspec(thread)
+#else
+#  define GL2PS_THREAD_LOCAL __thread
+#endif
+
 /********************************************************************* 
  *
  * Private definitions, data structures and prototypes
@@ -88,14 +106,20 @@
 #define GL2PS_ZOFFSET_LARGE 20.0F
 #define GL2PS_ZERO(arg)     (fabs(arg) < 1.e-20)
 
+/* Memory arenas: size of the blocks, number of vertices of the largest
+   recycled primitives, and maximum number of threads (each one has
+   its own arena) */
+
+#define GL2PS_ARENA_BLOCK   (1 << 20)
+#define GL2PS_RECYCLE_VERTS 4
+#define GL2PS_MAX_THREADS   64
+#define GL2PS_OUTPUT_BUFFER (1 << 16)
+
 /* Primitive types */
 
 #define GL2PS_NO_TYPE          -1
 #define GL2PS_TEXT             1
-#define GL2PS_POINT            2
-#define GL2PS_LINE             3
 #define GL2PS_QUADRANGLE       4
-#define GL2PS_TRIANGLE         5
 #define GL2PS_PIXMAP           6
 #define GL2PS_IMAGEMAP         7
 #define GL2PS_IMAGEMAP_WRITTEN 8
@@ -142,7 +166,6 @@ typedef enum {
   T_VAR_ALPHA    = 1<<4
 } GL2PS_TRIANGLE_PROPERTY;
 
-typedef GLfloat GL2PSxyz[3];
 typedef GLfloat GL2PSplane[4];
 
 typedef struct _GL2PSbsptree2d GL2PSbsptree2d;
@@ -152,9 +175,22 @@ struct _GL2PSbsptree2d {
   GL2PSbsptree2d *front, *back;
 };
 
+typedef struct _GL2PSarenablock GL2PSarenablock;
+
+struct _GL2PSarenablock {
+  GL2PSarenablock *next;
+  size_t size, used;
+};
+
+typedef struct {
+  GL2PSarenablock *block;
+  void *freeprims[GL2PS_RECYCLE_VERTS + 1]; /* recycled primitives */
+} GL2PSarena;
+
 typedef struct {
   GLint nmax, size, incr, n;
   char *array;
+  GL2PSarena *arena; /* if not NULL, the array is allocated in this arena */
 } GL2PSlist;
 
 typedef struct _GL2PSbsptree GL2PSbsptree;
@@ -165,11 +201,6 @@ struct _GL2PSbsptree {
   GL2PSbsptree *front, *back;
 };
 
-typedef struct {
-  GL2PSxyz xyz;
-  GL2PSrgba rgba;
-} GL2PSvertex;
-
 typedef struct {
   GL2PSvertex vertex[3];
   int prop;
@@ -222,13 +253,28 @@ typedef struct {
 #endif
 } GL2PScompress;
 
+/* All output goes through this buffer, and through a zlib stream while
+   writing gzipped files or compressed PDF page streams */
+
+typedef struct {
+  char *buf;
+  int len;
+#if defined(GL2PS_HAVE_ZLIB)
+  z_stream zstream;
+  Bytef *zbuf;
+  GLboolean deflating, gzip;
+  uLong crc;
+  int zlen;
+#endif
+} GL2PSoutput;
+
 typedef struct{
   GL2PSlist* ptrlist;
   int gsno, fontno, imno, shno, maskshno, trgroupno;
   int gsobjno, fontobjno, imobjno, shobjno, maskshobjno, trgroupobjno;
 } GL2PSpdfgroup;
 
-typedef struct {
+struct _GL2PScontext {
   /* General */
   GLint format, sort, options, colorsize, colormode, buffersize;
   char *title, *producer, *filename;
@@ -240,11 +286,17 @@ typedef struct {
   GL2PSvertex lastvertex;
   GL2PSlist *primitives, *auxprimitives;
   FILE *stream;
+  GL2PSoutput out;
   GL2PScompress *compress;
   GLboolean header;
 
+  /* Primitives, BSP trees and their lists are allocated in these
+     arenas (one per thread) and all released by gl2psEndPage */
+  GL2PSarena arena[GL2PS_MAX_THREADS];
+
   /* BSP-specific */
-  GLint maxbestroot;
+  GLint maxbestroot, bspsamples;
+  GLint bspnodes, bspdepth, bspsplits;
 
   /* Occlusion culling-specific */
   GLboolean zerosurfacearea;
@@ -266,7 +318,7 @@ typedef struct {
   /* for image map list */
   GL2PSimagemap *imagemap_head;
   GL2PSimagemap *imagemap_tail;
-} GL2PScontext;
+};
 
 typedef struct {
   void  (*printHeader)(void);
@@ -279,10 +331,11 @@ typedef struct {
   const char *description;
 } GL2PSbackend;
 
-/* The gl2ps context. gl2ps is not thread safe (we should create a
-   local GL2PScontext during gl2psBeginPage) */
+/* The current gl2ps context of this thread. Every page has its own
+   context, created by gl2psBeginPage, so different threads can write
+   different pages at the same time */
 
-static GL2PScontext *gl2ps = NULL;
+static GL2PS_THREAD_LOCAL GL2PScontext *gl2ps = NULL;
 
 /* Need to forward-declare this one */
 
@@ -312,6 +365,29 @@ static void gl2psMsg(GLint level, const char *fmt, ...)
   /* if(level == GL2PS_ERROR) exit(1); */
 }
 
+/* ctime and gmtime, using the reentrant versions when pages can be
+   written by several threads at once */
+
+static char *gl2psCtime(const time_t *t)
+{
+#if defined(GL2PS_HAVE_PTHREAD) && !defined(_WIN32)
+  static GL2PS_THREAD_LOCAL char buf[32];
+  return ctime_r(t, buf);
+#else
+  return ctime(t);
+#endif
+}
+
+static struct tm *gl2psGmtime(const time_t *t)
+{
+#if defined(GL2PS_HAVE_PTHREAD) && !defined(_WIN32)
+  static GL2PS_THREAD_LOCAL struct tm res;
+  return gmtime_r(t, &res);
+#else
+  return gmtime(t);
+#endif
+}
+
 static void *gl2psMalloc(size_t size)
 {
   void *ptr;
@@ -342,13 +418,194 @@ static void gl2psFree(void *ptr)
   free(ptr);
 }
 
+/* Arena allocation: memory is taken from large blocks and is only
+   released all at once by gl2psArenaFree */
+
+#define GL2PS_ARENA_ALIGN(n) (((n) + 15) & ~((size_t)15))
+#define GL2PS_ARENA_HEADER   GL2PS_ARENA_ALIGN(sizeof(GL2PSarenablock))
+#define GL2PS_ARENA_DATA(b)  ((char*)(b) + GL2PS_ARENA_HEADER)
+
+static void *gl2psArenaAlloc(GL2PSarena *arena, size_t size)
+{
+  GL2PSarenablock *b = arena->block, *nb;
+  char *ptr;
+
+  if(!size) return(NULL);
+  size = GL2PS_ARENA_ALIGN(size);
+  if(!b || b->used + size > b->size){
+    if(size > GL2PS_ARENA_BLOCK / 4){
+      /* big allocations get a block of their own, so that the space
+         left in the current block is not wasted */
+      nb = (GL2PSarenablock*)gl2psMalloc(GL2PS_ARENA_HEADER + size);
+      nb->size = nb->used = size;
+      if(b){
+        nb->next = b->next;
+        b->next = nb;
+      }
+      else{
+        nb->next = NULL;
+        arena->block = nb;
+      }
+      return(GL2PS_ARENA_DATA(nb));
+    }
+    nb = (GL2PSarenablock*)gl2psMalloc(GL2PS_ARENA_HEADER + GL2PS_ARENA_BLOCK);
+    nb->size = GL2PS_ARENA_BLOCK;
+    nb->used = 0;
+    nb->next = b;
+    arena->block = b = nb;
+  }
+  ptr = GL2PS_ARENA_DATA(b) + b->used;
+  b->used += size;
+  return(ptr);
+}
+
+static void gl2psArenaInit(GL2PSarena *arena)
+{
+  GLint i;
+
+  arena->block = NULL;
+  for(i = 0; i <= GL2PS_RECYCLE_VERTS; i++){
+    arena->freeprims[i] = NULL;
+  }
+}
+
+static void gl2psArenaFree(GL2PSarena *arena)
+{
+  GL2PSarenablock *b, *next;
+
+  for(b = arena->block; b != NULL; b = next){
+    next = b->next;
+    gl2psFree(b);
+  }
+  gl2psArenaInit(arena);
+}
+
+/* Primitives and their vertices are allocated together. Building the
+   BSP tree and culling discard about as many primitives (split or
+   divided into triangles) as they create, so those with up to
+   GL2PS_RECYCLE_VERTS vertices are kept in free lists for reuse */
+
+static GL2PSprimitive *gl2psArenaPrimitive(GL2PSarena *arena, GLshort numverts)
+{
+  GL2PSprimitive *prim;
+
+  if(numverts <= GL2PS_RECYCLE_VERTS && arena->freeprims[numverts]){
+    prim = (GL2PSprimitive*)arena->freeprims[numverts];
+    arena->freeprims[numverts] = *(void**)prim;
+  }
+  else{
+    prim = (GL2PSprimitive*)gl2psArenaAlloc(arena, sizeof(GL2PSprimitive) + 
+                                            numverts * sizeof(GL2PSvertex));
+  }
+  prim->numverts = numverts;
+  prim->verts = (GL2PSvertex*)(prim + 1);
+  return prim;
+}
+
+/* Give back a primitive that is no longer referenced. It can go in
+   the free list of any arena, since they are all released together */
+
+static void gl2psArenaRecycle(GL2PSarena *arena, GL2PSprimitive *prim)
+{
+  if(prim->numverts > GL2PS_RECYCLE_VERTS) return;
+  *(void**)prim = arena->freeprims[prim->numverts];
+  arena->freeprims[prim->numverts] = prim;
+}
+
+/* Buffered output. Everything written to the stream goes through
+   gl2psWrite, so that gzipped files and compressed PDF page streams
+   can be deflated as they are written instead of being built in
+   memory first */
+
+#if defined(GL2PS_HAVE_ZLIB)
+
+static void gl2psDeflateOutput(int flush)
+{
+  GL2PSoutput *out = &gl2ps->out;
+  int n;
+
+  if(out->gzip)
+    out->crc = crc32(out->crc, (Bytef*)out->buf, out->len);
+  out->zstream.next_in = (Bytef*)out->buf;
+  out->zstream.avail_in = out->len;
+  do{
+    out->zstream.next_out = out->zbuf;
+    out->zstream.avail_out = GL2PS_OUTPUT_BUFFER;
+    if(deflate(&out->zstream, flush) == Z_STREAM_ERROR){
+      gl2psMsg(GL2PS_ERROR, "Zlib deflate error");
+      break;
+    }
+    n = GL2PS_OUTPUT_BUFFER - out->zstream.avail_out;
+    fwrite(out->zbuf, 1, n, gl2ps->stream);
+    out->zlen += n;
+  } while(out->zstream.avail_out == 0);
+}
+
+#endif
+
+static void gl2psFlushOutput(void)
+{
+  GL2PSoutput *out = &gl2ps->out;
+
+#if defined(GL2PS_HAVE_ZLIB)
+  if(out->deflating){
+    if(out->len) gl2psDeflateOutput(Z_NO_FLUSH);
+    out->len = 0;
+    return;
+  }
+#endif
+  if(out->len) fwrite(out->buf, 1, out->len, gl2ps->stream);
+  out->len = 0;
+}
+
+/* Room for n more bytes at the end of the buffer (n must not be larger
+   than GL2PS_OUTPUT_BUFFER) */
+
+static char *gl2psOutputSpace(int n)
+{
+  if(gl2ps->out.len + n > GL2PS_OUTPUT_BUFFER)
+    gl2psFlushOutput();
+  return gl2ps->out.buf + gl2ps->out.len;
+}
+
+static void gl2psWrite(const void *data, int n)
+{
+  GL2PSoutput *out = &gl2ps->out;
+  const char *src = (const char*)data;
+  int len;
+
+  while(n > 0){
+    if(out->len == GL2PS_OUTPUT_BUFFER)
+      gl2psFlushOutput();
+    len = GL2PS_OUTPUT_BUFFER - out->len;
+    if(len > n) len = n;
+    memcpy(out->buf + out->len, src, len);
+    out->len += len;
+    src += len;
+    n -= len;
+  }
+}
+
+/* Number of bytes that reached the file for n bytes of output: the
+   caller can't know while they are being compressed */
+
+static int gl2psWritten(int n)
+{
+#if defined(GL2PS_HAVE_ZLIB)
+  if(gl2ps->out.deflating) return 0;
+#endif
+  return n;
+}
+
 static size_t gl2psWriteBigEndian(unsigned long data, size_t bytes)
 {
   size_t i;
   size_t size = sizeof(unsigned long);
+  char *buf = gl2psOutputSpace((int)bytes);
   for(i = 1; i <= bytes; ++i){
-    fputc(0xff & (data >> (size-i) * 8), gl2ps->stream);
+    *buf++ = (char)(0xff & (data >> (size-i) * 8));
   }
+  gl2ps->out.len += (int)bytes;
   return bytes;
 }
 
@@ -356,6 +613,66 @@ static size_t gl2psWriteBigEndian(unsigned long data, size_t bytes)
 
 #if defined(GL2PS_HAVE_ZLIB)
 
+/* Compress all further output, as a raw deflate stream for gzip files
+   (which carry their own header and footer) or a zlib stream for PDF */
+
+static void gl2psBeginDeflate(GLboolean gzip)
+{
+  GL2PSoutput *out = &gl2ps->out;
+
+  gl2psFlushOutput();
+  memset(&out->zstream, 0, sizeof(z_stream));
+  if(deflateInit2(&out->zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                  gzip ? -MAX_WBITS : MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+    gl2psMsg(GL2PS_ERROR, "Zlib deflate error");
+    return;
+  }
+  out->zbuf = (Bytef*)gl2psMalloc(GL2PS_OUTPUT_BUFFER);
+  out->deflating = GL_TRUE;
+  out->gzip = gzip;
+  out->crc = crc32(0L, Z_NULL, 0);
+  out->zlen = 0;
+}
+
+/* Finish the compressed stream. Returns the compressed length */
+
+static int gl2psEndDeflate(void)
+{
+  GL2PSoutput *out = &gl2ps->out;
+  uLong crc, len;
+  char tmp[8];
+  int n;
+
+  if(!out->deflating)
+    return 0;
+
+  gl2psDeflateOutput(Z_FINISH);
+  out->len = 0;
+  crc = out->crc;
+  len = out->zstream.total_in;
+  deflateEnd(&out->zstream);
+  gl2psFree(out->zbuf);
+  out->zbuf = NULL;
+  out->deflating = GL_FALSE;
+
+  if(out->gzip){
+    /* add the gzip file footer */
+    for(n = 0; n < 4; ++n){
+      tmp[n] = (char)(crc & 0xff);
+      crc >>= 8;
+    }
+    for(n = 4; n < 8; ++n){
+      tmp[n] = (char)(len & 0xff);
+      len >>= 8;
+    }
+    gl2psWrite(tmp, 8);
+  }
+  return out->zlen;
+}
+
+/* The PDF shading and image objects are still compressed in one go,
+   since their length has to be written before the data */
+
 static void gl2psSetupCompress(void)
 {
   gl2ps->compress = (GL2PScompress*)gl2psMalloc(sizeof(GL2PScompress));
@@ -382,36 +699,17 @@ static void gl2psFreeCompress(void)
 static int gl2psAllocCompress(unsigned int srcsize)
 {
   gl2psFreeCompress();
-  
+
   if(!gl2ps->compress || !srcsize)
     return GL2PS_ERROR;
-  
+
   gl2ps->compress->srcLen = srcsize;
   gl2ps->compress->destLen = (int)ceil(1.001 * gl2ps->compress->srcLen + 12);
   gl2ps->compress->src = (Bytef*)gl2psMalloc(gl2ps->compress->srcLen);
   gl2ps->compress->start = gl2ps->compress->src;
   gl2ps->compress->dest = (Bytef*)gl2psMalloc(gl2ps->compress->destLen);
-  
-  return GL2PS_SUCCESS;
-}
 
-static void *gl2psReallocCompress(unsigned int srcsize)
-{
-  if(!gl2ps->compress || !srcsize)
-    return NULL;
-  
-  if(srcsize < gl2ps->compress->srcLen)
-    return gl2ps->compress->start;
-  
-  gl2ps->compress->srcLen = srcsize;
-  gl2ps->compress->destLen = (int)ceil(1.001 * gl2ps->compress->srcLen + 12);
-  gl2ps->compress->src = (Bytef*)gl2psRealloc(gl2ps->compress->src, 
-                                              gl2ps->compress->srcLen);
-  gl2ps->compress->start = gl2ps->compress->src;
-  gl2ps->compress->dest = (Bytef*)gl2psRealloc(gl2ps->compress->dest, 
-                                               gl2ps->compress->destLen);
-  
-  return gl2ps->compress->start;
+  return GL2PS_SUCCESS;
 }
 
 static size_t gl2psWriteBigEndianCompress(unsigned long data, size_t bytes)
@@ -429,38 +727,249 @@ static int gl2psDeflate(void)
 {
   /* For compatibility with older zlib versions, we use compress(...)
      instead of compress2(..., Z_BEST_COMPRESSION) */
-  return compress(gl2ps->compress->dest, &gl2ps->compress->destLen, 
-                  gl2ps->compress->start, gl2ps->compress->srcLen);  
+  return compress(gl2ps->compress->dest, &gl2ps->compress->destLen,
+                  gl2ps->compress->start, gl2ps->compress->srcLen);
 }
 
 #endif
 
-static int gl2psPrintf(const char* fmt, ...)
+/* Number formatting. Writing coordinates and colors with vfprintf is
+   most of the cost of writing a large file, so the common conversions
+   are done by hand. They must give exactly the same result as printf:
+   values which are too large, or too close to a rounding tie for
+   double precision to decide, are left to sprintf */
+
+static const double gl2psPow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+static int gl2psFormatUnsigned(char *str, unsigned long val)
 {
-  int ret;
-  va_list args;
+  char tmp[24];
+  int i = 0, n = 0;
 
-#if defined(GL2PS_HAVE_ZLIB)
-  unsigned int oldsize = 0;
-  static char buf[1000];
-  if(gl2ps->options & GL2PS_COMPRESS){
-    va_start(args, fmt);
-    ret = vsprintf(buf, fmt, args);
-    va_end(args);
-    oldsize = gl2ps->compress->srcLen;
-    gl2ps->compress->start = (Bytef*)gl2psReallocCompress(oldsize + ret);
-    memcpy(gl2ps->compress->start+oldsize, buf, ret);
-    ret = 0;
+  do{
+    tmp[i++] = (char)('0' + val % 10);
+    val /= 10;
+  } while(val);
+  while(i) str[n++] = tmp[--i];
+  return n;
+}
+
+static int gl2psFormatInt(char *str, long val)
+{
+  if(val < 0){
+    *str = '-';
+    return 1 + gl2psFormatUnsigned(str + 1, 0UL - (unsigned long)val);
+  }
+  return gl2psFormatUnsigned(str, (unsigned long)val);
+}
+
+static int gl2psFormatHex(char *str, unsigned long val, int mindigits)
+{
+  static const char digits[] = "0123456789abcdef";
+  char tmp[24];
+  int i = 0, n = 0;
+
+  do{
+    tmp[i++] = digits[val & 0xf];
+    val >>= 4;
+  } while(val);
+  while(i < mindigits) tmp[i++] = '0';
+  while(i) str[n++] = tmp[--i];
+  return n;
+}
+
+/* Write the sign, and make val positive. -0.0 is printed as "-0" */
+
+static int gl2psFormatSign(char *str, double *val)
+{
+  if(*val < 0.0 || (*val == 0.0 && 1.0 / *val < 0.0)){
+    *str = '-';
+    *val = -*val;
+    return 1;
+  }
+  return 0;
+}
+
+/* %g */
+
+static int gl2psFormatG(char *str, double val)
+{
+  double scaled, frac;
+  unsigned long digits;
+  char d[8];
+  int n, e, i, last;
+
+  n = gl2psFormatSign(str, &val);
+  if(val == 0.0){
+    str[n++] = '0';
+    return n;
+  }
+  if(!(val >= 1e-4 && val < 1e6))
+    return sprintf(str, "%g", (n ? -val : val));
+
+  /* 6 significant digits, from 10^e */
+  for(e = 5; val < ((e >= 0) ? gl2psPow10[e] : 1.0 / gl2psPow10[-e]); e--);
+  scaled = val * gl2psPow10[5 - e];
+  digits = (unsigned long)scaled;
+  frac = scaled - (double)digits;
+  if(fabs(frac - 0.5) < 1e-6)
+    return sprintf(str, "%g", (n ? -val : val));
+  if(frac > 0.5) digits++;
+  if(digits == 1000000UL){
+    digits = 100000UL;
+    if(++e > 5)
+      return sprintf(str, "%g", (n ? -val : val));
+  }
+  for(i = 5; i >= 0; i--){
+    d[i] = (char)('0' + digits % 10);
+    digits /= 10;
+  }
+  for(last = 5; last > 0 && d[last] == '0'; last--);
+
+  if(e >= 0){
+    for(i = 0; i <= e; i++) str[n++] = d[i];
+    if(last > e){
+      str[n++] = '.';
+      for(i = e + 1; i <= last; i++) str[n++] = d[i];
+    }
   }
   else{
-#endif
-    va_start(args, fmt);
-    ret = vfprintf(gl2ps->stream, fmt, args);
-    va_end(args);
-#if defined(GL2PS_HAVE_ZLIB)
+    str[n++] = '0';
+    str[n++] = '.';
+    for(i = -1; i > e; i--) str[n++] = '0';
+    for(i = 0; i <= last; i++) str[n++] = d[i];
   }
-#endif
-  return ret;
+  return n;
+}
+
+/* %.<prec>f */
+
+static int gl2psFormatF(char *str, double val, int prec)
+{
+  double scaled, frac, ipart;
+  unsigned long fpart;
+  int n, i;
+
+  n = gl2psFormatSign(str, &val);
+  if(prec > 6 || !(val < 1e6))
+    return sprintf(str, "%.*f", prec, (n ? -val : val));
+
+  scaled = floor(val * gl2psPow10[prec]);
+  frac = val * gl2psPow10[prec] - scaled;
+  if(fabs(frac - 0.5) < 1e-3)
+    return sprintf(str, "%.*f", prec, (n ? -val : val));
+  if(frac > 0.5) scaled += 1.0;
+
+  ipart = floor(scaled / gl2psPow10[prec]);
+  fpart = (unsigned long)(scaled - ipart * gl2psPow10[prec]);
+  n += gl2psFormatUnsigned(str + n, (unsigned long)ipart);
+  if(prec){
+    str[n++] = '.';
+    for(i = prec - 1; i >= 0; i--){
+      str[n + i] = (char)('0' + fpart % 10);
+      fpart /= 10;
+    }
+    n += prec;
+  }
+  return n;
+}
+
+/* Formatted output. Handles %g, %d, %x, %c, %s and %f (with an optional
+   precision) itself, and any other conversion with sprintf. Returns
+   the number of bytes written, or 0 if the output is being compressed */
+
+#define GL2PS_FORMAT_MAX 512
+
+static int gl2psPrintf(const char* fmt, ...)
+{
+  va_list args;
+  const char *p, *q, *str;
+  char spec[32], *buf;
+  int len, ret = 0, prec, islong;
+
+  va_start(args, fmt);
+  p = fmt;
+  while(*p){
+    if(*p != '%'){
+      for(q = p; *q && *q != '%'; q++);
+      gl2psWrite(p, (int)(q - p));
+      ret += (int)(q - p);
+      p = q;
+      continue;
+    }
+
+    /* Conversion specification: %[flags][width][.prec][l]c */
+    q = ++p;
+    p += strspn(p, "-+ #0");
+    p += strspn(p, "0123456789");
+    prec = -1;
+    if(*p == '.'){
+      prec = atoi(++p);
+      p += strspn(p, "0123456789");
+    }
+    islong = (*p == 'l');
+    if(islong) p++;
+    if(!*p) break;
+
+    buf = gl2psOutputSpace(GL2PS_FORMAT_MAX);
+    len = -1;
+    if(p == q){
+      switch(*p){
+      case '%': buf[0] = '%'; len = 1; break;
+      case 'c': buf[0] = (char)va_arg(args, int); len = 1; break;
+      case 'd': len = gl2psFormatInt(buf, va_arg(args, int)); break;
+      case 'x': len = gl2psFormatHex(buf, va_arg(args, unsigned int), 1); break;
+      case 'g': len = gl2psFormatG(buf, va_arg(args, double)); break;
+      case 'f': len = gl2psFormatF(buf, va_arg(args, double), 6); break;
+      case 's':
+        str = va_arg(args, const char*);
+        len = (int)strlen(str);
+        gl2psWrite(str, len);
+        ret += len;
+        len = 0;
+        break;
+      }
+    }
+    else if(*p == 'f' && *q == '.' && !islong){
+      len = gl2psFormatF(buf, va_arg(args, double), prec);
+    }
+
+    if(len < 0){
+      /* Anything else (widths, flags, long integers) */
+      if(p - q + 3 > (int)sizeof(spec)){
+        gl2psMsg(GL2PS_ERROR, "Unsupported format '%s'", fmt);
+        break;
+      }
+      spec[0] = '%';
+      memcpy(spec + 1, q, p - q + 1);
+      spec[p - q + 2] = '\0';
+      switch(*p){
+      case 'e': case 'E': case 'f': case 'g': case 'G':
+        len = sprintf(buf, spec, va_arg(args, double));
+        break;
+      case 'd': case 'i': case 'c':
+        len = islong ? sprintf(buf, spec, va_arg(args, long)) :
+          sprintf(buf, spec, va_arg(args, int));
+        break;
+      case 'o': case 'u': case 'x': case 'X':
+        len = islong ? sprintf(buf, spec, va_arg(args, unsigned long)) :
+          sprintf(buf, spec, va_arg(args, unsigned int));
+        break;
+      default:
+        gl2psMsg(GL2PS_ERROR, "Unsupported format '%s'", fmt);
+        len = 0;
+        break;
+      }
+    }
+    gl2ps->out.len += len;
+    ret += len;
+    p++;
+  }
+  va_end(args);
+
+  return gl2psWritten(ret);
 }
 
 static void gl2psPrintGzipHeader()
@@ -474,51 +983,20 @@ static void gl2psPrintGzipHeader()
                   '\x03'}; /* OS code: 0x03 (Unix) */
 
   if(gl2ps->options & GL2PS_COMPRESS){
-    gl2psSetupCompress();
     /* add the gzip file header */
-    fwrite(tmp, 10, 1, gl2ps->stream);
+    gl2psWrite(tmp, 10);
+    gl2psBeginDeflate(GL_TRUE);
   }
-#endif  
+#endif
 }
 
 static void gl2psPrintGzipFooter()
 {
 #if defined(GL2PS_HAVE_ZLIB)
-  int n;
-  uLong crc, len;
-  char tmp[8];
-
   if(gl2ps->options & GL2PS_COMPRESS){
-    if(Z_OK != gl2psDeflate()){
-      gl2psMsg(GL2PS_ERROR, "Zlib deflate error");
-    }
-    else{
-      /* determine the length of the header in the zlib stream */
-      n = 2; /* CMF+FLG */
-      if(gl2ps->compress->dest[1] & (1<<5)){
-        n += 4; /* DICTID */
-      }
-      /* write the data, without the zlib header and footer */
-      fwrite(gl2ps->compress->dest+n, gl2ps->compress->destLen-(n+4), 
-             1, gl2ps->stream);
-      /* add the gzip file footer */
-      crc = crc32(0L, gl2ps->compress->start, gl2ps->compress->srcLen);
-      for(n = 0; n < 4; ++n){
-        tmp[n] = (char)(crc & 0xff);
-        crc >>= 8;
-      }
-      len = gl2ps->compress->srcLen;
-      for(n = 4; n < 8; ++n){
-        tmp[n] = (char)(len & 0xff);
-        len >>= 8;
-      }
-      fwrite(tmp, 8, 1, gl2ps->stream);
-    }
-    gl2psFreeCompress();
-    gl2psFree(gl2ps->compress);
-    gl2ps->compress = NULL;
+    gl2psEndDeflate();
   }
-#endif 
+#endif
 }
 
 /* The list handling routines */
@@ -530,19 +1008,53 @@ static void gl2psListRealloc(GL2PSlist *list, GLint n)
     return;
   }
   if(n <= 0) return;
-  if(!list->array){
+  if(list->arena){
+    /* Arena memory can't be resized: double the size and copy */
+    if(n > list->nmax){
+      char *array = list->array;
+      GLint nmax = list->nmax;
+      list->nmax = (n > 2 * nmax) ? n : 2 * nmax;
+      list->array = (char*)gl2psArenaAlloc(list->arena, list->nmax * list->size);
+      if(array) memcpy(list->array, array, nmax * list->size);
+    }
+  }
+  else if(!list->array){
     list->nmax = n;
     list->array = (char*)gl2psMalloc(list->nmax * list->size);
   }
   else{
     if(n > list->nmax){
-      list->nmax = ((n - 1) / list->incr + 1) * list->incr;
+      /* Grow geometrically, so that adding n items one at a time costs
+         O(log n) reallocs; incr is only the smallest step */
+      GLint nmax = list->nmax + ((list->nmax > list->incr) ? list->nmax : list->incr);
+      if(n > nmax) nmax = n;
+      list->nmax = ((nmax - 1) / list->incr + 1) * list->incr;
       list->array = (char*)gl2psRealloc(list->array,
                                         list->nmax * list->size);
     }
   }
 }
 
+/* Make room for at least n items without changing the list contents */
+
+static void gl2psListReserve(GL2PSlist *list, GLint n)
+{
+  if(!list){
+    gl2psMsg(GL2PS_ERROR, "Cannot reserve into unallocated list");
+    return;
+  }
+  if(n <= list->nmax) return;
+  if(list->arena){
+    char *array = list->array;
+    list->array = (char*)gl2psArenaAlloc(list->arena, n * list->size);
+    if(array) memcpy(list->array, array, list->n * list->size);
+  }
+  else{
+    list->array = (char*)gl2psRealloc(list->array, n * list->size);
+  }
+  list->nmax = n;
+}
+
 static GL2PSlist *gl2psListCreate(GLint n, GLint incr, GLint size)
 {
   GL2PSlist *list;
@@ -555,6 +1067,25 @@ static GL2PSlist *gl2psListCreate(GLint n, GLint incr, GLint size)
   list->size = size;
   list->n = 0;
   list->array = NULL;
+  list->arena = NULL;
+  gl2psListRealloc(list, n);
+  return(list);
+}
+
+/* A list allocated in an arena, which must not be deleted */
+
+static GL2PSlist *gl2psArenaListCreate(GL2PSarena *arena, GLint n, GLint size)
+{
+  GL2PSlist *list;
+
+  if(n < 0) n = 0;
+  list = (GL2PSlist*)gl2psArenaAlloc(arena, sizeof(GL2PSlist));
+  list->nmax = 0;
+  list->incr = 1;
+  list->size = size;
+  list->n = 0;
+  list->array = NULL;
+  list->arena = arena;
   gl2psListRealloc(list, n);
   return(list);
 }
@@ -568,6 +1099,10 @@ static void gl2psListReset(GL2PSlist *list)
 static void gl2psListDelete(GL2PSlist *list)
 {
   if(!list) return;  
+  if(list->arena){
+    gl2psMsg(GL2PS_ERROR, "Cannot delete a list allocated in an arena");
+    return;
+  }
   gl2psFree(list->array);
   gl2psFree(list);
 }
@@ -583,6 +1118,18 @@ static void gl2psListAdd(GL2PSlist *list, void *data)
   memcpy(&list->array[(list->n - 1) * list->size], data, list->size);
 }
 
+static void gl2psListAppend(GL2PSlist *list, GL2PSlist *other)
+{
+  if(!list){
+    gl2psMsg(GL2PS_ERROR, "Cannot append into unallocated list");
+    return;
+  }
+  if(!other || !other->n) return;
+  gl2psListRealloc(list, list->n + other->n);
+  memcpy(&list->array[list->n * list->size], other->array, other->n * other->size);
+  list->n += other->n;
+}
+
 static int gl2psListNbr(GL2PSlist *list)
 {
   if(!list)
@@ -762,7 +1309,7 @@ static GLfloat gl2psGetRGB(GL2PSimage *im, GLuint x, GLuint y,
 static GL2PSimage *gl2psCopyPixmap(GL2PSimage *im)
 {
   int size;
-  GL2PSimage *image = (GL2PSimage*)gl2psMalloc(sizeof(GL2PSimage));
+  GL2PSimage *image = (GL2PSimage*)gl2psArenaAlloc(gl2ps->arena, sizeof(GL2PSimage));
   
   image->width = im->width;
   image->height = im->height;
@@ -779,20 +1326,12 @@ static GL2PSimage *gl2psCopyPixmap(GL2PSimage *im)
     break;
   }
 
-  image->pixels = (GLfloat*)gl2psMalloc(size);
+  image->pixels = (GLfloat*)gl2psArenaAlloc(gl2ps->arena, size);
   memcpy(image->pixels, im->pixels, size);
   
   return image;
 }
 
-static void gl2psFreePixmap(GL2PSimage *im)
-{
-  if(!im)
-    return;
-  gl2psFree(im->pixels);
-  gl2psFree(im);
-}
-
 #if defined(GL2PS_HAVE_LIBPNG)
 
 #if !defined(png_jmpbuf)
@@ -870,16 +1409,19 @@ static GLint gl2psAddText(GLint type, const char *str, const char *fontname,
 
   if(gl2ps->options & GL2PS_NO_TEXT) return GL2PS_SUCCESS;
 
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+    gl2psMsg(GL2PS_WARNING, "Text needs an OpenGL raster position");
+    return GL2PS_WARNING;
+  }
+
   glGetBooleanv(GL_CURRENT_RASTER_POSITION_VALID, &valid);
   if(GL_FALSE == valid) return GL2PS_SUCCESS; /* the primitive is culled */
 
   glGetFloatv(GL_CURRENT_RASTER_POSITION, pos);
 
-  prim = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
+  prim = gl2psArenaPrimitive(gl2ps->arena, 1);
   prim->type = type;
   prim->boundary = 0;
-  prim->numverts = 1;
-  prim->verts = (GL2PSvertex*)gl2psMalloc(sizeof(GL2PSvertex));
   prim->verts[0].xyz[0] = pos[0];
   prim->verts[0].xyz[1] = pos[1];
   prim->verts[0].xyz[2] = pos[2];
@@ -889,10 +1431,10 @@ static GLint gl2psAddText(GLint type, const char *str, const char *fontname,
   prim->factor = 0;
   prim->width = 1;
   glGetFloatv(GL_CURRENT_RASTER_COLOR, prim->verts[0].rgba);
-  prim->data.text = (GL2PSstring*)gl2psMalloc(sizeof(GL2PSstring));
-  prim->data.text->str = (char*)gl2psMalloc((strlen(str)+1)*sizeof(char));
+  prim->data.text = (GL2PSstring*)gl2psArenaAlloc(gl2ps->arena, sizeof(GL2PSstring));
+  prim->data.text->str = (char*)gl2psArenaAlloc(gl2ps->arena, (strlen(str)+1)*sizeof(char));
   strcpy(prim->data.text->str, str); 
-  prim->data.text->fontname = (char*)gl2psMalloc((strlen(fontname)+1)*sizeof(char));
+  prim->data.text->fontname = (char*)gl2psArenaAlloc(gl2ps->arena, (strlen(fontname)+1)*sizeof(char));
   strcpy(prim->data.text->fontname, fontname);
   prim->data.text->fontsize = fontsize;
   prim->data.text->alignment = alignment;
@@ -906,10 +1448,10 @@ static GLint gl2psAddText(GLint type, const char *str, const char *fontname,
 
 static GL2PSstring *gl2psCopyText(GL2PSstring *t)
 {
-  GL2PSstring *text = (GL2PSstring*)gl2psMalloc(sizeof(GL2PSstring));
-  text->str = (char*)gl2psMalloc((strlen(t->str)+1)*sizeof(char));
+  GL2PSstring *text = (GL2PSstring*)gl2psArenaAlloc(gl2ps->arena, sizeof(GL2PSstring));
+  text->str = (char*)gl2psArenaAlloc(gl2ps->arena, (strlen(t->str)+1)*sizeof(char));
   strcpy(text->str, t->str); 
-  text->fontname = (char*)gl2psMalloc((strlen(t->fontname)+1)*sizeof(char));
+  text->fontname = (char*)gl2psArenaAlloc(gl2ps->arena, (strlen(t->fontname)+1)*sizeof(char));
   strcpy(text->fontname, t->fontname);
   text->fontsize = t->fontsize;
   text->alignment = t->alignment;
@@ -918,15 +1460,6 @@ static GL2PSstring *gl2psCopyText(GL2PSstring *t)
   return text;
 }
 
-static void gl2psFreeText(GL2PSstring *text)
-{
-  if(!text)
-    return;
-  gl2psFree(text->str);
-  gl2psFree(text->fontname);
-  gl2psFree(text);
-}
-
 /* Helpers for blending modes */
 
 static GLboolean gl2psSupportedBlendMode(GLenum sfactor, GLenum dfactor)
@@ -1027,17 +1560,15 @@ static GL2PSprimitive *gl2psCopyPrimitive(GL2PSprimitive *p)
     return NULL;
   }
 
-  prim = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
+  prim = gl2psArenaPrimitive(gl2ps->arena, p->numverts);
   
   prim->type = p->type;
-  prim->numverts = p->numverts;
   prim->boundary = p->boundary;
   prim->offset = p->offset;
   prim->pattern = p->pattern;
   prim->factor = p->factor;
   prim->culled = p->culled;
   prim->width = p->width;
-  prim->verts = (GL2PSvertex*)gl2psMalloc(p->numverts*sizeof(GL2PSvertex));
   memcpy(prim->verts, p->verts, p->numverts * sizeof(GL2PSvertex));
 
   switch(prim->type){
@@ -1200,21 +1731,26 @@ static void gl2psCutEdge(GL2PSvertex *a, GL2PSvertex *b, GL2PSplane plane,
   c->rgba[3] = (1 - sect) * a->rgba[3] + sect * b->rgba[3];
 }
 
-static void gl2psCreateSplitPrimitive(GL2PSprimitive *parent, GL2PSplane plane,
-                                      GL2PSprimitive *child, GLshort numverts,
-                                      GLshort *index0, GLshort *index1)
+static GL2PSprimitive *gl2psCreateSplitPrimitive(GL2PSarena *arena,
+                                                 GL2PSprimitive *parent,
+                                                 GL2PSplane plane,
+                                                 GLshort numverts,
+                                                 GLshort *index0, GLshort *index1)
 {
+  GL2PSprimitive *child;
   GLshort i;
 
+  if(parent->type != GL2PS_IMAGEMAP && numverts > 4){
+    gl2psMsg(GL2PS_WARNING, "%d vertices in polygon", numverts);
+    numverts = 4;
+  }
+  child = gl2psArenaPrimitive(arena, numverts);
+
   if(parent->type == GL2PS_IMAGEMAP){
     child->type = GL2PS_IMAGEMAP;
     child->data.image = parent->data.image;
   }
   else{
-    if(numverts > 4){
-      gl2psMsg(GL2PS_WARNING, "%d vertices in polygon", numverts);
-      numverts = 4;
-    }
     switch(numverts){
     case 1 : child->type = GL2PS_POINT; break; 
     case 2 : child->type = GL2PS_LINE; break; 
@@ -1230,8 +1766,6 @@ static void gl2psCreateSplitPrimitive(GL2PSprimitive *parent, GL2PSplane plane,
   child->pattern = parent->pattern;
   child->factor = parent->factor;
   child->width = parent->width;
-  child->numverts = numverts;
-  child->verts = (GL2PSvertex*)gl2psMalloc(numverts * sizeof(GL2PSvertex));
 
   for(i = 0; i < numverts; i++){
     if(index1[i] < 0){
@@ -1242,6 +1776,7 @@ static void gl2psCreateSplitPrimitive(GL2PSprimitive *parent, GL2PSplane plane,
                    plane, &child->verts[i]);
     }
   }
+  return child;
 }
 
 static void gl2psAddIndex(GLshort *index0, GLshort *index1, GLshort *nb, 
@@ -1263,7 +1798,9 @@ static GLshort gl2psGetIndex(GLshort i, GLshort num)
   return (i < num - 1) ? i + 1 : 0;
 }
 
-static GLint gl2psTestSplitPrimitive(GL2PSprimitive *prim, GL2PSplane plane)
+/* Which side of the plane a primitive is on, without splitting it */
+
+static GLint gl2psClassifyPrimitive(GL2PSprimitive *prim, GL2PSplane plane)
 {
   GLint type = GL2PS_COINCIDENT;
   GLshort i, j;
@@ -1274,27 +1811,34 @@ static GLint gl2psTestSplitPrimitive(GL2PSprimitive *prim, GL2PSplane plane)
   }
 
   if(prim->numverts < 2){
-    return 0;
+    if(prim->numverts && d[0] > GL2PS_EPSILON)       type = GL2PS_IN_BACK_OF;
+    else if(prim->numverts && d[0] < -GL2PS_EPSILON) type = GL2PS_IN_FRONT_OF;
   }
   else{
     for(i = 0; i < prim->numverts; i++){
       j = gl2psGetIndex(i, prim->numverts);
       if(d[j] > GL2PS_EPSILON){
         if(type == GL2PS_COINCIDENT)      type = GL2PS_IN_BACK_OF;
-        else if(type != GL2PS_IN_BACK_OF) return 1; 
-        if(d[i] < -GL2PS_EPSILON)         return 1;
+        else if(type != GL2PS_IN_BACK_OF) return GL2PS_SPANNING; 
+        if(d[i] < -GL2PS_EPSILON)         return GL2PS_SPANNING;
       }
       else if(d[j] < -GL2PS_EPSILON){
         if(type == GL2PS_COINCIDENT)       type = GL2PS_IN_FRONT_OF;   
-        else if(type != GL2PS_IN_FRONT_OF) return 1;
-        if(d[i] > GL2PS_EPSILON)           return 1;
+        else if(type != GL2PS_IN_FRONT_OF) return GL2PS_SPANNING;
+        if(d[i] > GL2PS_EPSILON)           return GL2PS_SPANNING;
       }
     }
   }
-  return 0;
+  return type;
+}
+
+static GLint gl2psTestSplitPrimitive(GL2PSprimitive *prim, GL2PSplane plane)
+{
+  return (gl2psClassifyPrimitive(prim, plane) == GL2PS_SPANNING) ? 1 : 0;
 }
 
-static GLint gl2psSplitPrimitive(GL2PSprimitive *prim, GL2PSplane plane, 
+static GLint gl2psSplitPrimitive(GL2PSarena *arena,
+                                 GL2PSprimitive *prim, GL2PSplane plane, 
                                  GL2PSprimitive **front, GL2PSprimitive **back)
 {
   GLshort i, j, in = 0, out = 0, in0[5], in1[5], out0[5], out1[5];
@@ -1345,29 +1889,24 @@ static GLint gl2psSplitPrimitive(GL2PSprimitive *prim, GL2PSplane plane,
   }
 
   if(type == GL2PS_SPANNING){
-    *back = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
-    *front = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
-    gl2psCreateSplitPrimitive(prim, plane, *back, out, out0, out1);
-    gl2psCreateSplitPrimitive(prim, plane, *front, in, in0, in1);
+    *back = gl2psCreateSplitPrimitive(arena, prim, plane, out, out0, out1);
+    *front = gl2psCreateSplitPrimitive(arena, prim, plane, in, in0, in1);
   }
 
   return type;
 }
 
-static void gl2psDivideQuad(GL2PSprimitive *quad, 
+static void gl2psDivideQuad(GL2PSarena *arena, GL2PSprimitive *quad, 
                             GL2PSprimitive **t1, GL2PSprimitive **t2)
 {
-  *t1 = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
-  *t2 = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
+  *t1 = gl2psArenaPrimitive(arena, 3);
+  *t2 = gl2psArenaPrimitive(arena, 3);
   (*t1)->type = (*t2)->type = GL2PS_TRIANGLE;
-  (*t1)->numverts = (*t2)->numverts = 3;
   (*t1)->culled = (*t2)->culled = quad->culled;
   (*t1)->offset = (*t2)->offset = quad->offset;
   (*t1)->pattern = (*t2)->pattern = quad->pattern;
   (*t1)->factor = (*t2)->factor = quad->factor;
   (*t1)->width = (*t2)->width = quad->width;
-  (*t1)->verts = (GL2PSvertex*)gl2psMalloc(3 * sizeof(GL2PSvertex));
-  (*t2)->verts = (GL2PSvertex*)gl2psMalloc(3 * sizeof(GL2PSvertex));
   (*t1)->verts[0] = quad->verts[0];
   (*t1)->verts[1] = quad->verts[1];
   (*t1)->verts[2] = quad->verts[2];
@@ -1418,7 +1957,110 @@ static int gl2psTrianglesFirst(const void *a, const void *b)
   return(q->type < w->type ? 1 : -1);
 }
 
-static GLint gl2psFindRoot(GL2PSlist *primitives, GL2PSprimitive **root)
+/* Sampled root selection (GL2PS_BEST_ROOT with gl2psSetBspRoot): a few
+   candidate planes, picked at random, are each tested against the same
+   random sample of primitives. The cost of a plane is the number of
+   primitives it splits, weighted, plus the imbalance between its two
+   sides. Planes aligned with an axis get a discount, and ties go to
+   the largest candidate. The random numbers only depend on the node,
+   so the tree does not depend on the number of threads */
+
+#define GL2PS_BSP_SPLIT_COST  8.0F
+#define GL2PS_BSP_AXIS_COST   0.75F
+#define GL2PS_BSP_MAX_SAMPLES 1024
+
+static GLuint gl2psRandom(GLuint *state)
+{
+  /* xorshift */
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+/* Random index in the i-th of k equal parts of [0, n) */
+
+static GLint gl2psRandomIndex(GLuint *state, GLint i, GLint k, GLint n)
+{
+  GLint lo = (GLint)(((double)n * i) / k);
+  GLint hi = (GLint)(((double)n * (i + 1)) / k);
+
+  return lo + (GLint)(gl2psRandom(state) % (GLuint)(hi - lo));
+}
+
+static GLfloat gl2psPrimitiveArea(GL2PSprimitive *prim)
+{
+  GL2PSxyz v, w, c;
+  GLfloat area = 0.0F;
+  GLshort i;
+
+  for(i = 2; i < prim->numverts; i++){
+    v[0] = prim->verts[i-1].xyz[0] - prim->verts[0].xyz[0];
+    v[1] = prim->verts[i-1].xyz[1] - prim->verts[0].xyz[1];
+    v[2] = prim->verts[i-1].xyz[2] - prim->verts[0].xyz[2];
+    w[0] = prim->verts[i].xyz[0] - prim->verts[0].xyz[0];
+    w[1] = prim->verts[i].xyz[1] - prim->verts[0].xyz[1];
+    w[2] = prim->verts[i].xyz[2] - prim->verts[0].xyz[2];
+    gl2psPvec(v, w, c);
+    area += gl2psNorm(c);
+  }
+  return 0.5F * area;
+}
+
+static GLint gl2psFindRootSampled(GL2PSlist *primitives, GLint depth,
+                                  GL2PSprimitive **root)
+{
+  GLint i, j, n, ncand, nsamp, idx, index = 0, split, front, back;
+  GLint sample[GL2PS_BSP_MAX_SAMPLES];
+  GLuint state;
+  GLfloat cost, best = 0.0F, area, bestarea = 0.0F;
+  GL2PSprimitive *cand, *prim;
+  GL2PSplane plane;
+
+  n = gl2psListNbr(primitives);
+  ncand = (n < gl2ps->maxbestroot) ? n : gl2ps->maxbestroot;
+  nsamp = (n < gl2ps->bspsamples) ? n : gl2ps->bspsamples;
+
+  state = 2166136261U ^ ((GLuint)n * 16777619U) ^ ((GLuint)depth * 2654435761U);
+  if(!state) state = 1;
+
+  for(j = 0; j < nsamp; j++){
+    sample[j] = (nsamp == n) ? j : gl2psRandomIndex(&state, j, nsamp, n);
+  }
+
+  for(i = 0; i < ncand; i++){
+    idx = (ncand == n) ? i : gl2psRandomIndex(&state, i, ncand, n);
+    cand = *(GL2PSprimitive**)gl2psListPointer(primitives, idx);
+    gl2psGetPlane(cand, plane);
+    split = front = back = 0;
+    for(j = 0; j < nsamp; j++){
+      if(sample[j] == idx) continue;
+      prim = *(GL2PSprimitive**)gl2psListPointer(primitives, sample[j]);
+      switch(gl2psClassifyPrimitive(prim, plane)){
+      case GL2PS_SPANNING : split++; break;
+      case GL2PS_IN_FRONT_OF : front++; break;
+      case GL2PS_IN_BACK_OF : back++; break;
+      }
+    }
+    cost = GL2PS_BSP_SPLIT_COST * split + abs(front - back);
+    if(fabs(plane[0]) > 1.0F - GL2PS_EPSILON || 
+       fabs(plane[1]) > 1.0F - GL2PS_EPSILON || 
+       fabs(plane[2]) > 1.0F - GL2PS_EPSILON){
+      cost *= GL2PS_BSP_AXIS_COST;
+    }
+    area = gl2psPrimitiveArea(cand);
+    if(!i || cost < best || (cost == best && area > bestarea)){
+      best = cost;
+      bestarea = area;
+      index = idx;
+      *root = cand;
+    }
+  }
+  return index;
+}
+
+static GLint gl2psFindRoot(GL2PSlist *primitives, GLint depth, 
+                           GL2PSprimitive **root)
 {
   GLint i, j, count, best = 1000000, index = 0;
   GL2PSprimitive *prim1, *prim2;
@@ -1432,7 +2074,10 @@ static GLint gl2psFindRoot(GL2PSlist *primitives, GL2PSprimitive **root)
 
   *root = *(GL2PSprimitive**)gl2psListPointer(primitives, 0);
 
-  if(gl2ps->options & GL2PS_BEST_ROOT){
+  if((gl2ps->options & GL2PS_BEST_ROOT) && gl2ps->bspsamples > 0){
+    return gl2psFindRootSampled(primitives, depth, root);
+  }
+  else if(gl2ps->options & GL2PS_BEST_ROOT){
     maxp = gl2psListNbr(primitives);
     if(maxp > gl2ps->maxbestroot){
       maxp = gl2ps->maxbestroot;
@@ -1474,22 +2119,11 @@ static void gl2psFreeImagemap(GL2PSimagemap *list){
   }
 }
 
-static void gl2psFreePrimitive(void *data)
-{
-  GL2PSprimitive *q;
-  
-  q = *(GL2PSprimitive**)data;
-  gl2psFree(q->verts);
-  if(q->type == GL2PS_TEXT || q->type == GL2PS_SPECIAL){
-    gl2psFreeText(q->data.text);
-  }
-  else if(q->type == GL2PS_PIXMAP){
-    gl2psFreePixmap(q->data.image);
-  }
-  gl2psFree(q);
-}
+/* Note: primitives and BSP trees are allocated in the page arenas,
+   so they are not freed individually */
 
-static void gl2psAddPrimitiveInList(GL2PSprimitive *prim, GL2PSlist *list)
+static void gl2psAddPrimitiveInList(GL2PSarena *arena, GL2PSprimitive *prim,
+                                    GL2PSlist *list)
 {
   GL2PSprimitive *t1, *t2;
 
@@ -1497,28 +2131,14 @@ static void gl2psAddPrimitiveInList(GL2PSprimitive *prim, GL2PSlist *list)
     gl2psListAdd(list, &prim);
   }
   else{
-    gl2psDivideQuad(prim, &t1, &t2);
+    gl2psDivideQuad(arena, prim, &t1, &t2);
     gl2psListAdd(list, &t1);
     gl2psListAdd(list, &t2);
-    gl2psFreePrimitive(&prim);
+    gl2psArenaRecycle(arena, prim);
   }
   
 }
 
-static void gl2psFreeBspTree(GL2PSbsptree **tree)
-{
-  if(*tree){
-    if((*tree)->back) gl2psFreeBspTree(&(*tree)->back);
-    if((*tree)->primitives){
-      gl2psListAction((*tree)->primitives, gl2psFreePrimitive);
-      gl2psListDelete((*tree)->primitives);
-    }
-    if((*tree)->front) gl2psFreeBspTree(&(*tree)->front);
-    gl2psFree(*tree);
-    *tree = NULL;
-  }
-}
-
 static GLboolean gl2psGreater(GLfloat f1, GLfloat f2)
 {
   if(f1 > f2) return GL_TRUE;
@@ -1531,52 +2151,428 @@ static GLboolean gl2psLess(GLfloat f1, GLfloat f2)
   else return GL_FALSE;
 }
 
-static void gl2psBuildBspTree(GL2PSbsptree *tree, GL2PSlist *primitives)
+/* The BSP tree can be built in parallel: the front and back subtrees
+   of large nodes are built as separate tasks on a small work-stealing
+   pool, and the classification loop of large nodes is split into
+   chunks. The chunk results are concatenated in order, so the tree
+   (and hence the output file) is identical to the one built serially */
+
+#define GL2PS_BSP_TASK_MIN   256  /* Smallest list built as a separate task */
+#define GL2PS_BSP_CHUNK_MIN 4096  /* Smallest chunk of the classification loop */
+
+/* Number of threads for the BSP build (0 = number of processors) */
+
+static GLint gl2psnthreads = 0;
+
+/* Statistics of the BSP trees built for the last page of this thread */
+
+static GL2PS_THREAD_LOCAL GLint gl2psbspnodes = 0, gl2psbspdepth = 0, gl2psbspsplits = 0;
+
+typedef struct {
+  void (*run)(void *data, GLint worker);
+  void *data;
+  GLint *pending; /* join counter, decremented when the task is done */
+} GL2PStask;
+
+#if defined(GL2PS_HAVE_PTHREAD)
+
+typedef struct {
+  GL2PStask **task;
+  GLint head, tail, size;
+} GL2PSdeque;
+
+typedef struct _GL2PSpool GL2PSpool;
+
+typedef struct {
+  GL2PSpool *pool;
+  GLint id;
+} GL2PSworker;
+
+struct _GL2PSpool {
+  GL2PScontext *context; /* of the page being sorted */
+  GLint nthreads;
+  pthread_t *thread;
+  GL2PSworker *worker;
+  GL2PSdeque *deque; /* one per thread, the calling thread is number 0 */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  GLboolean shutdown;
+};
+
+/* Get a task for this worker: the newest one in its own deque, or else
+   the oldest one (probably the largest) from another worker. The pool
+   mutex must be locked */
+
+static GL2PStask *gl2psPoolGetTask(GL2PSpool *pool, GLint worker)
 {
-  GL2PSprimitive *prim, *frontprim = NULL, *backprim = NULL;
-  GL2PSlist *frontlist, *backlist;
-  GLint i, index;
+  GL2PSdeque *d;
+  GLint i;
 
-  tree->front = NULL;
-  tree->back = NULL;
-  tree->primitives = gl2psListCreate(1, 2, sizeof(GL2PSprimitive*));
-  index = gl2psFindRoot(primitives, &prim);
-  gl2psGetPlane(prim, tree->plane);
-  gl2psAddPrimitiveInList(prim, tree->primitives);
+  d = &pool->deque[worker];
+  if(d->tail > d->head){
+    return d->task[--d->tail];
+  }
+  for(i = 1; i < pool->nthreads; i++){
+    d = &pool->deque[(worker + i) % pool->nthreads];
+    if(d->tail > d->head){
+      return d->task[d->head++];
+    }
+  }
+  return NULL;
+}
+
+static void gl2psPoolRun(GL2PSpool *pool, GL2PStask *task, GLint worker)
+{
+  task->run(task->data, worker);
+  pthread_mutex_lock(&pool->mutex);
+  (*task->pending)--;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+static void *gl2psPoolThread(void *data)
+{
+  GL2PSworker *w = (GL2PSworker*)data;
+  GL2PSpool *pool = w->pool;
+  GL2PStask *task;
+
+  gl2ps = pool->context;
+
+  pthread_mutex_lock(&pool->mutex);
+  for(;;){
+    task = gl2psPoolGetTask(pool, w->id);
+    if(task){
+      pthread_mutex_unlock(&pool->mutex);
+      gl2psPoolRun(pool, task, w->id);
+      pthread_mutex_lock(&pool->mutex);
+    }
+    else if(pool->shutdown){
+      break;
+    }
+    else{
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+static void gl2psPoolDelete(GL2PSpool *pool);
+
+static GL2PSpool *gl2psPoolCreate(void)
+{
+  GL2PSpool *pool;
+  GLint i, nthreads = gl2psnthreads;
+
+#if defined(_SC_NPROCESSORS_ONLN)
+  if(nthreads <= 0) nthreads = (GLint)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(nthreads > GL2PS_MAX_THREADS) nthreads = GL2PS_MAX_THREADS;
+  if(nthreads < 2) return NULL;
+
+  pool = (GL2PSpool*)gl2psMalloc(sizeof(GL2PSpool));
+  pool->context = gl2ps;
+  pool->thread = (pthread_t*)gl2psMalloc(nthreads * sizeof(pthread_t));
+  pool->worker = (GL2PSworker*)gl2psMalloc(nthreads * sizeof(GL2PSworker));
+  pool->deque = (GL2PSdeque*)gl2psMalloc(nthreads * sizeof(GL2PSdeque));
+  for(i = 0; i < nthreads; i++){
+    pool->worker[i].pool = pool;
+    pool->worker[i].id = i;
+    pool->deque[i].task = NULL;
+    pool->deque[i].head = pool->deque[i].tail = pool->deque[i].size = 0;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->shutdown = GL_FALSE;
+
+  /* Thread 0 is the caller */
+  pool->nthreads = 1;
+  for(i = 1; i < nthreads; i++){
+    if(pthread_create(&pool->thread[i], NULL, gl2psPoolThread, &pool->worker[i])){
+      gl2psMsg(GL2PS_WARNING, "Could only start %d threads", i);
+      break;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->nthreads++;
+    pthread_mutex_unlock(&pool->mutex);
+  }
+  if(pool->nthreads < 2){
+    gl2psPoolDelete(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+static void gl2psPoolDelete(GL2PSpool *pool)
+{
+  GLint i;
+
+  if(!pool) return;
+  pthread_mutex_lock(&pool->mutex);
+  pool->shutdown = GL_TRUE;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+  for(i = 1; i < pool->nthreads; i++){
+    pthread_join(pool->thread[i], NULL);
+  }
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->mutex);
+  for(i = 0; i < pool->nthreads; i++){
+    gl2psFree(pool->deque[i].task);
+  }
+  gl2psFree(pool->deque);
+  gl2psFree(pool->worker);
+  gl2psFree(pool->thread);
+  gl2psFree(pool);
+}
+
+/* Queue a task on this worker's deque. It must be waited for with
+   gl2psPoolJoin before the caller returns */
+
+static void gl2psPoolSpawn(GL2PSpool *pool, GLint worker, GL2PStask *task)
+{
+  GL2PSdeque *d;
+
+  if(!pool){
+    task->run(task->data, worker);
+    return;
+  }
+  pthread_mutex_lock(&pool->mutex);
+  d = &pool->deque[worker];
+  if(d->tail == d->size){
+    if(d->head){
+      memmove(d->task, d->task + d->head, (d->tail - d->head) * sizeof(GL2PStask*));
+      d->tail -= d->head;
+      d->head = 0;
+    }
+    else{
+      d->size = d->size ? 2 * d->size : 16;
+      d->task = (GL2PStask**)gl2psRealloc(d->task, d->size * sizeof(GL2PStask*));
+    }
+  }
+  d->task[d->tail++] = task;
+  (*task->pending)++;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Wait until all the tasks counted by 'pending' are done, running
+   other tasks in the meantime */
+
+static void gl2psPoolJoin(GL2PSpool *pool, GLint worker, GLint *pending)
+{
+  GL2PStask *task;
+
+  if(!pool) return;
+  pthread_mutex_lock(&pool->mutex);
+  while(*pending > 0){
+    task = gl2psPoolGetTask(pool, worker);
+    if(task){
+      pthread_mutex_unlock(&pool->mutex);
+      gl2psPoolRun(pool, task, worker);
+      pthread_mutex_lock(&pool->mutex);
+    }
+    else{
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+#else /* GL2PS_HAVE_PTHREAD */
+
+/* Without threads, tasks are simply run when they are spawned */
+
+typedef struct {
+  GLint nthreads;
+} GL2PSpool;
+
+static GL2PSpool *gl2psPoolCreate(void)
+{
+  return NULL;
+}
+
+static void gl2psPoolDelete(GL2PSpool *pool)
+{
+}
+
+static void gl2psPoolSpawn(GL2PSpool *pool, GLint worker, GL2PStask *task)
+{
+  task->run(task->data, worker);
+}
+
+static void gl2psPoolJoin(GL2PSpool *pool, GLint worker, GLint *pending)
+{
+}
+
+#endif /* GL2PS_HAVE_PTHREAD */
+
+typedef struct {
+  GL2PSlist *primitives;
+  GLint start, end, index;
+  GLfloat *plane;
+  GL2PSlist *coincident, *frontlist, *backlist;
+  GLint splits;
+} GL2PSbspchunk;
+
+typedef struct {
+  GL2PSpool *pool;
+  GL2PSbsptree *tree;
+  GL2PSlist *primitives;
+  GLint depth;
+  /* statistics of the subtree */
+  GLint nodes, maxdepth, splits;
+} GL2PSbspnode;
 
-  frontlist = gl2psListCreate(1, 2, sizeof(GL2PSprimitive*));
-  backlist = gl2psListCreate(1, 2, sizeof(GL2PSprimitive*));
+static void gl2psClassifyPrimitives(void *data, GLint worker)
+{
+  GL2PSbspchunk *c = (GL2PSbspchunk*)data;
+  GL2PSarena *arena = &gl2ps->arena[worker];
+  GL2PSprimitive *prim, *frontprim = NULL, *backprim = NULL;
+  GLint i;
 
-  for(i = 0; i < gl2psListNbr(primitives); i++){
-    if(i != index){
-      prim = *(GL2PSprimitive**)gl2psListPointer(primitives,i);
-      switch(gl2psSplitPrimitive(prim, tree->plane, &frontprim, &backprim)){
+  c->splits = 0;
+  for(i = c->start; i < c->end; i++){
+    if(i != c->index){
+      prim = *(GL2PSprimitive**)gl2psListPointer(c->primitives, i);
+      switch(gl2psSplitPrimitive(arena, prim, c->plane, &frontprim, &backprim)){
       case GL2PS_COINCIDENT:
-        gl2psAddPrimitiveInList(prim, tree->primitives);
+        gl2psAddPrimitiveInList(arena, prim, c->coincident);
         break;
       case GL2PS_IN_BACK_OF:
-        gl2psAddPrimitiveInList(prim, backlist);
+        gl2psAddPrimitiveInList(arena, prim, c->backlist);
         break;
       case GL2PS_IN_FRONT_OF:
-        gl2psAddPrimitiveInList(prim, frontlist);
+        gl2psAddPrimitiveInList(arena, prim, c->frontlist);
         break;
       case GL2PS_SPANNING:
-        gl2psAddPrimitiveInList(backprim, backlist);
-        gl2psAddPrimitiveInList(frontprim, frontlist);
-        gl2psFreePrimitive(&prim);
+        gl2psAddPrimitiveInList(arena, backprim, c->backlist);
+        gl2psAddPrimitiveInList(arena, frontprim, c->frontlist);
+        gl2psArenaRecycle(arena, prim);
+        c->splits++;
         break;
       }
     }
   }
+}
+
+static void gl2psBuildBspNode(void *data, GLint worker)
+{
+  GL2PSbspnode *node = (GL2PSbspnode*)data, sub[2];
+  GL2PSbspchunk first, *chunk = &first;
+  GL2PStask subtask, *task = NULL;
+  GL2PSbsptree *tree = node->tree;
+  GL2PSarena *arena = &gl2ps->arena[worker];
+  GL2PSlist *primitives = node->primitives, *frontlist, *backlist;
+  GL2PSprimitive *prim = NULL;
+  GLint i, n, m, index, nchunks = 1, pending = 0;
+  GLint nfront, nback, ncoincident;
+
+  tree->front = NULL;
+  tree->back = NULL;
+  tree->primitives = gl2psArenaListCreate(arena, 2, sizeof(GL2PSprimitive*));
+  index = gl2psFindRoot(primitives, node->depth, &prim);
+  gl2psGetPlane(prim, tree->plane);
+  gl2psAddPrimitiveInList(arena, prim, tree->primitives);
+
+  /* Start each side at half the parent: a good plane splits the
+     primitives about evenly, and the lists double from there if not */
+  n = gl2psListNbr(primitives);
+  frontlist = gl2psListCreate(n / 2 + 1, 2, sizeof(GL2PSprimitive*));
+  backlist = gl2psListCreate(n / 2 + 1, 2, sizeof(GL2PSprimitive*));
+
+  if(node->pool){
+    nchunks = n / GL2PS_BSP_CHUNK_MIN;
+    if(nchunks > node->pool->nthreads) nchunks = node->pool->nthreads;
+    if(nchunks < 1) nchunks = 1;
+  }
+  if(nchunks > 1){
+    chunk = (GL2PSbspchunk*)gl2psMalloc(nchunks * sizeof(GL2PSbspchunk));
+    task = (GL2PStask*)gl2psMalloc(nchunks * sizeof(GL2PStask));
+  }
+
+  for(i = 0; i < nchunks; i++){
+    chunk[i].primitives = primitives;
+    chunk[i].start = (GLint)(((double)n * i) / nchunks);
+    chunk[i].end = (GLint)(((double)n * (i + 1)) / nchunks);
+    chunk[i].index = index;
+    chunk[i].plane = tree->plane;
+    if(!i){
+      chunk[i].coincident = tree->primitives;
+      chunk[i].frontlist = frontlist;
+      chunk[i].backlist = backlist;
+    }
+    else{
+      m = chunk[i].end - chunk[i].start;
+      chunk[i].coincident = gl2psListCreate(1, 2, sizeof(GL2PSprimitive*));
+      chunk[i].frontlist = gl2psListCreate(m / 2 + 1, 2, sizeof(GL2PSprimitive*));
+      chunk[i].backlist = gl2psListCreate(m / 2 + 1, 2, sizeof(GL2PSprimitive*));
+      task[i].run = gl2psClassifyPrimitives;
+      task[i].data = &chunk[i];
+      task[i].pending = &pending;
+      gl2psPoolSpawn(node->pool, worker, &task[i]);
+    }
+  }
+  gl2psClassifyPrimitives(&chunk[0], worker);
+  gl2psPoolJoin(node->pool, worker, &pending);
+
+  node->nodes = 1;
+  node->maxdepth = node->depth;
+  node->splits = chunk[0].splits;
+
+  /* Concatenate the chunks in order, sizing the lists once up front */
+  nfront = gl2psListNbr(frontlist);
+  nback = gl2psListNbr(backlist);
+  ncoincident = gl2psListNbr(tree->primitives);
+  for(i = 1; i < nchunks; i++){
+    nfront += gl2psListNbr(chunk[i].frontlist);
+    nback += gl2psListNbr(chunk[i].backlist);
+    ncoincident += gl2psListNbr(chunk[i].coincident);
+  }
+  if(nchunks > 1){
+    gl2psListReserve(frontlist, nfront);
+    gl2psListReserve(backlist, nback);
+    gl2psListReserve(tree->primitives, ncoincident);
+  }
+  for(i = 1; i < nchunks; i++){
+    node->splits += chunk[i].splits;
+    gl2psListAppend(tree->primitives, chunk[i].coincident);
+    gl2psListAppend(frontlist, chunk[i].frontlist);
+    gl2psListAppend(backlist, chunk[i].backlist);
+    gl2psListDelete(chunk[i].coincident);
+    gl2psListDelete(chunk[i].frontlist);
+    gl2psListDelete(chunk[i].backlist);
+  }
+  if(nchunks > 1){
+    gl2psFree(chunk);
+    gl2psFree(task);
+  }
 
   if(gl2psListNbr(tree->primitives)){
     gl2psListSort(tree->primitives, gl2psTrianglesFirst);
   }
 
+  for(i = 0; i < 2; i++){
+    sub[i].pool = node->pool;
+    sub[i].depth = node->depth + 1;
+    sub[i].nodes = sub[i].maxdepth = sub[i].splits = 0;
+  }
+
   if(gl2psListNbr(frontlist)){
     gl2psListSort(frontlist, gl2psTrianglesFirst);
-    tree->front = (GL2PSbsptree*)gl2psMalloc(sizeof(GL2PSbsptree));
-    gl2psBuildBspTree(tree->front, frontlist);
+    tree->front = (GL2PSbsptree*)gl2psArenaAlloc(arena, sizeof(GL2PSbsptree));
+    sub[0].tree = tree->front;
+    sub[0].primitives = frontlist;
+    if(node->pool && gl2psListNbr(frontlist) >= GL2PS_BSP_TASK_MIN &&
+       gl2psListNbr(backlist)){
+      subtask.run = gl2psBuildBspNode;
+      subtask.data = &sub[0];
+      subtask.pending = &pending;
+      gl2psPoolSpawn(node->pool, worker, &subtask);
+    }
+    else{
+      gl2psBuildBspNode(&sub[0], worker);
+    }
   }
   else{
     gl2psListDelete(frontlist);
@@ -1584,16 +2580,45 @@ static void gl2psBuildBspTree(GL2PSbsptree *tree, GL2PSlist *primitives)
 
   if(gl2psListNbr(backlist)){
     gl2psListSort(backlist, gl2psTrianglesFirst);
-    tree->back = (GL2PSbsptree*)gl2psMalloc(sizeof(GL2PSbsptree));
-    gl2psBuildBspTree(tree->back, backlist);
+    tree->back = (GL2PSbsptree*)gl2psArenaAlloc(arena, sizeof(GL2PSbsptree));
+    sub[1].tree = tree->back;
+    sub[1].primitives = backlist;
+    gl2psBuildBspNode(&sub[1], worker);
   }
   else{
     gl2psListDelete(backlist);
   }
 
+  gl2psPoolJoin(node->pool, worker, &pending);
+
+  for(i = 0; i < 2; i++){
+    node->nodes += sub[i].nodes;
+    node->splits += sub[i].splits;
+    if(sub[i].maxdepth > node->maxdepth) node->maxdepth = sub[i].maxdepth;
+  }
+
   gl2psListDelete(primitives);
 }
 
+static void gl2psBuildBspTree(GL2PSbsptree *tree, GL2PSlist *primitives)
+{
+  GL2PSbspnode node;
+
+  node.pool = NULL;
+  if(gl2psListNbr(primitives) >= GL2PS_BSP_TASK_MIN){
+    node.pool = gl2psPoolCreate();
+  }
+  node.tree = tree;
+  node.primitives = primitives;
+  node.depth = 1;
+  gl2psBuildBspNode(&node, 0);
+  gl2psPoolDelete(node.pool);
+
+  gl2ps->bspnodes += node.nodes;
+  gl2ps->bspsplits += node.splits;
+  if(node.maxdepth > gl2ps->bspdepth) gl2ps->bspdepth = node.maxdepth;
+}
+
 static void gl2psTraverseBspTree(GL2PSbsptree *tree, GL2PSxyz eye, GLfloat epsilon,
                                  GLboolean (*compare)(GLfloat f1, GLfloat f2),
                                  void (*action)(void *data), int inverse)
@@ -1874,7 +2899,7 @@ static GL2PSprimitive *gl2psCreateSplitPrimitive2D(GL2PSprimitive *parent,
                                                    GL2PSvertex *vertx)
 {
   GLint i;
-  GL2PSprimitive *child = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
+  GL2PSprimitive *child = gl2psArenaPrimitive(gl2ps->arena, numverts);
 
   if(parent->type == GL2PS_IMAGEMAP){
     child->type = GL2PS_IMAGEMAP;
@@ -1895,8 +2920,6 @@ static GL2PSprimitive *gl2psCreateSplitPrimitive2D(GL2PSprimitive *parent,
   child->pattern = parent->pattern;
   child->factor = parent->factor;
   child->width = parent->width;
-  child->numverts = numverts;
-  child->verts = (GL2PSvertex*)gl2psMalloc(numverts * sizeof(GL2PSvertex));
   for(i = 0; i < numverts; i++){
     child->verts[i] = vertx[i];
   }
@@ -2021,10 +3044,8 @@ static GLint gl2psAddInBspImageTree(GL2PSprimitive *prim, GL2PSbsptree2d **tree)
           ret = 1;
         }
       }
-      gl2psFree(frontprim->verts);
-      gl2psFree(frontprim);
-      gl2psFree(backprim->verts);
-      gl2psFree(backprim);
+      gl2psArenaRecycle(gl2ps->arena, frontprim);
+      gl2psArenaRecycle(gl2ps->arena, backprim);
       return ret;
     case GL2PS_COINCIDENT:
       if((*tree)->back != NULL){
@@ -2079,7 +3100,7 @@ static void gl2psAddBoundaryInList(GL2PSprimitive *prim, GL2PSlist *list)
 
   for(i = 0; i < prim->numverts; i++){
     if(prim->boundary & (GLint)pow(2., i)){
-      b = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
+      b = gl2psArenaPrimitive(gl2ps->arena, 2);
       b->type = GL2PS_LINE;
       b->offset = prim->offset;
       b->pattern = prim->pattern;
@@ -2087,8 +3108,6 @@ static void gl2psAddBoundaryInList(GL2PSprimitive *prim, GL2PSlist *list)
       b->culled = prim->culled;
       b->width = prim->width;
       b->boundary = 0;
-      b->numverts = 2;
-      b->verts = (GL2PSvertex*)gl2psMalloc(2 * sizeof(GL2PSvertex));
 
 #if 0 /* FIXME: need to work on boundary offset... */
       v[0] = c[0] - prim->verts[i].xyz[0];
@@ -2151,17 +3170,18 @@ static void gl2psBuildPolygonBoundary(GL2PSbsptree *tree)
  *
  *********************************************************************/
 
-static void gl2psAddPolyPrimitive(GLshort type, GLshort numverts, 
-                                  GL2PSvertex *verts, GLint offset, 
-                                  GLushort pattern, GLint factor,
-                                  GLfloat width, char boundary)
+GL2PSDLL_API GLint gl2psAddPolyPrimitive(GLshort type, GLshort numverts, 
+                                         GL2PSvertex *verts, GLint offset, 
+                                         GLushort pattern, GLint factor,
+                                         GLfloat width, char boundary)
 {
   GL2PSprimitive *prim;
+  GLint i;
 
-  prim = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
+  if(!gl2ps) return GL2PS_UNINITIALIZED;
+
+  prim = gl2psArenaPrimitive(gl2ps->arena, numverts);
   prim->type = type;
-  prim->numverts = numverts;
-  prim->verts = (GL2PSvertex*)gl2psMalloc(numverts * sizeof(GL2PSvertex));
   memcpy(prim->verts, verts, numverts * sizeof(GL2PSvertex));
   prim->boundary = boundary;
   prim->offset = offset;
@@ -2173,7 +3193,15 @@ static void gl2psAddPolyPrimitive(GLshort type, GLshort numverts,
   /* FIXME: here we should have an option to split stretched
      tris/quads to enhance SIMPLE_SORT */
 
+  if(type == GL2PS_TRIANGLE && (gl2ps->options & GL2PS_NO_OPENGL_CONTEXT)){
+    /* done by the feedback buffer parser otherwise */
+    for(i = 0; i < numverts; i++)
+      gl2psAdaptVertexForBlending(&prim->verts[i]);
+  }
+
   gl2psListAdd(gl2ps->primitives, &prim);
+
+  return GL2PS_SUCCESS;
 }
 
 static GLint gl2psGetVertex(GL2PSvertex *v, GLfloat *p)
@@ -2319,11 +3347,9 @@ static void gl2psParseFeedbackBuffer(GLint used)
         lwidth = current[1];
         break;
       case GL2PS_IMAGEMAP_TOKEN :
-        prim = (GL2PSprimitive *)gl2psMalloc(sizeof(GL2PSprimitive));
+        prim = gl2psArenaPrimitive(gl2ps->arena, 4);
         prim->type = GL2PS_IMAGEMAP;
         prim->boundary = 0;
-        prim->numverts = 4;
-        prim->verts = (GL2PSvertex *)gl2psMalloc(4 * sizeof(GL2PSvertex));
         prim->culled = 0;
         prim->offset = 0;
         prim->pattern = 0;
@@ -2666,7 +3692,7 @@ static void gl2psPrintPostScriptHeader(void)
               "%%%%Pages: 1\n",
               gl2ps->title, GL2PS_MAJOR_VERSION, GL2PS_MINOR_VERSION, 
               GL2PS_PATCH_VERSION, GL2PS_EXTRA_VERSION, GL2PS_COPYRIGHT,
-              gl2ps->producer, ctime(&now));
+              gl2ps->producer, gl2psCtime(&now));
 
   if(gl2ps->format == GL2PS_PS){
     gl2psPrintf("%%%%Orientation: %s\n"
@@ -3122,7 +4148,8 @@ static void gl2psPrintPostScriptBeginViewport(GLint viewport[4])
   GLfloat rgba[4];
   int x = viewport[0], y = viewport[1], w = viewport[2], h = viewport[3];
 
-  glRenderMode(GL_FEEDBACK);
+  if(!(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT))
+    glRenderMode(GL_FEEDBACK);
 
   if(gl2ps->header){
     gl2psPrintPostScriptHeader();
@@ -3133,7 +4160,10 @@ static void gl2psPrintPostScriptBeginViewport(GLint viewport[4])
               "1.0 1.0 scale\n");
 
   if(gl2ps->options & GL2PS_DRAW_BACKGROUND){
-    if(gl2ps->colormode == GL_RGBA || gl2ps->colorsize == 0){
+    if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+      memcpy(rgba, gl2ps->bgcolor, sizeof(GL2PSrgba));
+    }
+    else if(gl2ps->colormode == GL_RGBA || gl2ps->colorsize == 0){
       glGetFloatv(GL_COLOR_CLEAR_VALUE, rgba);
     }
     else{
@@ -3223,16 +4253,16 @@ static void gl2psPrintTeXHeader(void)
 
   time(&now);
 
-  fprintf(gl2ps->stream, 
+  gl2psPrintf(
           "%% Title: %s\n"
           "%% Creator: GL2PS %d.%d.%d%s, %s\n"
           "%% For: %s\n"
           "%% CreationDate: %s",
           gl2ps->title, GL2PS_MAJOR_VERSION, GL2PS_MINOR_VERSION,
           GL2PS_PATCH_VERSION, GL2PS_EXTRA_VERSION, GL2PS_COPYRIGHT,
-          gl2ps->producer, ctime(&now));
+          gl2ps->producer, gl2psCtime(&now));
 
-  fprintf(gl2ps->stream, 
+  gl2psPrintf(
           "\\setlength{\\unitlength}{1pt}\n"
           "\\begin{picture}(0,0)\n"
           "\\includegraphics{%s}\n"
@@ -3250,54 +4280,54 @@ static void gl2psPrintTeXPrimitive(void *data)
 
   switch(prim->type){
   case GL2PS_TEXT :
-    fprintf(gl2ps->stream, "\\fontsize{%d}{0}\n\\selectfont", 
+    gl2psPrintf("\\fontsize{%d}{0}\n\\selectfont", 
             prim->data.text->fontsize);
-    fprintf(gl2ps->stream, "\\put(%g,%g){\\makebox(0,0)",
+    gl2psPrintf("\\put(%g,%g){\\makebox(0,0)",
             prim->verts[0].xyz[0], prim->verts[0].xyz[1]);
     switch(prim->data.text->alignment){
     case GL2PS_TEXT_C:
-      fprintf(gl2ps->stream, "{");
+      gl2psPrintf("{");
       break;
     case GL2PS_TEXT_CL:
-      fprintf(gl2ps->stream, "[l]{");
+      gl2psPrintf("[l]{");
       break;
     case GL2PS_TEXT_CR:
-      fprintf(gl2ps->stream, "[r]{");
+      gl2psPrintf("[r]{");
       break;
     case GL2PS_TEXT_B:
-      fprintf(gl2ps->stream, "[b]{");
+      gl2psPrintf("[b]{");
       break;
     case GL2PS_TEXT_BR:
-      fprintf(gl2ps->stream, "[br]{");
+      gl2psPrintf("[br]{");
       break;
     case GL2PS_TEXT_T:
-      fprintf(gl2ps->stream, "[t]{");
+      gl2psPrintf("[t]{");
       break;
     case GL2PS_TEXT_TL:
-      fprintf(gl2ps->stream, "[tl]{");
+      gl2psPrintf("[tl]{");
       break;
     case GL2PS_TEXT_TR:
-      fprintf(gl2ps->stream, "[tr]{");
+      gl2psPrintf("[tr]{");
       break;
     case GL2PS_TEXT_BL:
     default:
-      fprintf(gl2ps->stream, "[bl]{");
+      gl2psPrintf("[bl]{");
       break;
     }
     if(prim->data.text->angle)
-      fprintf(gl2ps->stream, "\\rotatebox{%g}{", prim->data.text->angle);
-    fprintf(gl2ps->stream, "\\textcolor[rgb]{%g,%g,%g}{{%s}}",
+      gl2psPrintf("\\rotatebox{%g}{", prim->data.text->angle);
+    gl2psPrintf("\\textcolor[rgb]{%g,%g,%g}{{%s}}",
             prim->verts[0].rgba[0], prim->verts[0].rgba[1], prim->verts[0].rgba[2],
             prim->data.text->str);
     if(prim->data.text->angle)
-      fprintf(gl2ps->stream, "}");
-    fprintf(gl2ps->stream, "}}\n");
+      gl2psPrintf("}");
+    gl2psPrintf("}}\n");
     break;
   case GL2PS_SPECIAL :
     /* alignment contains the format for which the special output text
        is intended */
     if (prim->data.text->alignment == GL2PS_TEX)
-      fprintf(gl2ps->stream, "%s\n", prim->data.text->str);
+      gl2psPrintf("%s\n", prim->data.text->str);
     break;
   default :
     break;
@@ -3306,13 +4336,14 @@ static void gl2psPrintTeXPrimitive(void *data)
 
 static void gl2psPrintTeXFooter(void)
 {
-  fprintf(gl2ps->stream, "\\end{picture}%s\n",
+  gl2psPrintf("\\end{picture}%s\n",
           (gl2ps->options & GL2PS_LANDSCAPE) ? "}" : "");
 }
 
 static void gl2psPrintTeXBeginViewport(GLint viewport[4])
 {
-  glRenderMode(GL_FEEDBACK);
+  if(!(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT))
+    glRenderMode(GL_FEEDBACK);
   
   if(gl2ps->header){
     gl2psPrintTeXHeader();
@@ -3352,7 +4383,7 @@ static int gl2psPrintPDFCompressorType(void)
 {
 #if defined(GL2PS_HAVE_ZLIB)
   if(gl2ps->options & GL2PS_COMPRESS){
-    return fprintf(gl2ps->stream, "/Filter [/FlateDecode]\n");
+    return gl2psPrintf("/Filter [/FlateDecode]\n");
   }
 #endif
   return 0;
@@ -3790,16 +4821,16 @@ static int gl2psPDFgroupListWriteGStateResources(void)
   int offs = 0;
   int i;
 
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "/ExtGState\n" 
                   "<<\n"
                   "/GSa 7 0 R\n");
   for(i = 0; i < gl2psListNbr(gl2ps->pdfgrouplist); ++i){  
     gro = (GL2PSpdfgroup*)gl2psListPointer(gl2ps->pdfgrouplist, i); 
     if(gro->gsno >= 0)
-      offs += fprintf(gl2ps->stream, "/GS%d %d 0 R\n", gro->gsno, gro->gsobjno);
+      offs += gl2psPrintf("/GS%d %d 0 R\n", gro->gsno, gro->gsobjno);
   }
-  offs += fprintf(gl2ps->stream, ">>\n"); 
+  offs += gl2psPrintf(">>\n"); 
   return offs;
 }
 
@@ -3811,17 +4842,17 @@ static int gl2psPDFgroupListWriteShaderResources(void)
   int offs = 0;
   int i;
 
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "/Shading\n"
                   "<<\n");
   for(i = 0; i < gl2psListNbr(gl2ps->pdfgrouplist); ++i){  
     gro = (GL2PSpdfgroup*)gl2psListPointer(gl2ps->pdfgrouplist, i); 
     if(gro->shno >= 0)
-      offs += fprintf(gl2ps->stream, "/Sh%d %d 0 R\n", gro->shno, gro->shobjno);
+      offs += gl2psPrintf("/Sh%d %d 0 R\n", gro->shno, gro->shobjno);
     if(gro->maskshno >= 0)
-      offs += fprintf(gl2ps->stream, "/TrSh%d %d 0 R\n", gro->maskshno, gro->maskshobjno);
+      offs += gl2psPrintf("/TrSh%d %d 0 R\n", gro->maskshno, gro->maskshobjno);
   }
-  offs += fprintf(gl2ps->stream,">>\n");  
+  offs += gl2psPrintf(">>\n");  
   return offs;
 }
 
@@ -3834,7 +4865,7 @@ static int gl2psPDFgroupListWriteXObjectResources(void)
   GL2PSpdfgroup *gro;
   int offs = 0;
 
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "/XObject\n"
                   "<<\n");
 
@@ -3848,16 +4879,16 @@ static int gl2psPDFgroupListWriteXObjectResources(void)
       gro->imobjno = gl2ps->objects_stack++;
       if(GL_RGBA == p->data.image->format)  /* reserve one object for image mask */
         gl2ps->objects_stack++;
-      offs += fprintf(gl2ps->stream, "/Im%d %d 0 R\n", gro->imno, gro->imobjno);
+      offs += gl2psPrintf("/Im%d %d 0 R\n", gro->imno, gro->imobjno);
     case GL2PS_TRIANGLE:
       if(gro->trgroupno >=0)
-        offs += fprintf(gl2ps->stream, "/TrG%d %d 0 R\n", gro->trgroupno, gro->trgroupobjno);
+        offs += gl2psPrintf("/TrG%d %d 0 R\n", gro->trgroupno, gro->trgroupobjno);
       break;
     default:
       break;
     }
   }
-  offs += fprintf(gl2ps->stream,">>\n");
+  offs += gl2psPrintf(">>\n");
   return offs;
 }
 
@@ -3869,16 +4900,16 @@ static int gl2psPDFgroupListWriteFontResources(void)
   GL2PSpdfgroup *gro;
   int offs = 0;
 
-  offs += fprintf(gl2ps->stream, "/Font\n<<\n");
+  offs += gl2psPrintf("/Font\n<<\n");
 
   for(i = 0; i < gl2psListNbr(gl2ps->pdfgrouplist); ++i){  
     gro = (GL2PSpdfgroup*)gl2psListPointer(gl2ps->pdfgrouplist, i); 
     if(gro->fontno < 0)
       continue;
     gro->fontobjno = gl2ps->objects_stack++;
-    offs += fprintf(gl2ps->stream, "/F%d %d 0 R\n", gro->fontno, gro->fontobjno);
+    offs += gl2psPrintf("/F%d %d 0 R\n", gro->fontno, gro->fontobjno);
   }
-  offs += fprintf(gl2ps->stream, ">>\n");
+  offs += gl2psPrintf(">>\n");
 
   return offs;
 }
@@ -3909,9 +4940,9 @@ static int gl2psPrintPDFInfo(void)
   struct tm *newtime;
   
   time(&now);
-  newtime = gmtime(&now);
+  newtime = gl2psGmtime(&now);
   
-  offs = fprintf(gl2ps->stream,
+  offs = gl2psPrintf(
                  "1 0 obj\n"
                  "<<\n"
                  "/Title (%s)\n"
@@ -3922,13 +4953,13 @@ static int gl2psPrintPDFInfo(void)
                  gl2ps->producer);
   
   if(!newtime){
-    offs += fprintf(gl2ps->stream, 
+    offs += gl2psPrintf(
                     ">>\n"
                     "endobj\n");
     return offs;
   }
   
-  offs += fprintf(gl2ps->stream, 
+  offs += gl2psPrintf(
                   "/CreationDate (D:%d%02d%02d%02d%02d%02d)\n"
                   ">>\n"
                   "endobj\n",
@@ -3945,7 +4976,7 @@ static int gl2psPrintPDFInfo(void)
 
 static int gl2psPrintPDFCatalog(void)
 {
-  return fprintf(gl2ps->stream, 
+  return gl2psPrintf(
                  "2 0 obj\n"
                  "<<\n"
                  "/Type /Catalog\n"
@@ -3956,7 +4987,7 @@ static int gl2psPrintPDFCatalog(void)
 
 static int gl2psPrintPDFPages(void)
 {
-  return fprintf(gl2ps->stream, 
+  return gl2psPrintf(
                  "3 0 obj\n"
                  "<<\n" 
                  "/Type /Pages\n"
@@ -3972,12 +5003,12 @@ static int gl2psOpenPDFDataStream(void)
 {
   int offs = 0;
   
-  offs += fprintf(gl2ps->stream, 
+  offs += gl2psPrintf(
                   "4 0 obj\n"
                   "<<\n" 
                   "/Length 5 0 R\n" );
   offs += gl2psPrintPDFCompressorType();
-  offs += fprintf(gl2ps->stream, 
+  offs += gl2psPrintf(
                   ">>\n"
                   "stream\n");
   return offs;
@@ -4017,7 +5048,7 @@ static void gl2psPrintPDFHeader(void)
   }
 #endif    
   gl2ps->xreflist[0] = 0;
-  offs += fprintf(gl2ps->stream, "%%PDF-1.4\n");
+  offs += gl2psPrintf("%%PDF-1.4\n");
   gl2ps->xreflist[1] = offs;
   
   offs += gl2psPrintPDFInfo();
@@ -4031,6 +5062,11 @@ static void gl2psPrintPDFHeader(void)
   
   offs += gl2psOpenPDFDataStream();
   gl2ps->xreflist[5] = offs; /* finished in gl2psPrintPDFFooter */
+#if defined(GL2PS_HAVE_ZLIB)
+  if(gl2ps->options & GL2PS_COMPRESS){
+    gl2psBeginDeflate(GL_FALSE);
+  }
+#endif
   gl2ps->streamlength = gl2psOpenPDFDataStreamWritePreface();
 }
 
@@ -4055,18 +5091,12 @@ static int gl2psClosePDFDataStream(void)
  
 #if defined(GL2PS_HAVE_ZLIB)
   if(gl2ps->options & GL2PS_COMPRESS){
-    if(Z_OK != gl2psDeflate())
-      gl2psMsg(GL2PS_ERROR, "Zlib deflate error");
-    else
-      fwrite(gl2ps->compress->dest, gl2ps->compress->destLen, 1, gl2ps->stream);
-    gl2ps->streamlength += gl2ps->compress->destLen;
-    
+    gl2ps->streamlength += gl2psEndDeflate();
     offs += gl2ps->streamlength;
-    gl2psFreeCompress();
   }
 #endif 
   
-  offs += fprintf(gl2ps->stream, 
+  offs += gl2psPrintf(
                   "endstream\n"
                   "endobj\n");
   return offs;
@@ -4076,7 +5106,7 @@ static int gl2psClosePDFDataStream(void)
 
 static int gl2psPrintPDFDataStreamLength(int val)
 {
-  return fprintf(gl2ps->stream,
+  return gl2psPrintf(
                  "5 0 obj\n"
                  "%d\n"
                  "endobj\n", val);
@@ -4090,7 +5120,7 @@ static int gl2psPrintPDFOpenPage(void)
   
   /* Write fixed part */
   
-  offs = fprintf(gl2ps->stream, 
+  offs = gl2psPrintf(
                  "6 0 obj\n"
                  "<<\n" 
                  "/Type /Page\n"
@@ -4100,9 +5130,9 @@ static int gl2psPrintPDFOpenPage(void)
                  (int)gl2ps->viewport[2], (int)gl2ps->viewport[3]);
   
   if(gl2ps->options & GL2PS_LANDSCAPE)
-    offs += fprintf(gl2ps->stream, "/Rotate -90\n");
+    offs += gl2psPrintf("/Rotate -90\n");
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "/Contents 4 0 R\n"
                   "/Resources\n" 
                   "<<\n" 
@@ -4130,7 +5160,7 @@ static int gl2psPDFgroupListWriteVariableResources(void)
   offs += gl2psPDFgroupListWriteFontResources();
   
   /* End resources and page */
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   ">>\n"
                   ">>\n"
                   "endobj\n");
@@ -4141,7 +5171,7 @@ static int gl2psPDFgroupListWriteVariableResources(void)
 
 static int gl2psPrintPDFGSObject(void)
 {
-  return fprintf(gl2ps->stream,
+  return gl2psPrintf(
                  "7 0 obj\n"
                  "<<\n"
                  "/Type /ExtGState\n"
@@ -4339,7 +5369,7 @@ static int gl2psPrintPDFShader(int obj, GL2PStriangle *triangles,
   
   gl2psPDFRectHull(&xmin, &xmax, &ymin, &ymax, triangles, size);
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "%d 0 obj\n"
                   "<< "
                   "/ShadingType 4 "
@@ -4365,14 +5395,13 @@ static int gl2psPrintPDFShader(int obj, GL2PStriangle *triangles,
 
     if(Z_OK == gl2psDeflate() && 23 + gl2ps->compress->destLen < gl2ps->compress->srcLen){
       offs += gl2psPrintPDFCompressorType();
-      offs += fprintf(gl2ps->stream,
+      offs += gl2psPrintf(
                       "/Length %d "
                       ">>\n"
                       "stream\n",
                       (int)gl2ps->compress->destLen);
-      offs += gl2ps->compress->destLen * fwrite(gl2ps->compress->dest, 
-                                                gl2ps->compress->destLen, 
-                                                1, gl2ps->stream);
+      gl2psWrite(gl2ps->compress->dest, (int)gl2ps->compress->destLen);
+      offs += (int)gl2ps->compress->destLen;
       done = 1;
     }
     gl2psFreeCompress();
@@ -4382,7 +5411,7 @@ static int gl2psPrintPDFShader(int obj, GL2PStriangle *triangles,
   if(!done){
     /* no compression, or too long after compression, or compress error
        -> write non-compressed entry */
-    offs += fprintf(gl2ps->stream,
+    offs += gl2psPrintf(
                     "/Length %d "
                     ">>\n"
                     "stream\n",
@@ -4393,7 +5422,7 @@ static int gl2psPrintPDFShader(int obj, GL2PStriangle *triangles,
                                             gl2psWriteBigEndian, gray);
   }
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "\nendstream\n"
                   "endobj\n");
   
@@ -4406,7 +5435,7 @@ static int gl2psPrintPDFShaderMask(int obj, int childobj)
 {
   int offs = 0, len;
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "%d 0 obj\n"
                   "<<\n"
                   "/Type /XObject\n"
@@ -4422,15 +5451,15 @@ static int gl2psPrintPDFShaderMask(int obj, int childobj)
     ? strlen("/TrSh sh\n") + (int)log10((double)childobj)+1
     : strlen("/TrSh0 sh\n"); 
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "/Length %d\n"
                   ">>\n"
                   "stream\n",
                   len);
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "/TrSh%d sh\n",
                   childobj);
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "endstream\n"
                   "endobj\n");
   
@@ -4445,16 +5474,16 @@ static int gl2psPrintPDFShaderExtGS(int obj, int childobj)
 {
   int offs = 0;
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "%d 0 obj\n"
                   "<<\n",
                   obj);
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "/SMask << /S /Alpha /G %d 0 R >> ",
                   childobj);
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   ">>\n"
                   "endobj\n");
   return offs;
@@ -4466,7 +5495,7 @@ static int gl2psPrintPDFShaderSimpleExtGS(int obj, GLfloat alpha)
 {
   int offs = 0;
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "%d 0 obj\n"
                   "<<\n"
                   "/ca %g"
@@ -4526,7 +5555,7 @@ static int gl2psPrintPDFPixmap(int obj, int childobj, GL2PSimage *im, int gray)
   if(gray)
     sigbytes = gray / 8; 
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "%d 0 obj\n"
                   "<<\n"
                   "/Type /XObject\n"
@@ -4539,7 +5568,7 @@ static int gl2psPrintPDFPixmap(int obj, int childobj, GL2PSimage *im, int gray)
                   (int)im->width, (int)im->height,
                   (gray) ? "/DeviceGray" : "/DeviceRGB" );
   if(GL_RGBA == im->format && gray == 0){
-    offs += fprintf(gl2ps->stream,
+    offs += gl2psPrintf(
                     "/SMask %d 0 R\n",
                     childobj);
   }
@@ -4552,13 +5581,13 @@ static int gl2psPrintPDFPixmap(int obj, int childobj, GL2PSimage *im, int gray)
     
     if(Z_OK == gl2psDeflate() && 23 + gl2ps->compress->destLen < gl2ps->compress->srcLen){
       offs += gl2psPrintPDFCompressorType();
-      offs += fprintf(gl2ps->stream,
+      offs += gl2psPrintf(
                       "/Length %d "
                       ">>\n"
                       "stream\n",
                       (int)gl2ps->compress->destLen);
-      offs += gl2ps->compress->destLen * fwrite(gl2ps->compress->dest, gl2ps->compress->destLen,
-                                                1, gl2ps->stream);
+      gl2psWrite(gl2ps->compress->dest, (int)gl2ps->compress->destLen);
+      offs += (int)gl2ps->compress->destLen;
       done = 1;
     }
     gl2psFreeCompress();
@@ -4568,7 +5597,7 @@ static int gl2psPrintPDFPixmap(int obj, int childobj, GL2PSimage *im, int gray)
   if(!done){
     /* no compression, or too long after compression, or compress error
        -> write non-compressed entry */
-    offs += fprintf(gl2ps->stream,
+    offs += gl2psPrintf(
                     "/Length %d "
                     ">>\n"
                     "stream\n",
@@ -4576,7 +5605,7 @@ static int gl2psPrintPDFPixmap(int obj, int childobj, GL2PSimage *im, int gray)
     offs += gl2psPrintPDFPixmapStreamData(im, gl2psWriteBigEndian, gray);
   }
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "\nendstream\n"
                   "endobj\n");
   
@@ -4587,7 +5616,7 @@ static int gl2psPrintPDFText(int obj, GL2PSstring *s, int fontnumber)
 {
   int offs = 0;
   
-  offs += fprintf(gl2ps->stream,
+  offs += gl2psPrintf(
                   "%d 0 obj\n"
                   "<<\n"
                   "/Type /Font\n"
@@ -4666,7 +5695,7 @@ static int gl2psPDFgroupListWriteObjects(int entryoffs)
       /* alignment contains the format for which the special output text
          is intended */
       if(p->data.text->alignment == GL2PS_PDF)
-        offs += fprintf(gl2ps->stream, "%s\n", p->data.text->str);
+        offs += gl2psPrintf("%s\n", p->data.text->str);
       break;
     default:
       break;
@@ -4708,15 +5737,15 @@ static void gl2psPrintPDFFooter(void)
 
   /* Start cross reference table. The file has to been opened in
      binary mode to preserve the 20 digit string length! */
-  fprintf(gl2ps->stream,
+  gl2psPrintf(
           "xref\n"
           "0 %d\n"
           "%010d 65535 f \n", gl2ps->objects_stack, 0);
   
   for(i = 1; i < gl2ps->objects_stack; ++i)
-    fprintf(gl2ps->stream, "%010d 00000 n \n", gl2ps->xreflist[i]);
+    gl2psPrintf("%010d 00000 n \n", gl2ps->xreflist[i]);
   
-  fprintf(gl2ps->stream,
+  gl2psPrintf(
           "trailer\n"
           "<<\n" 
           "/Size %d\n"
@@ -4750,7 +5779,8 @@ static void gl2psPrintPDFBeginViewport(GLint viewport[4])
   GLfloat rgba[4];
   int x = viewport[0], y = viewport[1], w = viewport[2], h = viewport[3];
   
-  glRenderMode(GL_FEEDBACK);
+  if(!(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT))
+    glRenderMode(GL_FEEDBACK);
   
   if(gl2ps->header){
     gl2psPrintPDFHeader();
@@ -4760,7 +5790,10 @@ static void gl2psPrintPDFBeginViewport(GLint viewport[4])
   offs += gl2psPrintf("q\n");
   
   if(gl2ps->options & GL2PS_DRAW_BACKGROUND){
-    if(gl2ps->colormode == GL_RGBA || gl2ps->colorsize == 0){
+    if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+      memcpy(rgba, gl2ps->bgcolor, sizeof(GL2PSrgba));
+    }
+    else if(gl2ps->colormode == GL_RGBA || gl2ps->colorsize == 0){
       glGetFloatv(GL_COLOR_CLEAR_VALUE, rgba);
     }
     else{
@@ -4840,7 +5873,11 @@ static void gl2psSVGGetColorString(GL2PSrgba rgba, char str[32])
   int rc = (r < 0) ? 0 : (r > 255) ? 255 : r;
   int gc = (g < 0) ? 0 : (g > 255) ? 255 : g;
   int bc = (b < 0) ? 0 : (b > 255) ? 255 : b;
-  sprintf(str, "#%2.2x%2.2x%2.2x", rc, gc, bc);
+  str[0] = '#';
+  gl2psFormatHex(str + 1, rc, 2);
+  gl2psFormatHex(str + 3, gc, 2);
+  gl2psFormatHex(str + 5, bc, 2);
+  str[7] = '\0';
 }
 
 static void gl2psPrintSVGHeader(void)
@@ -4878,7 +5915,7 @@ static void gl2psPrintSVGHeader(void)
               "For: %s\n"
               "CreationDate: %s",
               GL2PS_MAJOR_VERSION, GL2PS_MINOR_VERSION, GL2PS_PATCH_VERSION,
-              GL2PS_EXTRA_VERSION, GL2PS_COPYRIGHT, gl2ps->producer, ctime(&now));
+              GL2PS_EXTRA_VERSION, GL2PS_COPYRIGHT, gl2ps->producer, gl2psCtime(&now));
   gl2psPrintf("</desc>\n");
   gl2psPrintf("<defs>\n");
   gl2psPrintf("</defs>\n");
@@ -5126,7 +6163,8 @@ static void gl2psPrintSVGBeginViewport(GLint viewport[4])
   GLfloat rgba[4];
   int x = viewport[0], y = viewport[1], w = viewport[2], h = viewport[3];
 
-  glRenderMode(GL_FEEDBACK);
+  if(!(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT))
+    glRenderMode(GL_FEEDBACK);
   
   if(gl2ps->header){
     gl2psPrintSVGHeader();
@@ -5134,7 +6172,10 @@ static void gl2psPrintSVGBeginViewport(GLint viewport[4])
   }
 
   if(gl2ps->options & GL2PS_DRAW_BACKGROUND){
-    if(gl2ps->colormode == GL_RGBA || gl2ps->colorsize == 0){
+    if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+      memcpy(rgba, gl2ps->bgcolor, sizeof(GL2PSrgba));
+    }
+    else if(gl2ps->colormode == GL_RGBA || gl2ps->colorsize == 0){
       glGetFloatv(GL_COLOR_CLEAR_VALUE, rgba);
     }
     else{
@@ -5200,7 +6241,7 @@ static void gl2psPrintPGFColor(GL2PSrgba rgba)
 {
   if(!gl2psSameColor(gl2ps->lastrgba, rgba)){
     gl2psSetLastColor(rgba);
-    fprintf(gl2ps->stream, "\\color[rgb]{%f,%f,%f}\n", rgba[0], rgba[1], rgba[2]);
+    gl2psPrintf("\\color[rgb]{%f,%f,%f}\n", rgba[0], rgba[1], rgba[2]);
   }
 }
 
@@ -5210,19 +6251,19 @@ static void gl2psPrintPGFHeader(void)
 
   time(&now);
 
-  fprintf(gl2ps->stream, 
+  gl2psPrintf(
           "%% Title: %s\n"
           "%% Creator: GL2PS %d.%d.%d%s, %s\n"
           "%% For: %s\n"
           "%% CreationDate: %s",
           gl2ps->title, GL2PS_MAJOR_VERSION, GL2PS_MINOR_VERSION,
           GL2PS_PATCH_VERSION, GL2PS_EXTRA_VERSION, GL2PS_COPYRIGHT,
-          gl2ps->producer, ctime(&now));
+          gl2ps->producer, gl2psCtime(&now));
 
-  fprintf(gl2ps->stream, "\\begin{pgfpicture}\n");
+  gl2psPrintf("\\begin{pgfpicture}\n");
   if(gl2ps->options & GL2PS_DRAW_BACKGROUND){
     gl2psPrintPGFColor(gl2ps->bgcolor);
-    fprintf(gl2ps->stream,
+    gl2psPrintf(
             "\\pgfpathrectanglecorners{"
             "\\pgfpoint{%dpt}{%dpt}}{\\pgfpoint{%dpt}{%dpt}}\n"
             "\\pgfusepath{fill}\n",
@@ -5243,13 +6284,13 @@ static void gl2psPrintPGFDash(GLushort pattern, GLint factor)
 
   if(!pattern || !factor){
     /* solid line */
-    fprintf(gl2ps->stream, "\\pgfsetdash{}{0pt}\n");
+    gl2psPrintf("\\pgfsetdash{}{0pt}\n");
   }
   else{
     gl2psParseStipplePattern(pattern, factor, &n, array);
-    fprintf(gl2ps->stream, "\\pgfsetdash{");
-    for(i = 0; i < n; i++) fprintf(gl2ps->stream, "{%dpt}", array[i]);
-    fprintf(gl2ps->stream, "}{0pt}\n");
+    gl2psPrintf("\\pgfsetdash{");
+    for(i = 0; i < n; i++) gl2psPrintf("{%dpt}", array[i]);
+    gl2psPrintf("}{0pt}\n");
   }
 }
 
@@ -5279,7 +6320,7 @@ static void gl2psPrintPGFPrimitive(void *data)
   case GL2PS_POINT :
     /* Points in openGL are rectangular */
     gl2psPrintPGFColor(prim->verts[0].rgba);
-    fprintf(gl2ps->stream, 
+    gl2psPrintf(
             "\\pgfpathrectangle{\\pgfpoint{%fpt}{%fpt}}"
             "{\\pgfpoint{%fpt}{%fpt}}\n\\pgfusepath{fill}\n",
             prim->verts[0].xyz[0]-0.5*prim->width,
@@ -5290,10 +6331,10 @@ static void gl2psPrintPGFPrimitive(void *data)
     gl2psPrintPGFColor(prim->verts[0].rgba);
     if(gl2ps->lastlinewidth != prim->width){
       gl2ps->lastlinewidth = prim->width;
-      fprintf(gl2ps->stream, "\\pgfsetlinewidth{%fpt}\n", gl2ps->lastlinewidth);
+      gl2psPrintf("\\pgfsetlinewidth{%fpt}\n", gl2ps->lastlinewidth);
     }
     gl2psPrintPGFDash(prim->pattern, prim->factor);
-    fprintf(gl2ps->stream, 
+    gl2psPrintf(
             "\\pgfpathmoveto{\\pgfpoint{%fpt}{%fpt}}\n"
             "\\pgflineto{\\pgfpoint{%fpt}{%fpt}}\n"
             "\\pgfusepath{stroke}\n",
@@ -5303,10 +6344,10 @@ static void gl2psPrintPGFPrimitive(void *data)
   case GL2PS_TRIANGLE :
     if(gl2ps->lastlinewidth != 0){
       gl2ps->lastlinewidth = 0;
-      fprintf(gl2ps->stream, "\\pgfsetlinewidth{0.01pt}\n");
+      gl2psPrintf("\\pgfsetlinewidth{0.01pt}\n");
     }
     gl2psPrintPGFColor(prim->verts[0].rgba);
-    fprintf(gl2ps->stream, 
+    gl2psPrintf(
             "\\pgfpathmoveto{\\pgfpoint{%fpt}{%fpt}}\n"
             "\\pgflineto{\\pgfpoint{%fpt}{%fpt}}\n"
             "\\pgflineto{\\pgfpoint{%fpt}{%fpt}}\n"
@@ -5317,27 +6358,27 @@ static void gl2psPrintPGFPrimitive(void *data)
             prim->verts[0].xyz[0], prim->verts[0].xyz[1]);
     break;
   case GL2PS_TEXT :
-    fprintf(gl2ps->stream, "{\n\\pgftransformshift{\\pgfpoint{%fpt}{%fpt}}\n",
+    gl2psPrintf("{\n\\pgftransformshift{\\pgfpoint{%fpt}{%fpt}}\n",
             prim->verts[0].xyz[0], prim->verts[0].xyz[1]);
 
     if(prim->data.text->angle)
-      fprintf(gl2ps->stream, "\\pgftransformrotate{%f}{", prim->data.text->angle);
+      gl2psPrintf("\\pgftransformrotate{%f}{", prim->data.text->angle);
 
-    fprintf(gl2ps->stream, "\\pgfnode{rectangle}{%s}{\\fontsize{%d}{0}\\selectfont",
+    gl2psPrintf("\\pgfnode{rectangle}{%s}{\\fontsize{%d}{0}\\selectfont",
             gl2psPGFTextAlignment(prim->data.text->alignment),
             prim->data.text->fontsize);
 
-    fprintf(gl2ps->stream, "\\textcolor[rgb]{%g,%g,%g}{{%s}}",
+    gl2psPrintf("\\textcolor[rgb]{%g,%g,%g}{{%s}}",
             prim->verts[0].rgba[0], prim->verts[0].rgba[1],
             prim->verts[0].rgba[2], prim->data.text->str);
 
-    fprintf(gl2ps->stream, "}{}{\\pgfusepath{discard}}}\n");
+    gl2psPrintf("}{}{\\pgfusepath{discard}}}\n");
     break;
   case GL2PS_SPECIAL :
     /* alignment contains the format for which the special output text
        is intended */
     if (prim->data.text->alignment == GL2PS_PGF)
-      fprintf(gl2ps->stream, "%s\n", prim->data.text->str);
+      gl2psPrintf("%s\n", prim->data.text->str);
     break;
   default :
     break;
@@ -5346,7 +6387,7 @@ static void gl2psPrintPGFPrimitive(void *data)
 
 static void gl2psPrintPGFFooter(void)
 {
-  fprintf(gl2ps->stream, "\\end{pgfpicture}\n");
+  gl2psPrintf("\\end{pgfpicture}\n");
 }
 
 static void gl2psPrintPGFBeginViewport(GLint viewport[4])
@@ -5355,16 +6396,20 @@ static void gl2psPrintPGFBeginViewport(GLint viewport[4])
   GLfloat rgba[4];
   int x = viewport[0], y = viewport[1], w = viewport[2], h = viewport[3];
 
-  glRenderMode(GL_FEEDBACK);
+  if(!(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT))
+    glRenderMode(GL_FEEDBACK);
 
   if(gl2ps->header){
     gl2psPrintPGFHeader();
     gl2ps->header = GL_FALSE;
   }
 
-  fprintf(gl2ps->stream, "\\begin{pgfscope}\n");
+  gl2psPrintf("\\begin{pgfscope}\n");
   if(gl2ps->options & GL2PS_DRAW_BACKGROUND){
-    if(gl2ps->colormode == GL_RGBA || gl2ps->colorsize == 0){
+    if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+      memcpy(rgba, gl2ps->bgcolor, sizeof(GL2PSrgba));
+    }
+    else if(gl2ps->colormode == GL_RGBA || gl2ps->colorsize == 0){
       glGetFloatv(GL_COLOR_CLEAR_VALUE, rgba);
     }
     else{
@@ -5375,14 +6420,14 @@ static void gl2psPrintPGFBeginViewport(GLint viewport[4])
       rgba[3] = 1.0F;
     }
     gl2psPrintPGFColor(rgba);
-    fprintf(gl2ps->stream, 
+    gl2psPrintf(
             "\\pgfpathrectangle{\\pgfpoint{%dpt}{%dpt}}"
             "{\\pgfpoint{%dpt}{%dpt}}\n"
             "\\pgfusepath{fill}\n",
             x, y, w, h);
   }
   
-  fprintf(gl2ps->stream, 
+  gl2psPrintf(
           "\\pgfpathrectangle{\\pgfpoint{%dpt}{%dpt}}"
           "{\\pgfpoint{%dpt}{%dpt}}\n"
           "\\pgfusepath{clip}\n",
@@ -5393,7 +6438,7 @@ static GLint gl2psPrintPGFEndViewport(void)
 {
   GLint res;
   res = gl2psPrintPrimitives();
-  fprintf(gl2ps->stream, "\\end{pgfscope}\n");
+  gl2psPrintf("\\end{pgfscope}\n");
   return res;
 }
 
@@ -5457,7 +6502,10 @@ static GLint gl2psPrintPrimitives(void)
   GL2PSxyz eye = {0.0F, 0.0F, 100.0F * GL2PS_ZSCALE};
   GLint used;
 
-  used = glRenderMode(GL_RENDER);
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT)
+    used = 0; /* primitives were added directly */
+  else
+    used = glRenderMode(GL_RENDER);
 
   if(used < 0){
     gl2psMsg(GL2PS_INFO, "OpenGL feedback buffer overflow");
@@ -5488,7 +6536,6 @@ static GLint gl2psPrintPrimitives(void)
   switch(gl2ps->sort){
   case GL2PS_NO_SORT :
     gl2psListAction(gl2ps->primitives, gl2psbackends[gl2ps->format]->printPrimitive);
-    gl2psListAction(gl2ps->primitives, gl2psFreePrimitive);
     /* reset the primitive list, waiting for the next viewport */
     gl2psListReset(gl2ps->primitives);
     break;
@@ -5499,12 +6546,11 @@ static GLint gl2psPrintPrimitives(void)
       gl2psFreeBspImageTree(&gl2ps->imagetree);
     }
     gl2psListAction(gl2ps->primitives, gl2psbackends[gl2ps->format]->printPrimitive);
-    gl2psListAction(gl2ps->primitives, gl2psFreePrimitive);
     /* reset the primitive list, waiting for the next viewport */
     gl2psListReset(gl2ps->primitives);
     break;
   case GL2PS_BSP_SORT :
-    root = (GL2PSbsptree*)gl2psMalloc(sizeof(GL2PSbsptree));
+    root = (GL2PSbsptree*)gl2psArenaAlloc(gl2ps->arena, sizeof(GL2PSbsptree));
     gl2psBuildBspTree(root, gl2ps->primitives);
     if(GL_TRUE == gl2ps->boundary) gl2psBuildPolygonBoundary(root);
     if(gl2ps->options & GL2PS_OCCLUSION_CULL){
@@ -5514,7 +6560,6 @@ static GLint gl2psPrintPrimitives(void)
     }
     gl2psTraverseBspTree(root, eye, GL2PS_EPSILON, gl2psGreater, 
                          gl2psbackends[gl2ps->format]->printPrimitive, 0);
-    gl2psFreeBspTree(&root);
     /* reallocate the primitive list (it's been deleted by
        gl2psBuildBspTree) in case there is another viewport */
     gl2ps->primitives = gl2psListCreate(500, 500, sizeof(GL2PSprimitive*));
@@ -5547,6 +6592,9 @@ GL2PSDLL_API GLint gl2psBeginPage(const char *title, const char *producer,
   }
 
   gl2ps = (GL2PScontext*)gl2psMalloc(sizeof(GL2PScontext));
+  for(i = 0; i < GL2PS_MAX_THREADS; i++){
+    gl2psArenaInit(&gl2ps->arena[i]);
+  }
 
   if(format >= 0 && format < (GLint)(sizeof(gl2psbackends)/sizeof(gl2psbackends[0]))){
     gl2ps->format = format;
@@ -5583,11 +6631,23 @@ GL2PSDLL_API GLint gl2psBeginPage(const char *title, const char *producer,
 
   gl2ps->header = GL_TRUE;
   gl2ps->maxbestroot = 10;
+  gl2ps->bspsamples = 0;
+  gl2ps->bspnodes = gl2ps->bspdepth = gl2ps->bspsplits = 0;
   gl2ps->options = options;
   gl2ps->compress = NULL;
+  memset(&gl2ps->out, 0, sizeof(GL2PSoutput));
   gl2ps->imagemap_head = NULL;
   gl2ps->imagemap_tail = NULL;
 
+  if((gl2ps->options & GL2PS_NO_OPENGL_CONTEXT) && 
+     ((gl2ps->options & GL2PS_USE_CURRENT_VIEWPORT) || colormode != GL_RGBA)){
+    gl2psMsg(GL2PS_ERROR, "GL2PS_NO_OPENGL_CONTEXT needs an explicit viewport "
+             "and GL_RGBA color mode");
+    gl2psFree(gl2ps);
+    gl2ps = NULL;
+    return GL2PS_ERROR;
+  }
+
   if(gl2ps->options & GL2PS_USE_CURRENT_VIEWPORT){
     glGetIntegerv(GL_VIEWPORT, gl2ps->viewport);
   }
@@ -5630,14 +6690,27 @@ GL2PSDLL_API GLint gl2psBeginPage(const char *title, const char *producer,
   
   /* get default blending mode from current OpenGL state (enabled by
      default for SVG) */
-  gl2ps->blending = (gl2ps->format == GL2PS_SVG) ? GL_TRUE : glIsEnabled(GL_BLEND);
-  glGetIntegerv(GL_BLEND_SRC, &gl2ps->blendfunc[0]);
-  glGetIntegerv(GL_BLEND_DST, &gl2ps->blendfunc[1]);
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+    /* use gl2psEnable(GL2PS_BLEND) and gl2psSetBackgroundColor */
+    gl2ps->blending = (gl2ps->format == GL2PS_SVG) ? GL_TRUE : GL_FALSE;
+    gl2ps->blendfunc[0] = GL_SRC_ALPHA;
+    gl2ps->blendfunc[1] = GL_ONE_MINUS_SRC_ALPHA;
+  }
+  else{
+    gl2ps->blending = (gl2ps->format == GL2PS_SVG) ? GL_TRUE : glIsEnabled(GL_BLEND);
+    glGetIntegerv(GL_BLEND_SRC, &gl2ps->blendfunc[0]);
+    glGetIntegerv(GL_BLEND_DST, &gl2ps->blendfunc[1]);
+  }
 
   if(gl2ps->colormode == GL_RGBA){
     gl2ps->colorsize = 0;
     gl2ps->colormap = NULL;
-    glGetFloatv(GL_COLOR_CLEAR_VALUE, gl2ps->bgcolor);
+    if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+      for(i = 0; i < 4; i++)
+        gl2ps->bgcolor[i] = 0.0F;
+    }
+    else
+      glGetFloatv(GL_COLOR_CLEAR_VALUE, gl2ps->bgcolor);
   }
   else if(gl2ps->colormode == GL_COLOR_INDEX){
     if(!colorsize || !colormap){
@@ -5691,16 +6764,23 @@ GL2PSDLL_API GLint gl2psBeginPage(const char *title, const char *producer,
 
   gl2ps->primitives = gl2psListCreate(500, 500, sizeof(GL2PSprimitive*));
   gl2ps->auxprimitives = gl2psListCreate(100, 100, sizeof(GL2PSprimitive*));
-  gl2ps->feedback = (GLfloat*)gl2psMalloc(gl2ps->buffersize * sizeof(GLfloat));
-  glFeedbackBuffer(gl2ps->buffersize, GL_3D_COLOR, gl2ps->feedback);
-  glRenderMode(GL_FEEDBACK);  
+  gl2ps->out.buf = (char*)gl2psMalloc(GL2PS_OUTPUT_BUFFER);
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+    gl2ps->feedback = NULL;
+    gl2ps->buffersize = 0;
+  }
+  else{
+    gl2ps->feedback = (GLfloat*)gl2psMalloc(gl2ps->buffersize * sizeof(GLfloat));
+    glFeedbackBuffer(gl2ps->buffersize, GL_3D_COLOR, gl2ps->feedback);
+    glRenderMode(GL_FEEDBACK);  
+  }
 
   return GL2PS_SUCCESS;
 }
 
 GL2PSDLL_API GLint gl2psEndPage(void)
 {
-  GLint res;
+  GLint res, i;
 
   if(!gl2ps) return GL2PS_UNINITIALIZED;
 
@@ -5709,8 +6789,13 @@ GL2PSDLL_API GLint gl2psEndPage(void)
   if(res != GL2PS_OVERFLOW)
     (gl2psbackends[gl2ps->format]->printFooter)();
   
+  gl2psFlushOutput();
   fflush(gl2ps->stream);
 
+  gl2psbspnodes = gl2ps->bspnodes;
+  gl2psbspdepth = gl2ps->bspdepth;
+  gl2psbspsplits = gl2ps->bspsplits;
+
   gl2psListDelete(gl2ps->primitives);
   gl2psListDelete(gl2ps->auxprimitives);
   gl2psFreeImagemap(gl2ps->imagemap_head);
@@ -5719,12 +6804,64 @@ GL2PSDLL_API GLint gl2psEndPage(void)
   gl2psFree(gl2ps->producer);
   gl2psFree(gl2ps->filename);
   gl2psFree(gl2ps->feedback);
+  gl2psFree(gl2ps->out.buf);
+  for(i = 0; i < GL2PS_MAX_THREADS; i++){
+    gl2psArenaFree(&gl2ps->arena[i]);
+  }
   gl2psFree(gl2ps);
   gl2ps = NULL;
 
   return res;
 }
 
+/* As gl2psBeginPage, but returns the new context (NULL on error). It
+   becomes the current context of the calling thread, and can be passed
+   to gl2psSetContext and gl2psEndPageCtx. A thread can have several
+   pages open at once, and switch between them */
+
+GL2PSDLL_API GL2PScontext *gl2psBeginPageCtx(const char *title, const char *producer, 
+                                             GLint viewport[4], GLint format, GLint sort,
+                                             GLint options, GLint colormode,
+                                             GLint colorsize, GL2PSrgba *colormap,
+                                             GLint nr, GLint ng, GLint nb, GLint buffersize,
+                                             FILE *stream, const char *filename)
+{
+  GL2PScontext *current = gl2ps;
+
+  gl2ps = NULL;
+  if(gl2psBeginPage(title, producer, viewport, format, sort, options, colormode,
+                    colorsize, colormap, nr, ng, nb, buffersize,
+                    stream, filename) != GL2PS_SUCCESS){
+    gl2ps = current;
+    return NULL;
+  }
+  return gl2ps;
+}
+
+GL2PSDLL_API GLint gl2psEndPageCtx(GL2PScontext *context)
+{
+  if(!context) return GL2PS_UNINITIALIZED;
+
+  gl2ps = context;
+  return gl2psEndPage();
+}
+
+/* Make a context current in the calling thread. All other gl2ps calls
+   work on the current context. A context must not be current in two
+   threads at once */
+
+GL2PSDLL_API GLint gl2psSetContext(GL2PScontext *context)
+{
+  gl2ps = context;
+
+  return GL2PS_SUCCESS;
+}
+
+GL2PSDLL_API GL2PScontext *gl2psGetContext(void)
+{
+  return gl2ps;
+}
+
 GL2PSDLL_API GLint gl2psBeginViewport(GLint viewport[4])
 {
   if(!gl2ps) return GL2PS_UNINITIALIZED;
@@ -5783,16 +6920,19 @@ GL2PSDLL_API GLint gl2psDrawPixels(GLsizei width, GLsizei height,
     return GL2PS_ERROR;
   }
 
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+    gl2psMsg(GL2PS_WARNING, "Pixmaps need an OpenGL raster position");
+    return GL2PS_WARNING;
+  }
+
   glGetBooleanv(GL_CURRENT_RASTER_POSITION_VALID, &valid);
   if(GL_FALSE == valid) return GL2PS_SUCCESS; /* the primitive is culled */
 
   glGetFloatv(GL_CURRENT_RASTER_POSITION, pos);
 
-  prim = (GL2PSprimitive*)gl2psMalloc(sizeof(GL2PSprimitive));
+  prim = gl2psArenaPrimitive(gl2ps->arena, 1);
   prim->type = GL2PS_PIXMAP;
   prim->boundary = 0;
-  prim->numverts = 1;
-  prim->verts = (GL2PSvertex*)gl2psMalloc(sizeof(GL2PSvertex));
   prim->verts[0].xyz[0] = pos[0] + xorig;
   prim->verts[0].xyz[1] = pos[1] + yorig;
   prim->verts[0].xyz[2] = pos[2];
@@ -5802,7 +6942,7 @@ GL2PSDLL_API GLint gl2psDrawPixels(GLsizei width, GLsizei height,
   prim->factor = 0;
   prim->width = 1;
   glGetFloatv(GL_CURRENT_RASTER_COLOR, prim->verts[0].rgba);
-  prim->data.image = (GL2PSimage*)gl2psMalloc(sizeof(GL2PSimage));
+  prim->data.image = (GL2PSimage*)gl2psArenaAlloc(gl2ps->arena, sizeof(GL2PSimage));
   prim->data.image->width = width;
   prim->data.image->height = height;
   prim->data.image->format = format;
@@ -5814,7 +6954,7 @@ GL2PSDLL_API GLint gl2psDrawPixels(GLsizei width, GLsizei height,
       /* special case: blending turned off */
       prim->data.image->format = GL_RGB;
       size = height * width * 3;
-      prim->data.image->pixels = (GLfloat*)gl2psMalloc(size * sizeof(GLfloat));
+      prim->data.image->pixels = (GLfloat*)gl2psArenaAlloc(gl2ps->arena, size * sizeof(GLfloat));
       piv = (GLfloat*)pixels;
       for(i = 0; i < size; ++i, ++piv){
         prim->data.image->pixels[i] = *piv;
@@ -5824,14 +6964,14 @@ GL2PSDLL_API GLint gl2psDrawPixels(GLsizei width, GLsizei height,
     }
     else{
       size = height * width * 4;
-      prim->data.image->pixels = (GLfloat*)gl2psMalloc(size * sizeof(GLfloat));
+      prim->data.image->pixels = (GLfloat*)gl2psArenaAlloc(gl2ps->arena, size * sizeof(GLfloat));
       memcpy(prim->data.image->pixels, pixels, size * sizeof(GLfloat));
     }
     break;
   case GL_RGB:
   default:
     size = height * width * 3;
-    prim->data.image->pixels = (GLfloat*)gl2psMalloc(size * sizeof(GLfloat));
+    prim->data.image->pixels = (GLfloat*)gl2psArenaAlloc(gl2ps->arena, size * sizeof(GLfloat));
     memcpy(prim->data.image->pixels, pixels, size * sizeof(GLfloat));
     break;
   }
@@ -5851,6 +6991,11 @@ GL2PSDLL_API GLint gl2psDrawImageMap(GLsizei width, GLsizei height,
   if(!gl2ps || !imagemap) return GL2PS_UNINITIALIZED;
 
   if((width <= 0) || (height <= 0)) return GL2PS_ERROR;
+
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+    gl2psMsg(GL2PS_WARNING, "Image maps need the OpenGL feedback buffer");
+    return GL2PS_WARNING;
+  }
   
   size = height + height * ((width-1)/8);
   glPassThrough(GL2PS_IMAGEMAP_TOKEN);
@@ -5873,6 +7018,13 @@ GL2PSDLL_API GLint gl2psEnable(GLint mode)
 
   if(!gl2ps) return GL2PS_UNINITIALIZED;
 
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+    /* offset, boundary and stipple are given in gl2psAddPolyPrimitive */
+    if(mode == GL2PS_BLEND)
+      gl2ps->blending = GL_TRUE;
+    return GL2PS_SUCCESS;
+  }
+
   switch(mode){
   case GL2PS_POLYGON_OFFSET_FILL :
     glPassThrough(GL2PS_BEGIN_OFFSET_TOKEN);
@@ -5904,6 +7056,12 @@ GL2PSDLL_API GLint gl2psDisable(GLint mode)
 {
   if(!gl2ps) return GL2PS_UNINITIALIZED;
 
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+    if(mode == GL2PS_BLEND)
+      gl2ps->blending = GL_FALSE;
+    return GL2PS_SUCCESS;
+  }
+
   switch(mode){
   case GL2PS_POLYGON_OFFSET_FILL :
     glPassThrough(GL2PS_END_OFFSET_TOKEN);
@@ -5929,6 +7087,9 @@ GL2PSDLL_API GLint gl2psPointSize(GLfloat value)
 {
   if(!gl2ps) return GL2PS_UNINITIALIZED;
 
+  /* widths are given in gl2psAddPolyPrimitive without OpenGL */
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT) return GL2PS_SUCCESS;
+
   glPassThrough(GL2PS_POINT_SIZE_TOKEN);
   glPassThrough(value);
   
@@ -5939,6 +7100,8 @@ GL2PSDLL_API GLint gl2psLineWidth(GLfloat value)
 {
   if(!gl2ps) return GL2PS_UNINITIALIZED;
 
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT) return GL2PS_SUCCESS;
+
   glPassThrough(GL2PS_LINE_WIDTH_TOKEN);
   glPassThrough(value);
 
@@ -5952,6 +7115,12 @@ GL2PSDLL_API GLint gl2psBlendFunc(GLenum sfactor, GLenum dfactor)
   if(GL_FALSE == gl2psSupportedBlendMode(sfactor, dfactor))
     return GL2PS_WARNING;
 
+  if(gl2ps->options & GL2PS_NO_OPENGL_CONTEXT){
+    gl2ps->blendfunc[0] = sfactor;
+    gl2ps->blendfunc[1] = dfactor;
+    return GL2PS_SUCCESS;
+  }
+
   glPassThrough(GL2PS_SRC_BLEND_TOKEN);
   glPassThrough((GLfloat)sfactor);
   glPassThrough(GL2PS_DST_BLEND_TOKEN);
@@ -5960,6 +7129,62 @@ GL2PSDLL_API GLint gl2psBlendFunc(GLenum sfactor, GLenum dfactor)
   return GL2PS_SUCCESS;
 }
 
+GL2PSDLL_API GLint gl2psSetBackgroundColor(GLfloat r, GLfloat g, GLfloat b)
+{
+  if(!gl2ps) return GL2PS_UNINITIALIZED;
+
+  /* only needed with GL2PS_NO_OPENGL_CONTEXT, since the background
+     is otherwise taken from the OpenGL clear color */
+  gl2ps->bgcolor[0] = r;
+  gl2ps->bgcolor[1] = g;
+  gl2ps->bgcolor[2] = b;
+  gl2ps->bgcolor[3] = 1.0F;
+
+  return GL2PS_SUCCESS;
+}
+
+/* Number of threads used to build the BSP tree. This applies to all
+   following pages, in all threads; 0 means one per processor */
+
+GL2PSDLL_API GLint gl2psSetThreads(GLint nthreads)
+{
+  if(nthreads < 0) return GL2PS_ERROR;
+
+  gl2psnthreads = nthreads;
+
+  return GL2PS_SUCCESS;
+}
+
+/* Sampled BSP root selection, used with GL2PS_BEST_ROOT: at each node
+   'candidates' planes are each tested against 'samples' primitives.
+   With samples = 0, the first 'candidates' primitives are tested
+   against all the others (the default, with 10 candidates) */
+
+GL2PSDLL_API GLint gl2psSetBspRoot(GLint candidates, GLint samples)
+{
+  if(!gl2ps) return GL2PS_UNINITIALIZED;
+
+  if(candidates < 1 || samples < 0) return GL2PS_ERROR;
+
+  gl2ps->maxbestroot = candidates;
+  gl2ps->bspsamples = (samples > GL2PS_BSP_MAX_SAMPLES) ? GL2PS_BSP_MAX_SAMPLES : samples;
+
+  return GL2PS_SUCCESS;
+}
+
+/* Number of nodes, depth and number of split primitives of the BSP
+   trees built for the last page finished by this thread (for all its
+   viewports) */
+
+GL2PSDLL_API GLint gl2psGetBspStats(GLint *nodes, GLint *depth, GLint *splits)
+{
+  if(nodes) *nodes = gl2psbspnodes;
+  if(depth) *depth = gl2psbspdepth;
+  if(splits) *splits = gl2psbspsplits;
+
+  return GL2PS_SUCCESS;
+}
+
 GL2PSDLL_API GLint gl2psSetOptions(GLint options)
 {
   if(!gl2ps) return GL2PS_UNINITIALIZED;
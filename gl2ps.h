@@ -74,6 +74,12 @@
 #  endif
 #endif
 
+/* Support for building the BSP tree with several threads */
+
+#if defined(HAVE_PTHREAD) || defined(HAVE_LIBPTHREAD)
+#  define GL2PS_HAVE_PTHREAD
+#endif
+
 /* Version number */
 
 #define GL2PS_MAJOR_VERSION 1
@@ -128,6 +134,7 @@
 #define GL2PS_COMPRESS             (1<<10)
 #define GL2PS_NO_BLENDING          (1<<11)
 #define GL2PS_TIGHT_BOUNDING_BOX   (1<<12)
+#define GL2PS_NO_OPENGL_CONTEXT    (1<<13)
 
 /* Arguments for gl2psEnable/gl2psDisable */
 
@@ -152,7 +159,21 @@
 #define GL2PS_TEXT_TL 8
 #define GL2PS_TEXT_TR 9
 
+/* Primitive types for gl2psAddPolyPrimitive */
+
+#define GL2PS_POINT    2
+#define GL2PS_LINE     3
+#define GL2PS_TRIANGLE 5
+
 typedef GLfloat GL2PSrgba[4];
+typedef GLfloat GL2PSxyz[3];
+
+typedef struct {
+  GL2PSxyz xyz;
+  GL2PSrgba rgba;
+} GL2PSvertex;
+
+typedef struct _GL2PScontext GL2PScontext;
 
 #if defined(__cplusplus)
 extern "C" {
@@ -165,7 +186,19 @@ GL2PSDLL_API GLint gl2psBeginPage(const char *title, const char *producer,
                                   GLint nr, GLint ng, GLint nb, GLint buffersize,
                                   FILE *stream, const char *filename);
 GL2PSDLL_API GLint gl2psEndPage(void);
+GL2PSDLL_API GL2PScontext *gl2psBeginPageCtx(const char *title, const char *producer, 
+                                             GLint viewport[4], GLint format, GLint sort,
+                                             GLint options, GLint colormode,
+                                             GLint colorsize, GL2PSrgba *colormap, 
+                                             GLint nr, GLint ng, GLint nb, GLint buffersize,
+                                             FILE *stream, const char *filename);
+GL2PSDLL_API GLint gl2psEndPageCtx(GL2PScontext *context);
+GL2PSDLL_API GLint gl2psSetContext(GL2PScontext *context);
+GL2PSDLL_API GL2PScontext *gl2psGetContext(void);
 GL2PSDLL_API GLint gl2psSetOptions(GLint options);
+GL2PSDLL_API GLint gl2psSetThreads(GLint nthreads);
+GL2PSDLL_API GLint gl2psSetBspRoot(GLint candidates, GLint samples);
+GL2PSDLL_API GLint gl2psGetBspStats(GLint *nodes, GLint *depth, GLint *splits);
 GL2PSDLL_API GLint gl2psBeginViewport(GLint viewport[4]);
 GL2PSDLL_API GLint gl2psEndViewport(void);
 GL2PSDLL_API GLint gl2psText(const char *str, const char *fontname, 
@@ -182,6 +215,14 @@ GL2PSDLL_API GLint gl2psPointSize(GLfloat value);
 GL2PSDLL_API GLint gl2psLineWidth(GLfloat value);
 GL2PSDLL_API GLint gl2psBlendFunc(GLenum sfactor, GLenum dfactor);
 
+/* Direct primitive input, e.g. with GL2PS_NO_OPENGL_CONTEXT (vertices
+   in window coordinates, depth between 0 and 1) */
+GL2PSDLL_API GLint gl2psAddPolyPrimitive(GLshort type, GLshort numverts, 
+                                         GL2PSvertex *verts, GLint offset, 
+                                         GLushort pattern, GLint factor,
+                                         GLfloat width, char boundary);
+GL2PSDLL_API GLint gl2psSetBackgroundColor(GLfloat r, GLfloat g, GLfloat b);
+
 /* undocumented */
 GL2PSDLL_API GLint gl2psDrawImageMap(GLsizei width, GLsizei height,
                                      const GLfloat position[3],
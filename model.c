@@ -29,7 +29,7 @@
 #include <stdlib.h>
 
 /* Parse next line routine */
-int parse_nextline(FILE *fp, char* buffer, int maxbuffer, int first);
+int parse_nextline(FILE *fp, char* buffer, int maxbuffer, int *nlines);
 
 #define MAX_LINE_LEN 512
 #define DELIMS " ,"
@@ -57,10 +57,10 @@ char *next_str(char *s, char *delim)
 
 #define MAX_ARGS 10
 
-/* Like strtok, this modifies its arguments (only a little nasty) */
-char **split_args(char *s, char *delims, int *nargs)
+/* Like strtok, this modifies its arguments (only a little nasty).
+   Pointers to the arguments go in args, which has room for MAX_ARGS */
+char **split_args(char *s, char *delims, char **args, int *nargs)
 {
-  static char* args[MAX_ARGS];
   int i, j, n, found;
 
   n = strlen(delims);
@@ -201,8 +201,8 @@ int model_load(TModel *model, char *filename)
   int n;
   
   char buffer[MAX_LINE_LEN];
-  int linenr;
-  char **args;
+  int linenr, nlines;
+  char *argbuf[MAX_ARGS], **args;
   int nargs;
 
   enum NUM_OP op;
@@ -227,7 +227,8 @@ int model_load(TModel *model, char *filename)
   
   model->nitems = 0;
   
-  linenr = parse_nextline(fp, buffer, MAX_LINE_LEN-1, 1);
+  nlines = 0;
+  linenr = parse_nextline(fp, buffer, MAX_LINE_LEN-1, &nlines);
   if(linenr == -1) {
     return 1;
   }
@@ -240,7 +241,7 @@ int model_load(TModel *model, char *filename)
     }
     
     /* Split the arguments */
-    args = split_args(buffer, DELIMS, &nargs);
+    args = split_args(buffer, DELIMS, argbuf, &nargs);
 
     /* buffer now contains the first word and args[1...] the arguments */
     n = strlen(buffer);
@@ -414,7 +415,7 @@ int model_load(TModel *model, char *filename)
       fprintf(stderr, "Line %d: Unknown command '%s'\n", linenr, buffer);
     }
     }
-  }while((linenr = parse_nextline(fp, buffer, MAX_LINE_LEN-1, 0)) != -1);
+  }while((linenr = parse_nextline(fp, buffer, MAX_LINE_LEN-1, &nlines)) != -1);
 
   /* Close the file */
   fclose(fp);
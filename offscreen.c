@@ -0,0 +1,146 @@
+/*************************************************************************************
+ * offscreen.c: Create an OpenGL context without a window or display
+ *
+ * Uses a surfaceless EGL context (Mesa) with a framebuffer object
+ * as the render target, so batch jobs can run on machines without
+ * an X server and never need to initialise GLUT.
+ *
+ * Copyright (c) 2009 B.Dudson, University of York <bd512@york.ac.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ *************************************************************************************/
+
+/* Needed for the framebuffer object functions */
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+
+#include "offscreen.h"
+
+#ifdef HAVE_LIBEGL
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+static EGLContext egl_context = EGL_NO_CONTEXT;
+static GLuint framebuffer = 0, renderbuffer[2];
+
+/* Create a context and make it current, with a width x height
+   framebuffer to draw into. Returns 0 on success */
+int offscreen_init(int width, int height)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+  EGLint major, minor;
+  GLenum status;
+
+  /* Surfaceless platform needs no display server at all */
+  get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+    eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if(get_platform_display != NULL)
+    egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+				       EGL_DEFAULT_DISPLAY, NULL);
+  if(egl_display == EGL_NO_DISPLAY)
+    egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  if((egl_display == EGL_NO_DISPLAY) || !eglInitialize(egl_display, &major, &minor)) {
+    fprintf(stderr, "Error: Couldn't initialise EGL display\n");
+    return 1;
+  }
+
+  /* Need desktop OpenGL for feedback mode */
+  if(!eglBindAPI(EGL_OPENGL_API)) {
+    fprintf(stderr, "Error: EGL doesn't support desktop OpenGL\n");
+    offscreen_free();
+    return 1;
+  }
+
+  egl_context = eglCreateContext(egl_display, (EGLConfig) 0, EGL_NO_CONTEXT, NULL);
+  if(egl_context == EGL_NO_CONTEXT) {
+    fprintf(stderr, "Error: Couldn't create EGL context (0x%x)\n", eglGetError());
+    offscreen_free();
+    return 1;
+  }
+
+  if(!eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context)) {
+    fprintf(stderr, "Error: Surfaceless EGL contexts not supported\n");
+    offscreen_free();
+    return 1;
+  }
+
+  /* Without a surface there's no default framebuffer, so create one */
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glGenRenderbuffers(2, renderbuffer);
+
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			    GL_RENDERBUFFER, renderbuffer[0]);
+
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+			    GL_RENDERBUFFER, renderbuffer[1]);
+
+  status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if(status != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "Error: Incomplete offscreen framebuffer (0x%x)\n", status);
+    offscreen_free();
+    return 1;
+  }
+
+  return 0;
+}
+
+void offscreen_free()
+{
+  if(framebuffer != 0) {
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(2, renderbuffer);
+    glDeleteFramebuffers(1, &framebuffer);
+    framebuffer = 0;
+  }
+
+  if(egl_display == EGL_NO_DISPLAY)
+    return;
+
+  eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if(egl_context != EGL_NO_CONTEXT)
+    eglDestroyContext(egl_display, egl_context);
+  eglTerminate(egl_display);
+
+  egl_context = EGL_NO_CONTEXT;
+  egl_display = EGL_NO_DISPLAY;
+}
+
+#else /* HAVE_LIBEGL */
+
+int offscreen_init(int width, int height)
+{
+  fprintf(stderr, "Error: Compiled without EGL, so offscreen rendering is not available\n");
+  return 1;
+}
+
+void offscreen_free()
+{
+}
+
+#endif /* HAVE_LIBEGL */
@@ -0,0 +1,11 @@
+/*****************************************************************
+ * Offscreen OpenGL context for rendering without a window
+ *****************************************************************/
+
+#ifndef __OFFSCREEN_H__
+#define __OFFSCREEN_H__
+
+int offscreen_init(int width, int height);
+void offscreen_free();
+
+#endif /* __OFFSCREEN_H__ */
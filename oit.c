@@ -0,0 +1,298 @@
+/*************************************************************************************
+ * oit.c: Weighted blended order-independent transparency
+ *
+ * An approximation to blending transparent surfaces in the right order
+ * which needs no sorting (McGuire & Bavoil, JCGT 2013). Each transparent
+ * fragment adds its color, weighted by its alpha and distance, to one
+ * render target and its weight to another, while the product of
+ * (1 - alpha) gives the fraction of the background still showing. A
+ * final pass divides out the weights and blends the result over the
+ * opaque surfaces. The cost doesn't depend on how many surfaces overlap.
+ *
+ * Needs OpenGL 3.0 (framebuffer objects, float render targets, GLSL 1.30)
+ *
+ * Copyright (c) 2009 B.Dudson, University of York <bd512@york.ac.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ *************************************************************************************/
+
+/* Needed for the framebuffer and shader functions */
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "oit.h"
+#include "shader.h"
+
+/* Transparent surfaces: color weighted by alpha and view distance.
+   The weight is equation 7 of McGuire & Bavoil, for a scene a few
+   units across */
+static const char *accum_vs =
+  "#version 130\n"
+  "out float depth;\n"
+  "void main() {\n"
+  "  gl_FrontColor = gl_Color;\n"
+  "  depth = -(gl_ModelViewMatrix * gl_Vertex).z;\n"
+  "  gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;\n"
+  "}\n";
+
+static const char *accum_fs =
+  "#version 130\n"
+  "in float depth;\n"
+  "void main() {\n"
+  "  vec4 c = gl_Color;\n"
+  "  float w = c.a * clamp(10.0 / (1.0e-5 + pow(depth/5.0, 2.0) + pow(depth/200.0, 6.0)),\n"
+  "                        1.0e-2, 3.0e3);\n"
+  "  gl_FragData[0] = vec4(c.rgb * w, c.a);\n"
+  "  gl_FragData[1] = vec4(w);\n"
+  "}\n";
+
+/* Full-window pass putting the average color over the opaque surfaces */
+static const char *composite_vs =
+  "#version 130\n"
+  "void main() {\n"
+  "  gl_Position = gl_Vertex;\n"
+  "}\n";
+
+static const char *composite_fs =
+  "#version 130\n"
+  "uniform sampler2D accum;\n"
+  "uniform sampler2D weight;\n"
+  "void main() {\n"
+  "  ivec2 p = ivec2(gl_FragCoord.xy);\n"
+  "  vec4 a = texelFetch(accum, p, 0);\n"
+  "  float w = texelFetch(weight, p, 0).r;\n"
+  "  if(a.a >= 1.0)\n"
+  "    discard;\n"
+  "  gl_FragColor = vec4(a.rgb / max(w, 1.0e-5), 1.0 - a.a);\n"
+  "}\n";
+
+static int oit_state = 0; /* 0 = not set up yet, 1 = ready, -1 = not supported */
+static GLuint accum_prog, composite_prog;
+
+static GLuint framebuffer = 0;
+static GLuint renderbuffer[2]; /* Opaque color and depth */
+static GLuint texture[2];      /* Accumulated color and revealage, and weight */
+static int fb_width = 0, fb_height = 0;
+
+/************* Set up **************/
+
+/* Compile the shaders. Returns 0 on success */
+static int oit_setup()
+{
+  const char *version;
+
+  if(!shader_supported(3, 0, NULL)) {
+    version = (const char*) glGetString(GL_VERSION);
+    fprintf(stderr, "Weighted transparency needs OpenGL 3.0 (have %s)\n",
+	    version ? version : "none");
+    return 1;
+  }
+
+  accum_prog = shader_program(accum_vs, accum_fs);
+  composite_prog = shader_program(composite_vs, composite_fs);
+  if((accum_prog == 0) || (composite_prog == 0)) {
+    if(accum_prog != 0) glDeleteProgram(accum_prog);
+    if(composite_prog != 0) glDeleteProgram(composite_prog);
+    accum_prog = composite_prog = 0;
+    return 1;
+  }
+
+  glUseProgram(composite_prog);
+  glUniform1i(glGetUniformLocation(composite_prog, "accum"), 0);
+  glUniform1i(glGetUniformLocation(composite_prog, "weight"), 1);
+  glUseProgram(0);
+
+  return 0;
+}
+
+static void free_targets()
+{
+  if(framebuffer == 0)
+    return;
+  glDeleteRenderbuffers(2, renderbuffer);
+  glDeleteTextures(2, texture);
+  glDeleteFramebuffers(1, &framebuffer);
+  framebuffer = 0;
+  fb_width = fb_height = 0;
+}
+
+static void target_texture(GLuint tex, GLint format, GLenum layout, int width, int height)
+{
+  glBindTexture(GL_TEXTURE_2D, tex);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, layout, GL_FLOAT, NULL);
+}
+
+/* Make render targets of the given size. Returns 0 on success */
+static int make_targets(int width, int height)
+{
+  GLenum status;
+
+  if((framebuffer != 0) && (width == fb_width) && (height == fb_height))
+    return 0;
+  free_targets();
+
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+  glGenRenderbuffers(2, renderbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			    GL_RENDERBUFFER, renderbuffer[0]);
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+			    GL_RENDERBUFFER, renderbuffer[1]);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenTextures(2, texture);
+  target_texture(texture[0], GL_RGBA16F, GL_RGBA, width, height);
+  target_texture(texture[1], GL_R16F, GL_RED, width, height);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, texture[0], 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, texture[1], 0);
+
+  status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if(status != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "Error: Incomplete transparency framebuffer (0x%x)\n", status);
+    free_targets();
+    return 1;
+  }
+
+  fb_width = width;
+  fb_height = height;
+  return 0;
+}
+
+/************* Drawing **************/
+
+/* Draw the model with weighted blending of the transparent items, into
+   the framebuffer currently bound for drawing. Returns non-zero if
+   this isn't possible (including into the feedback buffer), in which
+   case nothing is drawn */
+int oit_draw(TGeometry *geom, TCamera *cam, int width, int height, float maxerr)
+{
+  static const GLfloat quad[8] = {-1.0, -1.0,  1.0, -1.0,  1.0, 1.0,  -1.0, 1.0};
+  static const GLenum accum_buffers[2] = {GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2};
+  GLint rendermode, target, src, dst;
+  GLfloat clear[4];
+  GLboolean blend, depthtest;
+
+  glGetIntegerv(GL_RENDER_MODE, &rendermode);
+  if((rendermode != GL_RENDER) || (width <= 0) || (height <= 0))
+    return 1;
+
+  if(oit_state == 0)
+    oit_state = oit_setup() ? -1 : 1;
+  if(oit_state < 0)
+    return 1;
+
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+  if(make_targets(width, height)) {
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    return 1;
+  }
+
+  blend = glIsEnabled(GL_BLEND);
+  depthtest = glIsEnabled(GL_DEPTH_TEST);
+  glGetIntegerv(GL_BLEND_SRC_RGB, &src);
+  glGetIntegerv(GL_BLEND_DST_RGB, &dst);
+  glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+  /* Opaque items, as usual */
+  glDrawBuffer(GL_COLOR_ATTACHMENT0);
+  glDisable(GL_BLEND);
+  glEnable(GL_DEPTH_TEST);
+  glDepthMask(GL_TRUE);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  geom_draw_items(geom, cam, height, maxerr, GEOM_OPAQUE);
+
+  /* Transparent items, in any order. Color sums go in RGB, and the
+     fraction of background showing in alpha */
+  glDrawBuffers(2, accum_buffers);
+  glClearColor(0.0, 0.0, 0.0, 1.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glDepthMask(GL_FALSE);
+  glEnable(GL_BLEND);
+  glBlendFuncSeparate(GL_ONE, GL_ONE, GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+  glUseProgram(accum_prog);
+  geom_draw_items(geom, cam, height, maxerr, GEOM_BLEND);
+
+  /* Average them and put the result over the opaque items */
+  glDrawBuffer(GL_COLOR_ATTACHMENT0);
+  glDisable(GL_DEPTH_TEST);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glUseProgram(composite_prog);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, texture[1]);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, texture[0]);
+
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glVertexPointer(2, GL_FLOAT, 0, quad);
+  glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+  glDisableClientState(GL_VERTEX_ARRAY);
+
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0);
+  glUseProgram(0);
+
+  /* Copy to where the caller was drawing */
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, target);
+  glBlitFramebuffer(0, 0, width, height, 0, 0, width, height,
+		    GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, target);
+
+  /* Put back the state */
+  glDepthMask(GL_TRUE);
+  if(depthtest)
+    glEnable(GL_DEPTH_TEST);
+  if(!blend)
+    glDisable(GL_BLEND);
+  glBlendFunc(src, dst);
+  glClearColor(clear[0], clear[1], clear[2], clear[3]);
+
+  return 0;
+}
+
+/* Release render targets and shaders. Needs the OpenGL context */
+void oit_free()
+{
+  free_targets();
+  if(oit_state > 0) {
+    glDeleteProgram(accum_prog);
+    glDeleteProgram(composite_prog);
+  }
+  accum_prog = composite_prog = 0;
+  oit_state = 0;
+}
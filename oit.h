@@ -0,0 +1,14 @@
+/*****************************************************************
+ * Weighted blended order-independent transparency
+ *****************************************************************/
+
+#ifndef __OIT_H__
+#define __OIT_H__
+
+#include "geometry.h"
+#include "tokamak_draw.h"
+
+int oit_draw(TGeometry *geom, TCamera *cam, int width, int height, float maxerr);
+void oit_free();
+
+#endif /* __OIT_H__ */
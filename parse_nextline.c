@@ -32,21 +32,19 @@
 #include <string.h>
 #include <ctype.h>
 
-/* Returns the next useful line from a file */
-int parse_nextline(FILE *fp, char* buffer, int maxbuffer, int first)
+/* Returns the next useful line from a file. nlines counts the lines read
+   so far, and should be zero for the first call. Returns the line number,
+   or -1 at the end of the file */
+int parse_nextline(FILE *fp, char* buffer, int maxbuffer, int *nlines)
 {
   int i, n, started, p, space, quote;
-  static int linenr = 0;
-  
-  if(first)
-    linenr = 0;
 
   do{
     buffer[0] = 0;
     /* Get a line from the file */
     fgets(buffer, maxbuffer-1, fp);
     buffer[maxbuffer-1] = 0; /* ensure always have terminating zero */
-    linenr++;
+    (*nlines)++;
     
     n = strlen(buffer);
     /* strip out comments and leading whitespace.
@@ -110,5 +108,5 @@ int parse_nextline(FILE *fp, char* buffer, int maxbuffer, int first)
   if(n == 0) {
     return(-1);
   }
-  return(linenr);
+  return(*nlines);
 }
@@ -0,0 +1,105 @@
+/*************************************************************************************
+ * shader.c: Compiling GLSL programs
+ *
+ * Copyright (c) 2009 B.Dudson, University of York <bd512@york.ac.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ *************************************************************************************/
+
+/* Needed for the shader functions */
+#define GL_GLEXT_PROTOTYPES
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "shader.h"
+
+static GLuint compile_shader(GLenum type, const char *src)
+{
+  GLuint shader;
+  GLint ok;
+  char log[1024];
+
+  shader = glCreateShader(type);
+  glShaderSource(shader, 1, &src, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if(!ok) {
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "Error: Couldn't compile shader\n%s\n", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+/* Compile and link a program from vertex and fragment shader source.
+   Returns 0 on failure, after printing the log */
+GLuint shader_program(const char *vs_src, const char *fs_src)
+{
+  GLuint vs, fs, prog;
+  GLint ok;
+  char log[1024];
+
+  vs = compile_shader(GL_VERTEX_SHADER, vs_src);
+  fs = compile_shader(GL_FRAGMENT_SHADER, fs_src);
+  if((vs == 0) || (fs == 0)) {
+    if(vs != 0) glDeleteShader(vs);
+    if(fs != 0) glDeleteShader(fs);
+    return 0;
+  }
+
+  prog = glCreateProgram();
+  glAttachShader(prog, vs);
+  glAttachShader(prog, fs);
+  glLinkProgram(prog);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+
+  glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+  if(!ok) {
+    glGetProgramInfoLog(prog, sizeof(log), NULL, log);
+    fprintf(stderr, "Error: Couldn't link shaders\n%s\n", log);
+    glDeleteProgram(prog);
+    return 0;
+  }
+  return prog;
+}
+
+/* Whether the OpenGL version is at least major.minor, and the named
+   extension (if not NULL) is supported. Needs a current context */
+int shader_supported(int major, int minor, const char *extension)
+{
+  const char *version, *list;
+  int maj, min;
+
+  version = (const char*) glGetString(GL_VERSION);
+  if((version == NULL) || (sscanf(version, "%d.%d", &maj, &min) != 2))
+    return 0;
+  if((maj < major) || ((maj == major) && (min < minor)))
+    return 0;
+  if(extension == NULL)
+    return 1;
+  list = (const char*) glGetString(GL_EXTENSIONS);
+  return (list != NULL) && (strstr(list, extension) != NULL);
+}
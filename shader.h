@@ -0,0 +1,13 @@
+/*****************************************************************
+ * Compiling GLSL programs
+ *****************************************************************/
+
+#ifndef __SHADER_H__
+#define __SHADER_H__
+
+#include <GL/gl.h>
+
+GLuint shader_program(const char *vs_src, const char *fs_src);
+int shader_supported(int major, int minor, const char *extension);
+
+#endif /* __SHADER_H__ */
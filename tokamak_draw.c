@@ -38,6 +38,9 @@
  *             
  ********************************************************/
 
+/* Needed for the sync object functions */
+#define GL_GLEXT_PROTOTYPES
+
 #include <GL/glut.h>
 
 #include <stdio.h>
@@ -45,12 +48,30 @@
 #include <math.h>
 #include <ctype.h>
 #include <string.h>
+#include <sys/time.h>
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
 
 #include "gl2ps.h"
 
 #include "model.h"
+#include "geometry.h"
+#include "offscreen.h"
+#include "vector.h"
+#include "oit.h"
+#include "shader.h"
+#include "frames.h"
 #include "tokamak_draw.h"
 
+/* Most views saved by one batch run */
+#define MAX_VIEWS 64
+
+/* Error (pixels) allowed in the viewer when choosing levels of detail */
+#define VIEW_LOD_ERROR 0.5
+
 /*********** GLOBALS *****************/
 
 TCamera *dispview;
@@ -60,10 +81,25 @@ TColor planecolor, linecolor;
 
 TModel drawmodel; /* The model being used */
 char modelfile[256]; /* Filename for the model */
+TGeometry drawgeom; /* Cached geometry for drawmodel */
+
+int vector_direct = 1; /* Vector output straight from drawgeom, not the feedback buffer */
+int bsp_candidates = 0, bsp_samples = 0; /* Sampled BSP root selection. 0 = first primitive */
+int sort_threads = 0; /* Threads for building and sorting (--threads). 0 = one per processor */
+int compress_output = 0; /* Gzip PS, EPS and SVG files, deflate PDF streams (needs zlib) */
+float view_lod = VIEW_LOD_ERROR; /* Pixel error for levels of detail on screen. 0 = full detail */
+float export_lod = 0.0; /* and when saving to file */
+int blending = 0; /* Transparency on: draw transparent surfaces back to front */
+int blend_weighted = 0; /* or approximate with weighted blending, which needs no sorting */
+int redraw_pending = 0; /* A redraw has been asked for since the last frame */
 
 /*********** PROTOTYPES ****************/
 
 TCamera *create_camera();
+void camera_position(TCamera *cam);
+void update_camera_position();
+void apply_camera();
+void request_redraw();
 void redraw_camera();
 void set_camera_pos(double R, double theta, double phi);
 void move_camera(double dR, double dtheta, double dphi);
@@ -73,20 +109,21 @@ void move_camera_focus(double up, double left);
 void keyboard (unsigned char key, int x, int y);
 void specialkey (int key, int x, int y);
 void reshape(int w, int h);
-
-float qromb(float (*func)(float, void*), float a, float b, void *params);
-float trapzd(float (*func)(float, void*), float a, float b, int n, void *p);
-void polint(float *xa, float *ya, float x, float *y, float *dy);
+void set_projection(int w, int h);
+
+void draw_scene(float maxerr);
+int export_options(int background);
+int export_direct(TCamera *cam, char *file, int format, int background, int transparency);
+int export_view(char *file, int format, int background, int transparency);
+int export_views(TCamera *views, int nviews, int njobs, char *outfile,
+		 int format, int background, int transparency);
+void camera_path(TCamera *views, int nviews, double t, TCamera *cam);
+int render_frames(TCamera *views, int nviews, int nframes, int njobs,
+		  char *outfile, char *command);
+int batch_render(int argc, char **argv);
 
 /** Drawing functions **/
 
-void draw_planes(int n, float major, float minor, TColor *color);
-
-/* Draw a m/n fieldline on a shaped flux-surface with elongation e and triangularity k */
-void draw_shapeline(float R, float a, float e, float k, int m, int n, int N, TColor *color, float theta0);
-
-void solid_surface(float R, float a, float e, float k, int N, TColor *color, float phi0, float phi1);
-void draw_shapesurf(float R, float a, float e, float k, int m, int n, TColor *color, int N);
 void draw_line(float q, float major, float minor,
 	       float *theta, float *phi,
 	       int N,
@@ -97,159 +134,6 @@ void draw_surface(int n, int m, float major, float minor, int M, float mode);
 
 /************* CODE **************/
 
-void draw_planes(int n, float major, float minor, TColor *color)
-{
-  int i;
-  float z, dz;
-  float r1, r2, x1, y1, x2, y2;
-
-  dz = 2.0*PI / ((float) n);
-  
-  r1 = major - minor;
-  r2 = major + minor;
-
-  for(z=0.0,i=0;i<n;i++) {
-
-    x1 = r1 * cos(z);
-    y1 = r1 * sin(z);
-    x2 = r2 * cos(z);
-    y2 = r2 * sin(z);
-
-    glBegin(GL_QUADS);
-    glColor4f(color->r, color->g, color->b, color->alpha);
-    glVertex3f(x1, -1.0*minor, y1);
-    glVertex3f(x1, minor, y1);
-    glVertex3f(x2, minor, y2);
-    glVertex3f(x2, -1.0*minor, y2);
-    glEnd();
-    
-    z += dz;
-  }
-}
-
-float shapefunc(float theta, void *data)
-{
-  float *vals;
-  float R, a, b;
-  float ct;
-
-  vals = (float*) data;
-  R = vals[0];
-  a = vals[1];
-  b = vals[2];
-
-  ct = cos(theta);
-  return(1.0 / (a*ct - b*ct*ct + R) );
-}
-
-/* Draw a m/n fieldline on a shaped flux-surface with elongation e and triangularity k */
-void draw_shapeline(float R, float a, float e, float k, int m, int n, int N, TColor *color, float theta0)
-{
-  int i, j;
-  float dphi, phi;
-  float theta;
-  float b;
-  float r, z, x, y;
-  float ct;
-  float alpha;
-  float vals[3];
-
-  b = a*( 2.0/(2.0 + k) - 1.0 );
-
-  vals[0] = R;
-  vals[1] = a;
-  vals[2] = b;
-  alpha = qromb(shapefunc, 0.0, 2.0*PI, (void*) vals);
-
-  alpha = (((float) n) / ((float) m)) * 2.0*PI / alpha;
-
-  phi = theta0;
-  theta = 0.0;
-  dphi = 2.0*PI / ((float) N);
-
-  glBegin(GL_LINE_STRIP);
-  glColor4f(color->r, color->g, color->b, 1.0);
-  for(j=0;j<n;j++) {
-    for(i=0;i<=N;i++) {
-      /* Work out coordinates */
-      ct = cos(theta);
-      r = a*ct - b*ct*ct + R;
-      x = r*cos(phi);
-      y = r*sin(phi);
-      z = a*(1.0 + e)*sin(theta);
-      
-      //printf("%d: (%f, %f), %f, (%f,%f,%f)\n", i, phi, theta, r, x, y, z);
-      
-      glVertex3f(x, z, y);
-      
-      /* Work out new theta */
-      //printf("%d: %f, %f, %f -> %f, %f\n", i, b, alpha, r, dphi, r*dphi*alpha);
-      phi += dphi;
-      theta -= r*dphi/alpha;
-    }
-  }
-
-  glEnd();
-}
-
-void solid_surface(float R, float a, float e, float k, int N, TColor *color, float phi0, float phi1)
-{
-  int i, j;
-  float dphi, phi;
-  float theta, dtheta;
-  float b;
-  float r1, z1, r2, z2;
-  float ct;
-
-  b = a*( 2.0/(2.0 + k) - 1.0 );
-
-  theta = 0.0;
-  dphi = (phi1 - phi0) / ((float) N);
-  dtheta = 2.0*PI / ((float) N);
-
-  ct = cos(theta);
-  r2 = a*ct - b*ct*ct + R;
-  z2 = a*(1.0 + e)*sin(theta);
-  for(i=0;i<N;i++) {
-    r1 = r2;
-    z1 = z2;
-
-    /* Work out coordinates */
-    theta += dtheta;
-    ct = cos(theta);
-    r2 = a*ct - b*ct*ct + R;
-    z2 = a*(1.0 + e)*sin(theta);
-
-    //printf("(%f, %f) -> (%f, %f)\n", r1, z1, r2, z2);
-    
-    glBegin(GL_QUAD_STRIP);
-    glColor4f(color->r, color->g, color->b, color->alpha);
-    phi = 0.0;
-    for(j=0;j<=N;j++) {
-      glVertex3f(r1*cos(phi), z1, r1*sin(phi));
-      glVertex3f(r2*cos(phi), z2, r2*sin(phi));
-      phi += dphi;
-    }
-    glEnd();
-    //return;
-  }
-  
-}
-
-void draw_shapesurf(float R, float a, float e, float k, int m, int n, TColor *color, int N)
-{
-  float dtheta, theta0;
-  int i;
-
-  dtheta = 2.0*PI / ((float) N);
-  theta0 = 0.0;
-  for(i=0;i<N;i++) {
-    draw_shapeline(R, a, e, k, m, n, 100, color, theta0);
-    theta0 += dtheta;
-  }
-}
-
-
 /* Draw a field-line, starting at toroidal angle theta0, poloidal phi0
    with pitch q and minor radius r using N segments */
 void draw_line(float q, float major, float minor,
@@ -318,52 +202,59 @@ void draw_surface(int n, int m, float major, float minor, int M, float mode)
 /************************* MAIN DRAWING ROUTINE ******************
  *
  * Define models as combination of surfaces and field-lines
- * NOTE: Currently no depth-sorting of transparent surfaces, so
- * won't look quite right.
+ * With transparency on, the triangles of transparent surfaces are
+ * sorted by distance from the camera and drawn after everything else
  *****************************************************************/
 
-void display()
+/* Draw the model into the current buffer, with each item within maxerr
+   pixels of full detail */
+void draw_scene(float maxerr)
 {
-  int i;
-  TModelItem *item;
-
   glPushMatrix();
 
   //glClearDepth(0.0);
   glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
-  /* Draw something here */
+  /* Draw the cached model geometry */
 
-  for(i=0;i<drawmodel.nitems;i++) {
-    item = &drawmodel.item[i];
-    switch(item->type) {
-    case DRAW_LINE: {
-      draw_shapesurf(item->major_radius, item->minor_radius,
-		     item->elongation, item->triangularity, 
-		     item->m, item->n, &item->color, item->number);
-      break;
-    };
-    case DRAW_SOLID: {
-      solid_surface( item->major_radius, item->minor_radius, 
-		     item->elongation, item->triangularity,
-		     item->number, &item->color, item->phi0, item->phi1);
-      break;
-    }
-    case DRAW_PLANES: {
-      draw_planes(item->number, item->major_radius, item->minor_radius, &item->color);
-      break;
-    }
-    default: {
-      fprintf(stderr,"ERROR: Unknown model item type. Ignoring\n");
-    }
-    };
-  }
+  if(!blending)
+    geom_draw(&drawgeom, dispview, win_height, maxerr);
+  else if(!blend_weighted || oit_draw(&drawgeom, dispview, win_width, win_height, maxerr))
+    geom_draw_blend(&drawgeom, dispview, win_height, maxerr);
   
   /* Finish drawing */
 
   glFlush();
   glPopMatrix();
+}
+
+/* Wait for the frame before this one to be finished, so that at most
+   one frame is queued up behind the input when drawing is slow */
+static void frame_throttle()
+{
+  static int state = 0; /* 0 = not set up yet, 1 = sync objects, -1 = not supported */
+  static GLsync fence = 0;
+
+  if(state == 0)
+    state = shader_supported(3, 2, NULL) ? 1 : -1;
+  if(state < 0) {
+    glFinish();
+    return;
+  }
+  if(fence != 0) {
+    while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 100000000) == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(fence);
+  }
+  fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void display()
+{
+  /* Everything changed since the last frame is drawn now */
+  redraw_pending = 0;
+  draw_scene(view_lod);
   glutSwapBuffers();
+  frame_throttle();
 }
 
 void init()
@@ -399,7 +290,13 @@ int main(int argc, char **argv)
 
   /* Clear the model */
   drawmodel.nitems = 0;
+  drawgeom.nitems = 0;
   
+  if((argc > 1) && (strcmp(argv[1], "--render") == 0)) {
+    /* Batch mode: render to file without opening a window */
+    return(batch_render(argc, argv));
+  }
+
   if(argc > 1) {
     if(strcasecmp(argv[1], "example") == 0) {
       // Generate the input file
@@ -414,6 +311,7 @@ int main(int argc, char **argv)
   if(model_load(&drawmodel, modelfile)) {
     fprintf(stderr, "Run '%s example' to generate an example input file 'example.def'\n", argv[0]);
   }
+  geom_build(&drawgeom, &drawmodel);
 
   glutInit (&argc, argv);
   glutInitDisplayMode (GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
@@ -432,23 +330,28 @@ int main(int argc, char **argv)
 
 
 void reshape(int w, int h)
+{
+  set_projection(w, h);
+  redraw_camera();
+}
+
+/* Set up viewport and perspective for a w x h window */
+void set_projection(int w, int h)
 {
   glViewport (0, 0, w, h);
   glMatrixMode ( GL_PROJECTION );
   glLoadIdentity();
   
   if (h == 0) {
-    gluPerspective (80, (float) w, 1.0, 1000.0 );
+    gluPerspective (CAMERA_FOV, (float) w, CAMERA_NEAR, CAMERA_FAR);
   }else {
-    gluPerspective (80, (float) w / (float) h, 1.0, 1000.0);
+    gluPerspective (CAMERA_FOV, (float) w / (float) h, CAMERA_NEAR, CAMERA_FAR);
   }
   glMatrixMode (GL_MODELVIEW);
   glLoadIdentity();
   
   win_width = w;
   win_height = h;
-
-  redraw_camera();
 }
 
 /**********************************************************************
@@ -471,32 +374,52 @@ TCamera *create_camera()
   return(camera);
 }
 
-void redraw_camera()
+/* Recalculate the cartesian location of a camera */
+void camera_position(TCamera *cam)
 {
-  double cx, cy, cz;
+  cam->cy = sin(cam->phi) * cam->R;
+  cam->cx = cos(cam->phi) * sin(cam->theta) * cam->R;
+  cam->cz = -1.0 * cos(cam->phi) * cos(cam->theta) * cam->R;
+}
 
-  /* Recalculate camera coordinates */
-  cy = sin(dispview->phi) * dispview->R;
-  cx = cos(dispview->phi) * sin(dispview->theta) * dispview->R;
-  cz = -1.0 * cos(dispview->phi) * cos(dispview->theta) * dispview->R;
+/* Recalculate the cartesian camera location */
+void update_camera_position()
+{
+  camera_position(dispview);
+}
 
-  /* Update record of camera location */
-  dispview->cx = cx;
-  dispview->cy = cy;
-  dispview->cz = cz;
+/* Load the modelview matrix for the current camera */
+void apply_camera()
+{
+  update_camera_position();
 
   glLoadIdentity();
 
-  gluLookAt(cx, cy, cz,
+  gluLookAt(dispview->cx, dispview->cy, dispview->cz,
 	    dispview->x, dispview->y, dispview->z,
 	    0.0, 1.0, 0.0); 
-  
-  glutPostRedisplay();
-  
+}
+
+/* Ask for the window to be drawn again. Everything asked for before
+   GLUT next gets to draw shares one frame, so a burst of key presses
+   only draws the final view */
+void request_redraw()
+{
+  if(!redraw_pending)
+    glutPostRedisplay();
+  redraw_pending = 1;
+}
+
+void redraw_camera()
+{
+  apply_camera();
+  request_redraw();
 }
 
 void set_camera_pos(double R, double theta, double phi)
 {
+  if((dispview->R == R) && (dispview->theta == theta) && (dispview->phi == phi))
+    return;
   dispview->R = R;
   dispview->theta = theta;
   dispview->phi = phi;
@@ -506,7 +429,7 @@ void set_camera_pos(double R, double theta, double phi)
 
 void move_camera(double dR, double dtheta, double dphi)
 {
-  double theta, phi;
+  double theta, phi, R;
 
   /* Change toroidal angle */
   theta = dispview->theta + dtheta;
@@ -514,27 +437,27 @@ void move_camera(double dR, double dtheta, double dphi)
     theta = 2.0*PI + theta;
   if(theta > 2.0*PI)
     theta = theta - 2.0*PI;
-  dispview->theta = theta;
 
   phi = dispview->phi + dphi;
   if(phi > PI/2.0 - 0.1)
     phi = PI/2.0 - 0.1;
   if(phi < -PI/2.0 + 0.1)
     phi = -PI/2.0 + 0.1;
-  dispview->phi = phi;
 
-  dispview->R += dR;
-  if(dispview->R < 1.5)
-    dispview->R = 1.5;
-  
+  R = dispview->R + dR;
+  if(R < 1.5)
+    R = 1.5;
   
-  redraw_camera();
+  /* Nothing to draw if already against a limit */
+  set_camera_pos(R, theta, phi);
 }
 
 
 /* Set the camera to focus on a given point */
 void set_camera_focus(double x, double y, double z)
 {
+  if((dispview->x == x) && (dispview->y == y) && (dispview->z == z))
+    return;
   dispview->x = x;
   dispview->y = y;
   dispview->z = z;
@@ -567,6 +490,599 @@ void move_camera_focus(double up, double left)
 }
 
 
+/**********************************************************************
+ * Output to file
+ * 
+ **********************************************************************/
+
+/* gl2ps options for exporting */
+int export_options(int background)
+{
+  int opt;
+
+  opt = GL2PS_OCCLUSION_CULL;
+  if(bsp_candidates > 0)
+    opt |= GL2PS_BEST_ROOT;
+  if(background)
+    opt |= GL2PS_DRAW_BACKGROUND;
+  if(vector_direct)
+    opt |= GL2PS_NO_OPENGL_CONTEXT;
+  if(compress_output)
+    opt |= GL2PS_COMPRESS;
+  return opt;
+}
+
+/* Project the cached geometry as seen from camera cam straight into
+   gl2ps, without OpenGL. Only uses its own gl2ps context, so views can
+   be exported from several threads at once. Returns 0 on success */
+int export_direct(TCamera *cam, char *file, int format, int background, int transparency)
+{
+  GL2PScontext *ctx;
+  GLint viewport[4];
+  FILE *fp;
+  int res;
+
+  viewport[0] = 0;
+  viewport[1] = 0;
+  viewport[2] = win_width;
+  viewport[3] = win_height;
+
+  if(!(fp = fopen(file, "wb"))) {
+    printf("Unable to open file %s for writing\n", file);
+    return 1;
+  }
+
+  ctx = gl2psBeginPageCtx(file, "pixie_draw", viewport, format, GL2PS_BSP_SORT,
+			  export_options(background) | GL2PS_NO_OPENGL_CONTEXT,
+			  GL_RGBA, 0, NULL, 8, 8, 8, 
+			  0, fp, file);
+  if(ctx == NULL) {
+    fclose(fp);
+    return 1;
+  }
+  if(background)
+    gl2psSetBackgroundColor(1.0, 1.0, 1.0);
+  if(transparency)
+    gl2psEnable(GL2PS_BLEND);
+  else
+    gl2psBlendFunc(GL_ONE, GL_ZERO); /* As OpenGL default, so opaque */
+  if(bsp_candidates > 0)
+    gl2psSetBspRoot(bsp_candidates, bsp_samples);
+
+  camera_position(cam);
+  vector_add_geometry(&drawgeom, cam, viewport, export_lod);
+
+  res = gl2psEndPageCtx(ctx);
+  fclose(fp);
+
+  return (res == GL2PS_SUCCESS) ? 0 : 1;
+}
+
+/* Print the current view to file using gl2ps. Returns 0 on success */
+int export_view(char *file, int format, int background, int transparency)
+{
+  int res, passes;
+  GLint viewport[4];
+  GLint buffersize;
+  GLint nodes, depth, splits;
+  FILE *fp;
+
+  printf("Saving image to file %s... ", file);
+  fflush(stdout);
+
+  if(vector_direct) {
+    if(export_direct(dispview, file, format, background, transparency))
+      return 1;
+    printf("Done!\n");
+  }else {
+    /* Capture the drawing with the OpenGL feedback buffer */
+    viewport[0] = 0;
+    viewport[1] = 0;
+    viewport[2] = win_width;
+    viewport[3] = win_height;
+
+    /* Feedback buffer size (floats), estimated from the model */
+    buffersize = geom_feedback_size(&drawgeom);
+    passes = 0;
+
+    do {
+      /* Truncates any output from a previous attempt */
+      fp = fopen(file, "wb");
+
+      if(!fp){
+	printf("Unable to open file %s for writing\n", file);
+	return 1;
+      }
+
+      gl2psBeginPage(file, "pixie_draw", viewport, format, GL2PS_BSP_SORT,
+		     export_options(background),
+		     GL_RGBA, 0, NULL, 8, 8, 8, 
+		     buffersize, fp, file);
+      if(bsp_candidates > 0)
+	gl2psSetBspRoot(bsp_candidates, bsp_samples);
+
+      draw_scene(export_lod);
+
+      res = gl2psEndPage();
+      fclose(fp);
+      passes++;
+
+      if(res == GL2PS_OVERFLOW) {
+	/* Grow the buffer and try again */
+	if(buffersize >= (1<<30)) {
+	  printf("Failed: feedback buffer overflow\n");
+	  return 1;
+	}
+	buffersize = (buffersize > (1<<29)) ? (1<<30) : 2*buffersize;
+      }
+    }while(res == GL2PS_OVERFLOW);
+
+    printf("Done! (feedback buffer %ld bytes, %d pass%s)\n",
+	   (long) buffersize * (long) sizeof(GLfloat), passes, (passes == 1) ? "" : "es");
+  }
+
+  gl2psGetBspStats(&nodes, &depth, &splits);
+  printf("  BSP tree: %d nodes, depth %d, %d splits\n", nodes, depth, splits);
+  fflush(stdout);
+
+  return 0;
+}
+
+/* Several views exported by a team of threads */
+typedef struct {
+  TCamera *views;
+  char **files;
+  int nviews, next, failed;
+  int format, background, transparency;
+#ifdef HAVE_LIBPTHREAD
+  pthread_mutex_t mutex;
+#endif
+}TExportJobs;
+
+#ifdef HAVE_LIBPTHREAD
+static void *export_worker(void *data)
+{
+  TExportJobs *jobs = (TExportJobs*) data;
+  GLint nodes, depth, splits;
+  int i;
+
+  for(;;) {
+    pthread_mutex_lock(&jobs->mutex);
+    i = jobs->next++;
+    pthread_mutex_unlock(&jobs->mutex);
+    if(i >= jobs->nviews)
+      break;
+
+    if(export_direct(&jobs->views[i], jobs->files[i], jobs->format,
+		     jobs->background, jobs->transparency)) {
+      pthread_mutex_lock(&jobs->mutex);
+      jobs->failed++;
+      pthread_mutex_unlock(&jobs->mutex);
+      continue;
+    }
+    gl2psGetBspStats(&nodes, &depth, &splits);
+    printf("Saved image to file %s (BSP tree: %d nodes, depth %d, %d splits)\n",
+	   jobs->files[i], nodes, depth, splits);
+    fflush(stdout);
+  }
+  return NULL;
+}
+#endif
+
+/* Export each of the views to its own file, named by numbering outfile:
+   view 1 of out.pdf goes to out_1.pdf. Vector output without OpenGL is
+   done by njobs threads at once (0 = one per processor).
+   Returns 0 on success */
+int export_views(TCamera *views, int nviews, int njobs, char *outfile,
+		 int format, int background, int transparency)
+{
+  TExportJobs jobs;
+  char *ext;
+  int i, n;
+#ifdef HAVE_LIBPTHREAD
+  pthread_t *threads;
+#endif
+
+  jobs.views = views;
+  jobs.nviews = nviews;
+  jobs.next = 0;
+  jobs.failed = 0;
+  jobs.format = format;
+  jobs.background = background;
+  jobs.transparency = transparency;
+
+  jobs.files = (char**) malloc(sizeof(char*)*nviews);
+  if(jobs.files == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed\n");
+    exit(1);
+  }
+  if((ext = strrchr(outfile, '.')) == NULL)
+    ext = outfile + strlen(outfile);
+  n = (int) (ext - outfile);
+  for(i=0;i<nviews;i++) {
+    jobs.files[i] = (char*) malloc(strlen(outfile) + 16);
+    if(jobs.files[i] == NULL) {
+      fprintf(stderr, "Error: Memory allocation failed\n");
+      exit(1);
+    }
+    sprintf(jobs.files[i], "%.*s_%d%s", n, outfile, i+1, ext);
+  }
+
+#ifdef HAVE_LIBPTHREAD
+#ifdef _SC_NPROCESSORS_ONLN
+  if(njobs <= 0)
+    njobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if(njobs > nviews)
+    njobs = nviews;
+  if(vector_direct && (njobs > 1)) {
+    printf("Saving %d views with %d threads\n", nviews, njobs);
+    fflush(stdout);
+
+    /* Each view sorts with its own share of the sorting threads, rather
+       than every one of them starting a thread per processor */
+    n = sort_threads;
+#ifdef _SC_NPROCESSORS_ONLN
+    if(n <= 0)
+      n = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    n /= njobs;
+    gl2psSetThreads((n > 1) ? n : 1);
+
+    pthread_mutex_init(&jobs.mutex, NULL);
+    threads = (pthread_t*) malloc(sizeof(pthread_t)*njobs);
+    if(threads == NULL) {
+      fprintf(stderr, "Error: Memory allocation failed\n");
+      exit(1);
+    }
+    /* This thread is one of the team */
+    for(n=1;n<njobs;n++)
+      if(pthread_create(&threads[n], NULL, export_worker, &jobs))
+	break;
+    export_worker(&jobs);
+    for(i=1;i<n;i++)
+      pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&jobs.mutex);
+    gl2psSetThreads(sort_threads);
+  }else
+#endif
+  {
+    /* One at a time, through the current view */
+    for(i=0;i<nviews;i++) {
+      *dispview = views[i];
+      if(!vector_direct)
+	apply_camera();
+      if(export_view(jobs.files[i], format, background, transparency))
+	jobs.failed++;
+    }
+  }
+
+  for(i=0;i<nviews;i++)
+    free(jobs.files[i]);
+  free(jobs.files);
+
+  return (jobs.failed > 0) ? 1 : 0;
+}
+
+/* Catmull-Rom interpolation between b and c at s in [0,1] */
+static double spline(double a, double b, double c, double d, double s)
+{
+  return b + 0.5*s*(c - a + s*(2.*a - 5.*b + 4.*c - d + s*(3.*(b - c) + d - a)));
+}
+
+/* The camera a fraction t in [0,1] of the way along a smooth path
+   through the views, passing through each of them in turn */
+void camera_path(TCamera *views, int nviews, double t, TCamera *cam)
+{
+  TCamera *a, *b, *c, *d;
+  double s;
+  int i;
+
+  if(nviews == 1) {
+    *cam = views[0];
+    camera_position(cam);
+    return;
+  }
+
+  /* Segment from view i to view i+1 */
+  s = t*(nviews - 1);
+  i = (int) s;
+  if(i > nviews - 2)
+    i = nviews - 2;
+  if(i < 0)
+    i = 0;
+  s -= i;
+
+  /* Ends repeat the first and last views */
+  b = &views[i];
+  c = &views[i+1];
+  a = (i > 0) ? &views[i-1] : b;
+  d = (i < nviews-2) ? &views[i+2] : c;
+
+  cam->R     = spline(a->R,     b->R,     c->R,     d->R,     s);
+  cam->theta = spline(a->theta, b->theta, c->theta, d->theta, s);
+  cam->phi   = spline(a->phi,   b->phi,   c->phi,   d->phi,   s);
+  cam->x     = spline(a->x,     b->x,     c->x,     d->x,     s);
+  cam->y     = spline(a->y,     b->y,     c->y,     d->y,     s);
+  cam->z     = spline(a->z,     b->z,     c->z,     d->z,     s);
+  camera_position(cam);
+}
+
+/* Render nframes images along the camera path through the views into
+   the current (offscreen) context, and save them numbered from outfile
+   or piped into command. Returns 0 on success */
+int render_frames(TCamera *views, int nviews, int nframes, int njobs,
+		  char *outfile, char *command)
+{
+  struct timeval start, now;
+  double secs;
+  int i, ret = 0;
+
+  if(frames_begin(outfile, command, win_width, win_height, nframes, njobs))
+    return 1;
+
+  if(command != NULL)
+    printf("Rendering %d frames into '%s'\n", nframes, command);
+  else
+    printf("Rendering %d frames to %s\n", nframes, outfile);
+  fflush(stdout);
+
+  gettimeofday(&start, NULL);
+  for(i=0;i<nframes;i++) {
+    camera_path(views, nviews, (nframes > 1) ? (double) i / (nframes - 1) : 0.0, dispview);
+    apply_camera();
+    draw_scene(export_lod);
+    if(frames_add()) {
+      ret = 1;
+      break;
+    }
+    if(((i+1) % 25 == 0) || (i+1 == nframes)) {
+      printf("\r  %d / %d", i+1, nframes);
+      fflush(stdout);
+    }
+  }
+  if(frames_end())
+    ret = 1;
+
+  gettimeofday(&now, NULL);
+  secs = (now.tv_sec - start.tv_sec) + 1e-6*(now.tv_usec - start.tv_usec);
+  if(ret)
+    printf("\nFailed after %d frames\n", i);
+  else
+    printf("\nDone! (%.1f frames/s)\n", (secs > 0.0) ? nframes / secs : 0.0);
+  fflush(stdout);
+
+  return ret;
+}
+
+/* Output formats, by name */
+static struct {
+  char *name;
+  int format;
+}format_table[] = { {"PS",  GL2PS_PS},
+		    {"EPS", GL2PS_EPS},
+		    {"TEX", GL2PS_TEX},
+		    {"PDF", GL2PS_PDF},
+		    {"SVG", GL2PS_SVG},
+		    {"PGF", GL2PS_PGF},
+		    {NULL}};
+
+static int find_format(char *name)
+{
+  int i;
+  for(i=0;format_table[i].name != NULL;i++)
+    if(strcasecmp(name, format_table[i].name) == 0)
+      return format_table[i].format;
+  return -1;
+}
+
+static void batch_usage(char *prog)
+{
+  printf("Usage: %s --render <model file> [options]\n", prog);
+  printf("Options:\n");
+  printf("  --camera R,theta,phi  Camera distance and angles (degrees). Repeat\n");
+  printf("                        for several views, saved as <file>_1 etc.\n");
+  printf("                        Add ,x,y,z to set this view's focus\n");
+  printf("  --focus x,y,z         Point the camera is looking at\n");
+  printf("  --frames N            Save N images along a smooth path through\n");
+  printf("                        the views, to <file>_0001.png (or .ppm) etc.\n");
+  printf("  --pipe <command>      Write the frames into a command as PPM images\n");
+  printf("  --size WxH            Image size (default 640x640)\n");
+  printf("  --format <fmt>        One of ps, eps, tex, pdf, svg, pgf\n");
+  printf("  --background          Draw a white background\n");
+  printf("  --alpha               Enable transparency\n");
+  printf("  --feedback            Capture output with OpenGL feedback\n");
+  printf("  --compress            Compress the output (gzip, or deflate for PDF)\n");
+  printf("  --threads N           Threads for building and sorting (default one per CPU)\n");
+  printf("  --jobs N              Views to save at once, or threads saving\n");
+  printf("                        frames (default one per CPU)\n");
+  printf("  --bsp K,S             Choose BSP splitting planes from K candidates\n");
+  printf("                        tested against S sampled primitives\n");
+  printf("  --lod P               Reduce detail where the error is under P pixels\n");
+  printf("  -o <file>             Output file (default draw_out.<ext>)\n");
+}
+
+/* Render a model straight to file using an offscreen context.
+   Never initialises GLUT, so works without a display */
+int batch_render(int argc, char **argv)
+{
+  int i;
+  int width = 640, height = 640;
+  int format = -1;
+  int background = 0, transparency = 0;
+  TCamera views[MAX_VIEWS];
+  int focused[MAX_VIEWS]; /* View has its own focus */
+  int nviews = 0, njobs = 0, nframes = 0;
+  double R, theta, phi;
+  double x = 0.0, y = 0.0, z = 0.0;
+  char *outfile = NULL, *ext, *command = NULL;
+  char file[256];
+  int ret;
+
+  if(argc < 3) {
+    batch_usage(argv[0]);
+    return(1);
+  }
+  strncpy(modelfile, argv[2], 255);
+
+  for(i=3;i<argc;i++) {
+    if((strcmp(argv[i], "--camera") == 0) && (i+1 < argc)) {
+      if(nviews == MAX_VIEWS) {
+	fprintf(stderr, "Error: At most %d views\n", MAX_VIEWS);
+	return(1);
+      }
+      ret = sscanf(argv[++i], "%lf,%lf,%lf,%lf,%lf,%lf", &R, &theta, &phi,
+		   &views[nviews].x, &views[nviews].y, &views[nviews].z);
+      if((ret != 3) && (ret != 6)) {
+	fprintf(stderr, "Error: Syntax is '--camera R,theta,phi[,x,y,z]' e.g. '--camera 5,30,20'\n");
+	return(1);
+      }
+      views[nviews].R = R;
+      views[nviews].theta = theta*PI/180.;
+      views[nviews].phi = phi*PI/180.;
+      focused[nviews] = (ret == 6);
+      nviews++;
+    }else if((strcmp(argv[i], "--focus") == 0) && (i+1 < argc)) {
+      if(sscanf(argv[++i], "%lf,%lf,%lf", &x, &y, &z) != 3) {
+	fprintf(stderr, "Error: Syntax is '--focus x,y,z' e.g. '--focus 0,0.5,0'\n");
+	return(1);
+      }
+    }else if((strcmp(argv[i], "--size") == 0) && (i+1 < argc)) {
+      if((sscanf(argv[++i], "%dx%d", &width, &height) != 2) || (width <= 0) || (height <= 0)) {
+	fprintf(stderr, "Error: Syntax is '--size WxH' e.g. '--size 800x600'\n");
+	return(1);
+      }
+    }else if((strcmp(argv[i], "--format") == 0) && (i+1 < argc)) {
+      if((format = find_format(argv[++i])) < 0) {
+	fprintf(stderr, "Error: Unknown output format '%s'\n", argv[i]);
+	return(1);
+      }
+    }else if(strcmp(argv[i], "--background") == 0) {
+      background = 1;
+    }else if(strcmp(argv[i], "--alpha") == 0) {
+      transparency = 1;
+    }else if(strcmp(argv[i], "--feedback") == 0) {
+      vector_direct = 0;
+    }else if(strcmp(argv[i], "--compress") == 0) {
+#ifdef HAVE_LIBZ
+      compress_output = 1;
+#else
+      fprintf(stderr, "Warning: Compiled without zlib, so output will not be compressed\n");
+#endif
+    }else if((strcmp(argv[i], "--bsp") == 0) && (i+1 < argc)) {
+      if((sscanf(argv[++i], "%d,%d", &bsp_candidates, &bsp_samples) != 2) ||
+	 (bsp_candidates < 0) || (bsp_samples < 0)) {
+	fprintf(stderr, "Error: Syntax is '--bsp K,S' e.g. '--bsp 8,64'\n");
+	return(1);
+      }
+    }else if((strcmp(argv[i], "--lod") == 0) && (i+1 < argc)) {
+      if((sscanf(argv[++i], "%f", &export_lod) != 1) || (export_lod < 0.0)) {
+	fprintf(stderr, "Error: Syntax is '--lod P' e.g. '--lod 0.5'\n");
+	return(1);
+      }
+    }else if((strcmp(argv[i], "--threads") == 0) && (i+1 < argc)) {
+      sort_threads = atoi(argv[++i]);
+      gl2psSetThreads(sort_threads);
+      geom_set_threads(sort_threads);
+    }else if((strcmp(argv[i], "--jobs") == 0) && (i+1 < argc)) {
+      njobs = atoi(argv[++i]);
+    }else if((strcmp(argv[i], "--frames") == 0) && (i+1 < argc)) {
+      if((sscanf(argv[++i], "%d", &nframes) != 1) || (nframes <= 0)) {
+	fprintf(stderr, "Error: Syntax is '--frames N' e.g. '--frames 100'\n");
+	return(1);
+      }
+    }else if((strcmp(argv[i], "--pipe") == 0) && (i+1 < argc)) {
+      command = argv[++i];
+    }else if((strcmp(argv[i], "-o") == 0) && (i+1 < argc)) {
+      outfile = argv[++i];
+    }else {
+      fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+      batch_usage(argv[0]);
+      return(1);
+    }
+  }
+
+  if(format < 0) {
+    /* Guess from output file extension */
+    format = GL2PS_PS;
+    if((outfile != NULL) && ((ext = strrchr(outfile, '.')) != NULL))
+      if((format = find_format(ext+1)) < 0)
+	format = GL2PS_PS;
+  }
+  if(outfile == NULL) {
+    if(nframes > 0)
+#ifdef HAVE_LIBZ
+      sprintf(file, "draw_out.png");
+#else
+      sprintf(file, "draw_out.ppm");
+#endif
+    else
+      sprintf(file, "draw_out.%s", gl2psGetFileExtension(format));
+    outfile = file;
+  }
+  if((command != NULL) && (nframes == 0)) {
+    fprintf(stderr, "Error: --pipe needs --frames\n");
+    return(1);
+  }
+
+  if(model_load(&drawmodel, modelfile))
+    return(1);
+  geom_build(&drawgeom, &drawmodel);
+
+  if(nviews == 0) {
+    views[0].R = 5.0;
+    views[0].theta = views[0].phi = 0.0;
+    focused[0] = 0;
+    nviews = 1;
+  }
+  for(i=0;i<nviews;i++) {
+    if(focused[i])
+      continue;
+    views[i].x = x;
+    views[i].y = y;
+    views[i].z = z;
+  }
+  *dispview = views[0];
+
+  win_width = width;
+  win_height = height;
+
+  if(!vector_direct || (nframes > 0)) {
+    /* Need an OpenGL context to draw into the feedback buffer, or to render frames */
+    if(offscreen_init(width, height)) {
+      geom_free(&drawgeom);
+      model_free(&drawmodel);
+      return(1);
+    }
+    init();
+    if(background)
+      glClearColor( 1.0, 1.0, 1.0, 0.0 );
+    if(transparency) {
+      glEnable(GL_BLEND);
+      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      blending = 1;
+    }
+
+    set_projection(width, height);
+    apply_camera();
+  }
+
+  if(nframes > 0)
+    ret = render_frames(views, nviews, nframes, njobs, outfile, command);
+  else if(nviews == 1)
+    ret = export_view(outfile, format, background, transparency);
+  else
+    ret = export_views(views, nviews, njobs, outfile, format, background, transparency);
+
+  geom_free(&drawgeom);
+  if(!vector_direct || (nframes > 0))
+    offscreen_free();
+  model_free(&drawmodel);
+
+  return(ret);
+}
+
 /**********************************************************************
  * Keyboard and Mouse handlers
  * 
@@ -576,10 +1092,9 @@ void keyboard (unsigned char key, int x, int y)
 {
   static int background = 0;
   static int transparency = 0;
-  int opt;
   char file[256];
-  GLint viewport[4];
-  FILE *fp;
+  TModel newmodel;
+  int n;
   
   static int format = GL2PS_PS;
 
@@ -616,7 +1131,7 @@ void keyboard (unsigned char key, int x, int y)
       glClearColor( 0.0, 0.0, 0.0, 0.0 );
       background = 0;
     }
-    glutPostRedisplay();
+    request_redraw();
     break;
     }
   case 'a': {
@@ -624,17 +1139,17 @@ void keyboard (unsigned char key, int x, int y)
       /* Enable transparency */
 
       glEnable(GL_BLEND);
-      glDisable(GL_DEPTH_TEST); /* hack for when no sorting */
       glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
       transparency = 1;
+      blending = 1;
       printf("Transparency enabled\n");
     }else {
       glDisable(GL_BLEND);
-      glEnable(GL_DEPTH_TEST); /* This is a hack for alpha*/
       transparency = 0;
+      blending = 0;
       printf("Transparency disabled\n");
     }
-    display(); /* re-draw */
+    request_redraw();
     break;
   }
   case 'f': { // Change output format
@@ -649,38 +1164,37 @@ void keyboard (unsigned char key, int x, int y)
     break;
   }
   case 'p': { // print to file
-    
-    opt = GL2PS_OCCLUSION_CULL;
-    if(background)
-      opt |= GL2PS_DRAW_BACKGROUND;
-    
     sprintf(file, "draw_out.%s",gl2psGetFileExtension(format));
-
-    viewport[0] = 0;
-    viewport[1] = 0;
-    viewport[2] = win_width;
-    viewport[3] = win_height;
-
-    fp = fopen(file, "wb");
-
-    if(!fp){
-      printf("Unable to open file %s for writing\n", file);
-      break;
+    export_view(file, format, background, transparency);
+    break;
+  }
+  case 'o': {
+    blend_weighted = !blend_weighted;
+    if(blend_weighted)
+      printf("Transparency approximated by weighted blending\n");
+    else
+      printf("Transparency sorted back to front\n");
+    if(blending)
+      request_redraw();
+    break;
+  }
+  case 'd': {
+    if(view_lod > 0.0) {
+      view_lod = 0.0;
+      printf("Always drawing at full detail\n");
+    }else {
+      view_lod = VIEW_LOD_ERROR;
+      printf("Reducing detail where the error is under %g pixels\n", view_lod);
     }
-    printf("Saving image to file %s... ", file);
-    fflush(stdout);
-    
-    gl2psBeginPage(file, "pixie_draw", viewport, format, GL2PS_BSP_SORT, opt,
-                   GL_RGBA, 0, NULL, 8, 8, 8, 
-                   10*1024*1024, fp, file);
-
-    display();
-    
-    gl2psEndPage();
-
-    printf("Done!\n");
-    fflush(stdout);
-
+    request_redraw();
+    break;
+  }
+  case 'v': {
+    vector_direct = !vector_direct;
+    if(vector_direct)
+      printf("Printing projects the model directly\n");
+    else
+      printf("Printing uses the OpenGL feedback buffer\n");
     break;
   }
   case 'l': {
@@ -691,8 +1205,18 @@ void keyboard (unsigned char key, int x, int y)
     modelfile[strlen(modelfile)-1] = '\0';
   }
   case 'r': {
+    /* Only the items which changed are built again. If the file
+       can't be read, keep the model as it was */
+    newmodel.nitems = 0;
+    if(model_load(&newmodel, modelfile)) {
+      model_free(&newmodel);
+      break;
+    }
+    n = geom_update(&drawgeom, &drawmodel, &newmodel);
+    printf("Reloaded %s: %d of %d items rebuilt\n", modelfile, n, newmodel.nitems);
     model_free(&drawmodel);
-    model_load(&drawmodel, modelfile);
+    drawmodel = newmodel;
+    request_redraw();
     break;
   }
   case '?':
@@ -706,10 +1230,13 @@ void keyboard (unsigned char key, int x, int y)
     printf("  b        - flip background color\n");
     printf("  c        - centre camera on origin\n");
     printf("  C        - reset camera\n");
+    printf("  d        - switch level of detail on/off\n");
     printf("  f        - change output format\n");
     printf("  l        - Load a model\n");
+    printf("  o        - switch transparency between sorted and weighted\n");
     printf("  p        - print the current view to file\n");
     printf("  r        - Reload model from file\n");
+    printf("  v        - switch printing between direct and OpenGL feedback\n");
     printf("  x or -   - zoom out\n");
     printf("  z or +   - zoom in\n");
     break;
@@ -771,98 +1298,3 @@ void specialkey (int key, int x, int y)
     break;
   };
 }
-
-/*************************************************************************
- * Integrate a function using QROMB method
- *************************************************************************/
-
-/* Fractional error, determined by extrapolation error */
-#define EPS 1.0e-6
-/* Maximum number of steps */
-#define JMAX 20
-#define JMAXP (JMAX+1)
-/* Number of points to use in extrapolation */
-#define K 5
-
-/* Integrate function from a to b */
-float qromb(float (*func)(float, void*), float a, float b, void *params)
-{
-  float ss, dss;
-  float s[JMAXP], h[JMAXP+1];
-  int j;
-  
-  h[0] = 1.0;
-  for(j=0;j!=JMAX;j++) {
-    s[j] = trapzd(func, a, b, j+1, params);
-    if(j > K) {
-      polint(&h[j-K], &s[j-K], 0.0, &ss, &dss);
-      if(fabs(dss) <= EPS*fabs(ss)) return(ss);
-      if(fabs(ss) < 1.0e-14) {
-	printf("Value of function within rounding errors\n");
-	return(0.0);
-      }
-    }
-    h[j+1] = 0.25*h[j];
-  }
-  printf("Too many steps in function qromb\n");
-  return(0.0);
-}
-
-#define FUNC(x, p) ((*func)(x, p))
-
-/* Call with n=1 returns crudest estimate, subsequent calls improve accuracy by adding 2^(n-2) additional points */
-float trapzd(float (*func)(float, void*), float a, float b, int n, void *p)
-{
-  float x, tnm, sum, del;
-  static float s;
-  int it, j;
-  
-  if(n == 1) {
-    s = 0.5*(b-a)*(FUNC(a, p)+FUNC(b, p));
-  }else {
-    for(it=1,j=1;j<(n-1);j++) it <<= 1;
-    tnm = it;
-    del = (b-a)/tnm;
-    x = a+0.5*del;
-    for(sum=0.0,j=1;j<=it;j++,x+=del) sum += FUNC(x, p);
-    s = 0.5*(s+(b-a)*sum/tnm); /* refine s */
-  }
-  return(s);
-}
-
-#define POL_N K
-
-/* Polynomial interpolation/extrapolation: Input xa and ya, returns value y at x with error estimate dy */
-void polint(float *xa, float *ya, float x, float *y, float *dy)
-{
-  int i, m, ns=0;
-  float den, dif, dift, ho, hp, w;
-  float c[POL_N], d[POL_N];
-  
-  dif = fabs(x - xa[0]);
-  for(i=1;i<=POL_N;i++) {
-    /* Find closest index */
-    if((dift = fabs(x - xa[i-1])) < dif) {
-      ns = i;
-      dif = dift;
-    }
-    c[i-1] = ya[i-1];
-    d[i-1] = ya[i-1];
-  }
-  
-  *y = ya[ns--];
-  for(m=1;m<POL_N;m++) {
-    for(i=1;i<=(POL_N-m);i++) {
-      ho = xa[i-1] - x;
-      hp = xa[i+m-1] - x;
-      w = c[i] - d[i-1];
-      /* Two xa's within roundoff */
-      if( (den = ho-hp) == 0.0) printf("problem in polint\n");
-      den = w / den;
-      d[i-1] = hp*den;
-      c[i-1] = ho*den;
-    }
-    *y += (*dy=(2*ns < (POL_N-m) ? c[ns] : d[(ns--)-1]));
-  }
-}
-
@@ -7,6 +7,11 @@
 
 #define PI 3.141592653589793
 
+/* Perspective projection: field of view (degrees) and clipping planes */
+#define CAMERA_FOV  80.0
+#define CAMERA_NEAR 1.0
+#define CAMERA_FAR  1000.0
+
 /* Structure storing a viewpoint */
 typedef struct {
   /* POSITION OF CAMERA - SPHERICAL COORDS */
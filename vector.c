@@ -0,0 +1,340 @@
+/*************************************************************************************
+ * vector.c: Vector output straight from the cached geometry
+ *
+ * Rather than drawing into the OpenGL feedback buffer and having gl2ps
+ * parse it, the cached vertices are transformed by the camera and
+ * perspective matrices, clipped, and handed to gl2ps as primitives.
+ * This doesn't need an OpenGL context, and memory use grows with the
+ * size of the model rather than being limited by a fixed buffer.
+ *
+ * Copyright (c) 2009 B.Dudson, University of York <bd512@york.ac.uk>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the Software
+ * is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+ * PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ *************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "gl2ps.h"
+
+#include "vector.h"
+
+/* Maximum vertices in a polygon after clipping against 6 planes */
+#define MAX_CLIP_VERTS 16
+
+/* Vertex in homogeneous clip coordinates */
+typedef struct {
+  double p[4];
+  float rgba[4];
+}TClipVertex;
+
+/************* Matrices **************/
+
+/* Product c = a*b of row-major 4x4 matrices */
+static void mat_mult(double a[16], double b[16], double c[16])
+{
+  int i, j, k;
+  for(i=0;i<4;i++)
+    for(j=0;j<4;j++) {
+      c[4*i+j] = 0.0;
+      for(k=0;k<4;k++)
+	c[4*i+j] += a[4*i+k]*b[4*k+j];
+    }
+}
+
+/* Combined perspective and viewing matrix (row-major), equivalent to the
+   gluPerspective and gluLookAt calls in set_projection and apply_camera.
+   The camera location (cx, cy, cz) must be up to date */
+void camera_matrix(TCamera *cam, int width, int height, double m[16])
+{
+  double view[16], proj[16];
+  double f[3], s[3], u[3], len, aspect, cot;
+  int i;
+
+  /* Viewing direction */
+  f[0] = cam->x - cam->cx;
+  f[1] = cam->y - cam->cy;
+  f[2] = cam->z - cam->cz;
+  len = sqrt(f[0]*f[0] + f[1]*f[1] + f[2]*f[2]);
+  for(i=0;i<3;i++)
+    f[i] /= len;
+
+  /* s = f x up, with up = (0, 1, 0) */
+  s[0] = -f[2];
+  s[1] = 0.0;
+  s[2] = f[0];
+  len = sqrt(s[0]*s[0] + s[2]*s[2]);
+  for(i=0;i<3;i++)
+    s[i] /= len;
+
+  /* u = s x f */
+  u[0] = s[1]*f[2] - s[2]*f[1];
+  u[1] = s[2]*f[0] - s[0]*f[2];
+  u[2] = s[0]*f[1] - s[1]*f[0];
+
+  memset(view, 0, sizeof(double)*16);
+  for(i=0;i<3;i++) {
+    view[i]   = s[i];
+    view[4+i] = u[i];
+    view[8+i] = -f[i];
+  }
+  view[3]  = -(s[0]*cam->cx + s[1]*cam->cy + s[2]*cam->cz);
+  view[7]  = -(u[0]*cam->cx + u[1]*cam->cy + u[2]*cam->cz);
+  view[11] =  (f[0]*cam->cx + f[1]*cam->cy + f[2]*cam->cz);
+  view[15] = 1.0;
+
+  aspect = (height == 0) ? ((double) width) : ((double) width) / ((double) height);
+  cot = 1.0 / tan(0.5*CAMERA_FOV*PI/180.);
+
+  memset(proj, 0, sizeof(double)*16);
+  proj[0]  = cot / aspect;
+  proj[5]  = cot;
+  proj[10] = (CAMERA_FAR + CAMERA_NEAR) / (CAMERA_NEAR - CAMERA_FAR);
+  proj[11] = 2.0*CAMERA_FAR*CAMERA_NEAR / (CAMERA_NEAR - CAMERA_FAR);
+  proj[14] = -1.0;
+
+  mat_mult(proj, view, m);
+}
+
+static void transform_vertex(double m[16], TVertex *v, TClipVertex *c)
+{
+  int i;
+  for(i=0;i<4;i++)
+    c->p[i] = m[4*i]*v->x + m[4*i+1]*v->y + m[4*i+2]*v->z + m[4*i+3];
+  c->rgba[0] = v->r;
+  c->rgba[1] = v->g;
+  c->rgba[2] = v->b;
+  c->rgba[3] = v->a;
+}
+
+/************* Clipping **************/
+
+/* Signed distance inside clip plane k (0..5): w +/- x, y or z */
+static double clip_dist(TClipVertex *v, int k)
+{
+  if(k & 1)
+    return v->p[3] - v->p[k>>1];
+  return v->p[3] + v->p[k>>1];
+}
+
+static void clip_interp(TClipVertex *a, TClipVertex *b, double t, TClipVertex *out)
+{
+  int i;
+  for(i=0;i<4;i++) {
+    out->p[i] = a->p[i] + t*(b->p[i] - a->p[i]);
+    out->rgba[i] = a->rgba[i] + t*(b->rgba[i] - a->rgba[i]);
+  }
+}
+
+/* Clip a polygon against the view volume. Returns new number of vertices */
+static int clip_polygon(TClipVertex *in, int n, TClipVertex *tmp)
+{
+  int k, i, m;
+  double d0, d1;
+  TClipVertex *src, *dst, *swap, *a, *b;
+
+  src = in;
+  dst = tmp;
+  for(k=0;(k<6) && (n > 0);k++) {
+    m = 0;
+    for(i=0;i<n;i++) {
+      a = &src[i];
+      b = &src[(i+1) % n];
+      d0 = clip_dist(a, k);
+      d1 = clip_dist(b, k);
+      if(d0 >= 0.0)
+	dst[m++] = *a;
+      if((d0 >= 0.0) != (d1 >= 0.0))
+	clip_interp(a, b, d0 / (d0 - d1), &dst[m++]);
+    }
+    n = m;
+    swap = src; src = dst; dst = swap;
+  }
+  if(src != in)
+    memcpy(in, src, sizeof(TClipVertex)*n);
+  return n;
+}
+
+/* Clip a line segment. Returns 0 if entirely outside */
+static int clip_line(TClipVertex *a, TClipVertex *b)
+{
+  int k;
+  double d0, d1, t0 = 0.0, t1 = 1.0, t;
+  TClipVertex a0, b0;
+
+  for(k=0;k<6;k++) {
+    d0 = clip_dist(a, k);
+    d1 = clip_dist(b, k);
+    if((d0 < 0.0) && (d1 < 0.0))
+      return 0;
+    if((d0 < 0.0) || (d1 < 0.0)) {
+      t = d0 / (d0 - d1);
+      if(d0 < 0.0) {
+	if(t > t0) t0 = t;
+      }else if(t < t1)
+	t1 = t;
+    }
+  }
+  if(t0 > t1)
+    return 0;
+
+  a0 = *a;
+  b0 = *b;
+  clip_interp(&a0, &b0, t0, a);
+  clip_interp(&a0, &b0, t1, b);
+  return 1;
+}
+
+/************* Output **************/
+
+/* Convert to window coordinates, as in the feedback buffer */
+static void window_vertex(TClipVertex *c, int viewport[4], GL2PSvertex *v)
+{
+  v->xyz[0] = viewport[0] + 0.5*viewport[2]*(c->p[0]/c->p[3] + 1.0);
+  v->xyz[1] = viewport[1] + 0.5*viewport[3]*(c->p[1]/c->p[3] + 1.0);
+  v->xyz[2] = 0.5*(c->p[2]/c->p[3] + 1.0);
+  memcpy(v->rgba, c->rgba, sizeof(GL2PSrgba));
+}
+
+/* Clip a polygon and split it into a fan of triangles, the same as the
+   feedback buffer parser does */
+static int add_polygon(TClipVertex *poly, int n, int viewport[4])
+{
+  TClipVertex tmp[MAX_CLIP_VERTS];
+  GL2PSvertex verts[3];
+  int i;
+
+  n = clip_polygon(poly, n, tmp);
+  if(n < 3)
+    return 0;
+
+  window_vertex(&poly[0], viewport, &verts[0]);
+  window_vertex(&poly[1], viewport, &verts[1]);
+  for(i=2;i<n;i++) {
+    window_vertex(&poly[i], viewport, &verts[2]);
+    gl2psAddPolyPrimitive(GL2PS_TRIANGLE, 3, verts, 0, 0, 0, 1, 0);
+    verts[1] = verts[2];
+  }
+  return n-2;
+}
+
+static int add_line(TClipVertex *a, TClipVertex *b, int viewport[4])
+{
+  TClipVertex ca, cb;
+  GL2PSvertex verts[2];
+
+  ca = *a;
+  cb = *b;
+  if(!clip_line(&ca, &cb))
+    return 0;
+
+  window_vertex(&ca, viewport, &verts[0]);
+  window_vertex(&cb, viewport, &verts[1]);
+  gl2psAddPolyPrimitive(GL2PS_LINE, 2, verts, 0, 0, 0, 1, 0);
+  return 1;
+}
+
+/* Add all cached geometry to the current gl2ps page, which should have
+   been started with GL2PS_NO_OPENGL_CONTEXT. Each item is within maxerr
+   pixels of full resolution (see geom_lod). Returns number of primitives */
+int vector_add_geometry(TGeometry *geom, TCamera *cam, int viewport[4], float maxerr)
+{
+  double m[16];
+  int i, j, k, n, nv, nprim = 0;
+  TGeomItem *g;
+  TVertex rv;
+  TClipVertex *cv, *v, poly[MAX_CLIP_VERTS];
+
+  camera_matrix(cam, viewport[2], viewport[3], m);
+
+  for(i=0;i<geom->nitems;i++) {
+    g = geom_lod(&geom->item[i], cam, viewport[3], maxerr);
+    if(g->nverts <= 0)
+      continue;
+
+    /* Transform all vertices of this item. Surfaces are swept out from
+       their cross-section first */
+    nv = (g->rows > 0) ? g->rows*g->cols : g->nverts;
+    cv = (TClipVertex*) malloc(sizeof(TClipVertex)*nv);
+    if(cv == NULL) {
+      fprintf(stderr, "Error: Memory allocation failed\n");
+      exit(1);
+    }
+
+    /* Field-lines may be copies of one line, rotated about the axis */
+    for(n=0;n<((g->ninstances > 0) ? g->ninstances : 1);n++) {
+      for(j=0;j<nv;j++) {
+	if(g->rows > 0)
+	  geom_grid_vertex(g, j / g->cols, j % g->cols, &rv);
+	else
+	  geom_instance_vertex(g, n, &g->vert[j], &rv);
+	transform_vertex(m, &rv, &cv[j]);
+      }
+
+      /* Grids go row by row as quads, like quad strips. This sorts
+	 into a smaller BSP tree than the order of the indices, which
+	 is chosen for the vertex cache */
+      if(g->rows > 0)
+	for(j=0;j<g->rows+g->wraprows-1;j++)
+	  for(k=0;k<g->cols+g->wrapcols-1;k++) {
+	    poly[0] = cv[j*g->cols + k];
+	    poly[1] = cv[((j+1) % g->rows)*g->cols + k];
+	    poly[2] = cv[((j+1) % g->rows)*g->cols + (k+1) % g->cols];
+	    poly[3] = cv[j*g->cols + (k+1) % g->cols];
+	    nprim += add_polygon(poly, 4, viewport);
+	  }
+
+      for(j=0;j<g->nstrips;j++) {
+	v = cv + g->first[j];
+	switch(g->mode) {
+	case GL_QUAD_STRIP: {
+	  for(k=0;k<g->count[j]/2-1;k++) {
+	    poly[0] = v[2*k];
+	    poly[1] = v[2*k+1];
+	    poly[2] = v[2*k+3];
+	    poly[3] = v[2*k+2];
+	    nprim += add_polygon(poly, 4, viewport);
+	  }
+	  break;
+	}
+	case GL_QUADS: {
+	  for(k=0;k<g->count[j]/4;k++) {
+	    memcpy(poly, v + 4*k, sizeof(TClipVertex)*4);
+	    nprim += add_polygon(poly, 4, viewport);
+	  }
+	  break;
+	}
+	case GL_LINE_STRIP: {
+	  for(k=0;k<g->count[j]-1;k++)
+	    nprim += add_line(&v[k], &v[k+1], viewport);
+	  break;
+	}
+	default: {
+	  fprintf(stderr, "Warning: Primitive type 0x%x not supported in vector output\n", g->mode);
+	}
+	}
+      }
+    }
+
+    free(cv);
+  }
+  return nprim;
+}
@@ -0,0 +1,14 @@
+/*****************************************************************
+ * Vector output without the OpenGL feedback buffer
+ *****************************************************************/
+
+#ifndef __VECTOR_H__
+#define __VECTOR_H__
+
+#include "geometry.h"
+#include "tokamak_draw.h"
+
+void camera_matrix(TCamera *cam, int width, int height, double m[16]);
+int vector_add_geometry(TGeometry *geom, TCamera *cam, int viewport[4], float maxerr);
+
+#endif /* __VECTOR_H__ */